@@ -95,6 +95,11 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_ALIGNED  0x40
+
+int ram_save_page_aligned = 0;
+int64_t ram_save_section_offset;
+int ram_load_mmap_fd = -1;
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -180,6 +185,56 @@ static int ram_save_block(QEMUFile *f)
 
 static uint64_t bytes_transferred;
 
+/* Only blocks made of whole host pages can be mapped straight from the file */
+static int ram_block_mappable(RAMBlock *block)
+{
+    return (block->length & (qemu_real_host_page_size - 1)) == 0;
+}
+
+/* Write every mappable block whole, each starting on a host page boundary
+ * of the file, and clear its dirty bits so ram_save_block skips it. */
+static uint64_t ram_save_aligned_blocks(QEMUFile *f)
+{
+    static const uint8_t zeroes[4096];
+    RAMBlock *block;
+    uint64_t bytes_sent = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        int64_t pos;
+        uint32_t pad;
+        ram_addr_t done;
+
+        if (!ram_block_mappable(block)) {
+            continue;
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_ALIGNED);
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+
+        /* f is a temporary file that is later copied into the snapshot,
+           so pad against where the block will land there.  The pad length
+           is written out so the loader never has to guess it. */
+        pos = ram_save_section_offset + qemu_ftell(f) + 4;
+        pad = (qemu_real_host_page_size - (pos & (qemu_real_host_page_size - 1)))
+              & (qemu_real_host_page_size - 1);
+        qemu_put_be32(f, pad);
+        while (pad > 0) {
+            int n = MIN(sizeof(zeroes), pad);
+            qemu_put_buffer(f, zeroes, n);
+            pad -= n;
+        }
+        for (done = 0; done < block->length; done += TARGET_PAGE_SIZE) {
+            qemu_put_buffer(f, block->host + done, TARGET_PAGE_SIZE);
+        }
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        MIGRATION_DIRTY_FLAG);
+        bytes_sent += block->length;
+    }
+    return bytes_sent;
+}
+
 static ram_addr_t ram_save_remaining(void)
 {
     RAMBlock *block;
@@ -298,6 +353,10 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
             qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
             qemu_put_be64(f, block->length);
         }
+
+        if (ram_save_page_aligned) {
+            bytes_transferred += ram_save_aligned_blocks(f);
+        }
     }
 
     bytes_transferred_last = bytes_transferred;
@@ -374,6 +433,63 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* Load a block written by ram_save_aligned_blocks.  If we have the
+ * snapshot's fd, map the block copy-on-write over guest RAM so pages are
+ * only read when the guest first touches them; otherwise copy it. */
+static int ram_load_aligned_block(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+    ram_addr_t length, done;
+    uint32_t pad;
+    int64_t pos;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    length = qemu_get_be64(f);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block || block->length != length) {
+        fprintf(stderr, "Can't load aligned block %s!\n", id);
+        return -EINVAL;
+    }
+
+    pad = qemu_get_be32(f);
+    pos = qemu_ftell(f) + pad;
+
+#ifndef _WIN32
+    /* the block is only mappable if it really landed page aligned in the
+       file, e.g. not when the snapshot was streamed through a migration */
+    if (ram_load_mmap_fd >= 0 && !kvm_enabled() &&
+        !(pos & (qemu_real_host_page_size - 1))) {
+        void *host = mmap(block->host, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, ram_load_mmap_fd, pos);
+        if (host == block->host) {
+            qemu_fseek(f, pos + length, SEEK_SET);
+            return 0;
+        }
+        fprintf(stderr, "mmap of block %s failed, copying instead\n", id);
+    }
+#endif
+
+    /* no fd (or the map failed): skip the padding and copy page by page */
+    while (pad-- > 0) {
+        qemu_get_byte(f);
+    }
+    for (done = 0; done < length; done += TARGET_PAGE_SIZE) {
+        if (qemu_get_buffer(f, block->host + done, TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -463,6 +579,11 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = host_from_stream_offset(f, addr, flags);
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_ALIGNED) {
+            error = ram_load_aligned_block(f);
+            if (error) {
+                return error;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
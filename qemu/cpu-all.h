@@ -543,6 +543,10 @@ extern int mem_prealloc;
 #define TLB_NOTDIRTY    (1 << 4)
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
+/* Set if a filtered PANDA memory callback watches the page.  The softmmu
+   helpers ignore it when called from instrumented code and otherwise have
+   the accessing code retranslated (panda_memcb_retranslate).  */
+#define TLB_PANDA_MEMCB (1 << 6)
 
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
@@ -115,7 +115,10 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* Guest physical page of each tlb_table entry, for PANDA memory    \
+       callbacks. Only meaningful while the entry itself is valid.  */  \
+    target_phys_addr_t tlb_phys[NB_MMU_MODES][CPU_TLB_SIZE];
 
 #else
 
@@ -138,7 +138,7 @@ static TranslationBlock *tb_find_slow(CPUState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    panda_cb_list *plist;
+    panda_cb_entry *plist;
     TranslationBlock *tb, **ptb1;
     unsigned int h;
     tb_page_addr_t phys_pc, phys_page1;
@@ -156,6 +156,7 @@ static TranslationBlock *tb_find_slow(CPUState *env,
         if (!tb)
             goto not_found;
         if (tb->pc == pc &&
+            tb->rr_max_insns == 0 &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
             tb->flags == flags) {
@@ -177,13 +178,13 @@ static TranslationBlock *tb_find_slow(CPUState *env,
  not_found:
    /* if no translated code available, then translate it now */
 
-    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_TRANSLATE) {
         plist->entry.before_block_translate(env, pc);
     }
 
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
-    for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_BLOCK_TRANSLATE) {
         plist->entry.after_block_translate(env, tb);
     }
 
@@ -199,6 +200,52 @@ static TranslationBlock *tb_find_slow(CPUState *env,
     return tb;
 }
 
+#ifdef CONFIG_SOFTMMU
+/* Replay: find or translate a copy of orig_tb that stops after max_insns
+   guest instructions, so that an interrupt lands on a block boundary.
+   The full-length block stays cached (and in tb_jmp_cache) for the next
+   visit.  The short copies sit next to it in the physical hash, are never
+   returned by tb_find_slow, and go away with the usual page invalidation
+   and tb_flush. */
+static TranslationBlock *tb_find_truncated(CPUState *env,
+                                           TranslationBlock *orig_tb,
+                                           int max_insns)
+{
+    panda_cb_entry *plist;
+    TranslationBlock *tb;
+    target_ulong pc = orig_tb->pc;
+    target_ulong cs_base = orig_tb->cs_base;
+    uint64_t flags = orig_tb->flags;
+    unsigned int h;
+
+    h = tb_phys_hash_func(get_page_addr_code(env, pc));
+    for (tb = tb_phys_hash[h]; tb != NULL; tb = tb->phys_hash_next) {
+        /* orig_tb was just looked up, so its pages are the current ones */
+        if (tb->rr_max_insns == max_insns &&
+            tb->pc == pc &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags &&
+            tb->page_addr[0] == orig_tb->page_addr[0] &&
+            (tb->page_addr[1] == -1 ||
+             tb->page_addr[1] == orig_tb->page_addr[1])) {
+            return tb;
+        }
+    }
+
+    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_TRANSLATE) {
+        plist->entry.before_block_translate(env, pc);
+    }
+
+    tb = tb_gen_code(env, pc, cs_base, flags, max_insns);
+    tb->rr_max_insns = max_insns;
+
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_BLOCK_TRANSLATE) {
+        plist->entry.after_block_translate(env, tb);
+    }
+    return tb;
+}
+#endif
+
 static inline TranslationBlock *tb_find_fast(CPUState *env)
 {
     TranslationBlock *tb;
@@ -728,6 +775,19 @@ int cpu_exec(CPUState *env)
                     }
                 }
 
+#ifdef CONFIG_SOFTMMU
+                // PANDA instruction windows: open/close windows whose
+                // boundary we have reached. Switching instrumentation may
+                // request the TB flush just below.
+                if (rr_in_replay()) {
+                    panda_windows_update();
+                }
+#endif
+
+                // No hook site is inside a callback table here, so tables
+                // replaced by (un)registration can be freed
+                panda_cb_tables_gc();
+
                 if(panda_flush_tb()) {
                     tb_flush(env);
                     tb_invalidated_flag = 1;
@@ -738,6 +798,14 @@ int cpu_exec(CPUState *env)
                 //bdg WARNING! This can cause an exception
                 tb = tb_find_fast(env);
 
+#ifdef CONFIG_SOFTMMU
+                // Don't let this TB run across a window boundary; the
+                // replay truncation below retranslates it if needed.
+                if (rr_in_replay()) {
+                    panda_windows_clamp(tb);
+                }
+#endif
+
 #ifdef CONFIG_SOFTMMU
                 qemu_log_mask(CPU_LOG_RR, 
 			      "Prog point: 0x" TARGET_FMT_lx " {guest_instr_count=%llu, pc=%08llx, secondary=%08llx}\n",
@@ -753,11 +821,10 @@ int cpu_exec(CPUState *env)
                 // executed the block in question if there are interrupts pending.
                 // So we guard the callback execution with bb_invalidate_done, which
                 // will get cleared when we actually get to execute the basic block.
-                panda_cb_list *plist;
+                panda_cb_entry *plist;
                 bool panda_invalidate_tb = false;
                 if (unlikely(!bb_invalidate_done)) {
-                    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-                            plist != NULL; plist = panda_cb_list_next(plist)) {
+                    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT) {
                         panda_invalidate_tb |=
                             plist->entry.before_block_exec_invalidate_opt(env, tb);
                     }
@@ -765,14 +832,18 @@ int cpu_exec(CPUState *env)
                 }
 
 #ifdef CONFIG_SOFTMMU
-                if (panda_invalidate_tb ||
-                    (rr_mode == RR_REPLAY && rr_num_instr_before_next_interrupt > 0 &&
-                        tb->num_guest_insns > rr_num_instr_before_next_interrupt)) {
+                if (panda_invalidate_tb) {
                     //mz invalidate current TB and retranslate
                     invalidate_single_tb(env, tb->pc);
                     //mz try again.
                     tb = tb_find_fast(env);
                 }
+                if (rr_mode == RR_REPLAY && rr_num_instr_before_next_interrupt > 0 &&
+                        tb->num_guest_insns > rr_num_instr_before_next_interrupt) {
+                    // Run a copy cut short at the interrupt instead, keeping
+                    // the full block for next time.
+                    tb = tb_find_truncated(env, tb, rr_num_instr_before_next_interrupt);
+                }
 
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -861,6 +932,10 @@ int cpu_exec(CPUState *env)
                         //mz setting program point just before call to gen_func()
 #ifdef CONFIG_SOFTMMU
                         rr_set_program_point();
+                        if (unlikely(rr_in_replay() &&
+                                    rr_prog_point.guest_instr_count >= rr_next_checkpoint)) {
+                            rr_do_checkpoint();
+                        }
 #endif
                         //mz Actually jump into the generated code
                         /* execute the generated code */
@@ -870,8 +945,7 @@ int cpu_exec(CPUState *env)
                         bb_invalidate_done = false;
 
                         // PANDA instrumentation: before basic block exec
-                        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
-                                plist != NULL; plist = panda_cb_list_next(plist)) {
+                        PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_EXEC) {
                             plist->entry.before_block_exec(env, tb);
                         }
 
@@ -887,7 +961,13 @@ int cpu_exec(CPUState *env)
                         next_tb = tcg_qemu_tb_exec(env, tc_ptr);
 #endif
 
-                        for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
+#ifdef CONFIG_SOFTMMU
+                        if (panda_mem_batch_len) {
+                            panda_mem_batch_flush(env);
+                        }
+#endif
+
+                        PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_BLOCK_EXEC) {
                             plist->entry.after_block_exec(env, tb, (TranslationBlock *)(next_tb & ~3));
                         }
 
@@ -930,6 +1010,12 @@ int cpu_exec(CPUState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#ifdef CONFIG_SOFTMMU
+            /* accesses made before a fault or exit still go out */
+            if (panda_mem_batch_len) {
+                panda_mem_batch_flush(env);
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -101,6 +101,7 @@ int cpu_restore_state(struct TranslationBlock *tb,
                       CPUState *env, unsigned long searched_pc);
 void cpu_resume_from_signal(CPUState *env1, void *puc);
 void cpu_io_recompile(CPUState *env, void *retaddr);
+void panda_memcb_retranslate(CPUState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
@@ -186,6 +187,17 @@ struct TranslationBlock {
 
     // record and replay - might just be able to use icount
     uint16_t num_guest_insns;
+    // replay: nonzero for a copy of a block cut short to stop after this
+    // many instructions for an interrupt (see tb_find_truncated)
+    uint16_t rr_max_insns;
+
+    // PANDA: the call/ret/syscall/... among this block's instructions
+    // (there is at most one, as they end the block), see panda_insn_info
+    uint8_t panda_insn_cls;
+    target_ulong panda_insn_pc;
+    target_ulong panda_insn_target;
+    // PANDA: translated with the instrumented load/store helpers
+    uint8_t panda_memcb;
 
 #ifdef CONFIG_LLVM
     /* pointer to LLVM translated code */
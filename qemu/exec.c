@@ -702,6 +702,8 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->rr_max_insns = 0;
+    tb->panda_insn_cls = 0;
 
 #ifdef CONFIG_LLVM
     tcg_llvm_tb_alloc(tb);
@@ -2094,6 +2096,82 @@ CPUState *cpu_copy(CPUState *env)
 
 #if !defined(CONFIG_USER_ONLY)
 
+/* PANDA: direct-mapped cache of guest page-table walks for
+   panda_virtual_memory_rw, indexed by virtual page and tagged with the
+   asid.  It is invalidated along with the soft TLB, which the targets
+   already flush whenever a translation the guest could observe changes.
+   Entries are only valid if they carry the current generation, so
+   dropping the whole cache is just a counter bump. */
+#define PANDA_V2P_CACHE_BITS 12
+#define PANDA_V2P_CACHE_SIZE (1 << PANDA_V2P_CACHE_BITS)
+
+typedef struct panda_v2p_entry {
+    target_ulong asid;
+    target_ulong vpage;
+    target_phys_addr_t ppage;
+    uint32_t gen;
+} panda_v2p_entry;
+
+static panda_v2p_entry panda_v2p_cache[PANDA_V2P_CACHE_SIZE];
+/* starts at 1 so the zeroed cache is empty */
+static uint32_t panda_v2p_gen = 1;
+/* Set once the guest maps a page larger than TARGET_PAGE_SIZE.  One entry
+   of such a page may cover many of our slots, so from then on a page
+   flush drops everything. */
+static bool panda_v2p_large_pages;
+
+static inline panda_v2p_entry *panda_v2p_slot(target_ulong vpage)
+{
+    return &panda_v2p_cache[(vpage >> TARGET_PAGE_BITS) &
+                            (PANDA_V2P_CACHE_SIZE - 1)];
+}
+
+void panda_v2p_cache_flush(void)
+{
+    if (++panda_v2p_gen == 0) {
+        /* wrapped: make sure no old entry can match again */
+        memset(panda_v2p_cache, 0, sizeof(panda_v2p_cache));
+        panda_v2p_gen = 1;
+    }
+}
+
+static void panda_v2p_cache_flush_page(target_ulong vpage)
+{
+    panda_v2p_entry *e;
+
+    if (panda_v2p_large_pages) {
+        panda_v2p_cache_flush();
+        return;
+    }
+    /* whatever the asid, vpage can only be cached in its own slot */
+    e = panda_v2p_slot(vpage);
+    if (e->vpage == vpage) {
+        e->gen = 0;
+    }
+}
+
+/* Same contract as cpu_get_phys_page_debug: returns -1 if unmapped */
+static target_phys_addr_t panda_get_phys_page(CPUState *env,
+                                              target_ulong vpage)
+{
+    target_ulong asid = panda_current_asid(env);
+    panda_v2p_entry *e = panda_v2p_slot(vpage);
+    target_phys_addr_t ppage;
+
+    if (likely(e->gen == panda_v2p_gen &&
+               e->vpage == vpage && e->asid == asid)) {
+        return e->ppage;
+    }
+    ppage = cpu_get_phys_page_debug(env, vpage);
+    if (ppage != -1) {
+        e->asid = asid;
+        e->vpage = vpage;
+        e->ppage = ppage;
+        e->gen = panda_v2p_gen;
+    }
+    return ppage;
+}
+
 static inline void tlb_flush_jmp_cache(CPUState *env, target_ulong addr)
 {
     unsigned int i;
@@ -2137,6 +2215,7 @@ void tlb_flush(CPUState *env, int flush_global)
     }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    panda_v2p_cache_flush();
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
@@ -2183,6 +2262,7 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
     tlb_flush_jmp_cache(env, addr);
+    panda_v2p_cache_flush_page(addr);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -2206,10 +2286,10 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
                                          unsigned long start, unsigned long length)
 {
     unsigned long addr;
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_PANDA_MEMCB)) == IO_MEM_RAM) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write = (tlb_entry->addr_write & TARGET_PAGE_MASK) | TLB_NOTDIRTY;
+            tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
 }
@@ -2315,7 +2395,7 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
     fprintf(logfile, "cpu_tlb_update_dirty:\n");
 #endif
 
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_PANDA_MEMCB)) == IO_MEM_RAM) {
         p = (void *)(unsigned long)((tlb_entry->addr_write & TARGET_PAGE_MASK)
             + tlb_entry->addend);
         ram_addr = qemu_ram_addr_from_host_nofail(p);
@@ -2338,8 +2418,8 @@ void cpu_tlb_update_dirty(CPUState *env)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY))
-        tlb_entry->addr_write = vaddr;
+    if ((tlb_entry->addr_write & ~TLB_PANDA_MEMCB) == (vaddr | TLB_NOTDIRTY))
+        tlb_entry->addr_write &= ~TLB_NOTDIRTY;
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -2366,6 +2446,7 @@ static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
 {
     target_ulong mask = ~(size - 1);
 
+    panda_v2p_large_pages = true;
     if (env->tlb_flush_addr == (target_ulong)-1) {
         env->tlb_flush_addr = vaddr & mask;
         env->tlb_flush_mask = mask;
@@ -2398,6 +2479,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUTLBEntry *te;
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
+    int panda_prot;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -2457,12 +2539,20 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         }
     }
 
+    /* Accesses that filtered PANDA memory callbacks watch take the slow
+       path, which moves them to instrumented code.  */
+    panda_prot = panda_memcb_page_prot(vaddr, paddr);
+
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    env->tlb_phys[mmu_idx][index] = paddr & TARGET_PAGE_MASK;
     te = &env->tlb_table[mmu_idx][index];
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
+        if (panda_prot & PAGE_READ) {
+            te->addr_read |= TLB_PANDA_MEMCB;
+        }
     } else {
         te->addr_read = -1;
     }
@@ -2483,6 +2573,9 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         } else {
             te->addr_write = address;
         }
+        if (panda_prot & PAGE_WRITE) {
+            te->addr_write |= TLB_PANDA_MEMCB;
+        }
     } else {
         te->addr_write = -1;
     }
@@ -4206,16 +4299,16 @@ static int cpu_physical_memory_rw_ex(target_phys_addr_t addr, uint8_t *buf,
                 ptr = qemu_get_ram_ptr(addr1);
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
-                    panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_entry *plist;
+                    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM) {
                         plist->entry.replay_before_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
                 memcpy(ptr, buf, l);
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
-                    panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_entry *plist;
+                    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM) {
                         plist->entry.replay_after_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
@@ -4282,16 +4375,16 @@ static int cpu_physical_memory_rw_ex(target_phys_addr_t addr, uint8_t *buf,
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
-                    panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_entry *plist;
+                    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM) {
                         plist->entry.replay_before_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
                 memcpy(buf, dest, l);
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
-                    panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_entry *plist;
+                    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM) {
                         plist->entry.replay_after_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
@@ -5081,7 +5174,7 @@ target_phys_addr_t panda_virt_to_phys(CPUState *env, target_ulong addr){
     target_ulong page;
     target_phys_addr_t phys_addr;
     page = addr & TARGET_PAGE_MASK;
-    phys_addr = cpu_get_phys_page_debug(env, page);
+    phys_addr = panda_get_phys_page(env, page);
     /* if no physical page mapped, return an error */
     if (phys_addr == -1)
         return -1;
@@ -5099,7 +5192,7 @@ int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
-        phys_addr = cpu_get_phys_page_debug(env, page);
+        phys_addr = panda_get_phys_page(env, page);
         /* if no physical page mapped, return an error */
         if (phys_addr == -1)
             return -1;
@@ -5190,6 +5283,34 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
+#ifdef CONFIG_SOFTMMU
+/* Uninstrumented code touched a page with TLB_PANDA_MEMCB set.  Have the
+   accessing instruction translated with the instrumented load/store
+   helpers from now on and restart it, as for a watchpoint hit.  Accesses
+   made by helpers rather than translated code are not instrumented and
+   just go ahead.  */
+void panda_memcb_retranslate(CPUState *env, void *retaddr)
+{
+    TranslationBlock *tb;
+    target_ulong pc, cs_base;
+    int flags;
+
+    tb = tb_find_pc((unsigned long)retaddr);
+    if (!tb) {
+        return;
+    }
+    cpu_restore_state(tb, env, (unsigned long)retaddr);
+    /* The instruction was already counted and will be again */
+    if (rr_mode != RR_OFF) {
+        env->rr_guest_instr_count--;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    panda_memcb_watch_pc(pc);
+    tb_phys_invalidate(tb, -1);
+    cpu_resume_from_signal(env, NULL);
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
@@ -1458,4 +1458,12 @@ ETEXI
         .help       = "send a command to a PANDA plugin",
         .mhandler.cmd = hmp_panda_plugin_cmd,
     },
+
+    {
+        .name       = "plugin_profile",
+        .args_type  = "action:s?",
+        .params     = "[on|off]",
+        .help       = "turn PANDA callback profiling on or off, or show the costs so far",
+        .mhandler.cmd = hmp_panda_plugin_profile,
+    },
         
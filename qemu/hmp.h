@@ -50,5 +50,6 @@ void hmp_panda_load_plugin(Monitor *mon, const QDict *qdict);
 void hmp_panda_unload_plugin(Monitor *mon, const QDict *qdict);
 void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict);
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict);
+void hmp_panda_plugin_profile(Monitor *mon, const QDict *qdict);
 
 #endif
@@ -4620,9 +4620,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     struct statfs stfs;
     void *p;
 
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_USER_BEFORE_SYSCALL]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_USER_BEFORE_SYSCALL) {
         plist->entry.user_before_syscall(cpu_env, fcntl_flags_tbl,
                                          num, arg1, arg2, arg3, arg4,
                                          arg5, arg6, arg7, arg8);
@@ -8173,8 +8172,7 @@ fail:
     if(do_strace)
         print_syscall_ret(num, ret);
 
-    for(plist = panda_cbs[PANDA_CB_USER_AFTER_SYSCALL]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(plist, PANDA_CB_USER_AFTER_SYSCALL) {
         plist->entry.user_after_syscall(cpu_env, fcntl_flags_tbl,num, arg1,
                                         arg2, arg3, arg4, arg5, arg6, arg7,
                                         arg8, p, ret);
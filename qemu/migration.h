@@ -88,6 +88,17 @@ uint64_t ram_bytes_total(void);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
 
+/* Set while saving a record/replay snapshot: RAM blocks are written whole,
+ * host-page aligned, so that ram_load can map them instead of copying. */
+extern int ram_save_page_aligned;
+/* Offset in the destination file at which the section now being saved will
+ * start.  Live sections are written to a temporary file first, so this is
+ * what aligned blocks must be padded against. */
+extern int64_t ram_save_section_offset;
+/* File descriptor of the snapshot being loaded, or -1.  When set, page
+ * aligned RAM blocks are mapped copy-on-write from it and faulted in lazily. */
+extern int ram_load_mmap_fd;
+
 extern int incoming_expected;
 
 /**
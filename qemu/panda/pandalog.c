@@ -1,7 +1,11 @@
 
+
 #ifndef PANDALOG_READER
 #include "panda_common.h"
 #include "rr_log.h"
+#include "qemu-thread.h"
+#include "panda_plugin.h"
+#include <glib.h>
 #endif
 
 
@@ -9,9 +13,18 @@
 #include "pandalog.h"
 #include "pandalog_print.h"
 #include <zlib.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+// v1 logs (read only)
 gzFile pandalog_file = 0;
+// v2 logs
+FILE *pandalog_fp = 0;
+int pandalog_writing = 0;
 
 uint32_t pandalog_buf_size = 16;
 unsigned char *pandalog_buf = 0;
@@ -35,15 +48,871 @@ void resize_pandalog(size_t n) {
 }
 
 
+#define PANDALOG_HEADER_SIZE (8 + 4 + 4 + 8)
+#define PANDALOG_INDEX_OFFSET_POS (8 + 4 + 4)
+#define PANDALOG_CHUNK_HEADER_SIZE (8 + 8 + 8 + 8 + 8 + 4)
+// u32 len + u64 instr in front of each packed entry
+#define PANDALOG_RECORD_HEADER_SIZE (4 + 8)
+
+// index, built as chunks are written or read from the end of the file
+static pandalog_chunk_info *pl_chunks = 0;
+static uint32_t pl_nchunks = 0;
+static uint32_t pl_chunks_cap = 0;
+
+
+static void pl_reserve(unsigned char **buf, size_t *cap, size_t n) {
+    if (n <= *cap) return;
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < n) new_cap *= 2;
+    *buf = (unsigned char *) realloc(*buf, new_cap);
+    assert (*buf != NULL);
+    *cap = new_cap;
+}
+
+#ifndef PANDALOG_READER
+static void pl_write(const void *p, size_t n) {
+    size_t x = fwrite(p, 1, n, pandalog_fp);
+    if (x != n) {
+        printf("fwrite for pandalog failed\n");
+    }
+}
+#endif
+
+static int pl_read(void *p, size_t n) {
+    return fread(p, 1, n, pandalog_fp) == n;
+}
+
+static void pl_add_chunk_info(pandalog_chunk_info *ci) {
+    if (pl_nchunks == pl_chunks_cap) {
+        pl_chunks_cap = pl_chunks_cap ? pl_chunks_cap * 2 : 64;
+        pl_chunks = (pandalog_chunk_info *)
+            realloc(pl_chunks, pl_chunks_cap * sizeof(pandalog_chunk_info));
+        assert (pl_chunks != NULL);
+    }
+    pl_chunks[pl_nchunks++] = *ci;
+}
+
+
+// Call str_fn on every string and cs_fn on every CallStack in message m
+// (recursively), for interning.
+typedef void (*pl_str_fn)(char **where, void *opaque);
+typedef void (*pl_cs_fn)(Panda__CallStack *cs, void *opaque);
+
+static void pl_walk(ProtobufCMessage *m, pl_str_fn str_fn, pl_cs_fn cs_fn,
+                    void *opaque) {
+    const ProtobufCMessageDescriptor *d = m->descriptor;
+    char *base = (char *) m;
+    unsigned i;
+    size_t j;
+    if (d == &panda__call_stack__descriptor) {
+        cs_fn((Panda__CallStack *) m, opaque);
+        return;
+    }
+    for (i = 0; i < d->n_fields; i++) {
+        const ProtobufCFieldDescriptor *f = &d->fields[i];
+        if (f->type != PROTOBUF_C_TYPE_STRING && f->type != PROTOBUF_C_TYPE_MESSAGE) {
+            continue;
+        }
+        void **v;
+        size_t n;
+        if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+            n = *(size_t *) (base + f->quantifier_offset);
+            v = *(void ***) (base + f->offset);
+        }
+        else {
+            n = 1;
+            v = (void **) (base + f->offset);
+        }
+        for (j = 0; j < n; j++) {
+            if (v[j] == NULL) continue;
+            if (f->type == PROTOBUF_C_TYPE_STRING) {
+                str_fn((char **) &v[j], opaque);
+            }
+            else {
+                pl_walk((ProtobufCMessage *) v[j], str_fn, cs_fn, opaque);
+            }
+        }
+    }
+}
+
+#ifndef PANDALOG_READER
+// Writing. The guest thread packs entries into pl_fill. Full chunks are
+// compressed on the PANDA worker pool, several at a time; whichever
+// worker completes the oldest outstanding chunk then writes out, in
+// order, every chunk that is ready. At most PANDALOG_MAX_INFLIGHT chunks
+// are outstanding, beyond that the guest thread waits for the writers.
+
+#define PANDALOG_MAX_INFLIGHT 8
+
+typedef struct pl_job {
+    uint64_t seq;
+    unsigned char *buf;     // records
+    size_t len;
+    size_t cap;
+    unsigned char *zbuf;    // buf, compressed
+    size_t zcap;
+    uLongf zsize;
+    pandalog_chunk_info info;
+    struct pl_job *next;    // free list
+} pl_job;
+
+// guest thread only
+static pl_job *pl_fill = 0;
+static int pl_fill_has_instr = 0;
+static uint64_t pl_num_entries = 0;
+static uint64_t pl_last_max_instr = 0;
+// per Panda__LogEntry field (descriptor order) counts for pl_fill
+static uint32_t *pl_type_hist = 0;
+
+// pl_fill's interning tables
+typedef struct pl_interned_str {
+    char *str;
+    char *token;        // what goes in the packed entry instead
+} pl_interned_str;
+
+typedef struct pl_interned_cs {
+    size_t n;
+    uint64_t *addr;
+    uint32_t id;
+} pl_interned_cs;
+
+static GHashTable *pl_str_ids;  // str -> pl_interned_str
+static GPtrArray *pl_strs;      // pl_interned_str by id
+static GHashTable *pl_cs_ids;   // pl_interned_cs -> itself
+static GPtrArray *pl_css;       // pl_interned_cs by id
+
+// what pandalog_write_entry changed in the caller's entry, to put back
+typedef struct pl_undo {
+    char **str_where;
+    char *str_was;
+    Panda__CallStack *cs;
+    Panda__CallStack cs_was;
+} pl_undo;
+
+static GArray *pl_undos;
+
+// shared with the workers, under pl_lock
+static QemuMutex pl_lock;
+static QemuCond pl_cond;
+static pl_job *pl_free_jobs = 0;
+static pl_job *pl_done[PANDALOG_MAX_INFLIGHT];
+static uint64_t pl_seq_submit = 0;
+static uint64_t pl_seq_write = 0;
+static int pl_writer_busy = 0;
+
+// Does entry have this (optional or repeated) field set?
+static int pl_field_present(const Panda__LogEntry *entry,
+                            const ProtobufCFieldDescriptor *f) {
+    const char *base = (const char *) entry;
+    if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+        return *(const size_t *) (base + f->quantifier_offset) != 0;
+    }
+    if (f->type == PROTOBUF_C_TYPE_MESSAGE || f->type == PROTOBUF_C_TYPE_STRING) {
+        return *(void * const *) (base + f->offset) != NULL;
+    }
+    if (f->label == PROTOBUF_C_LABEL_OPTIONAL) {
+        return *(const protobuf_c_boolean *) (base + f->quantifier_offset) != 0;
+    }
+    // required fields (pc, instr) are on every entry
+    return 0;
+}
+
+static void pl_interned_str_free(gpointer p) {
+    pl_interned_str *is = (pl_interned_str *) p;
+    g_free(is->str);
+    g_free(is->token);
+    g_free(is);
+}
+
+static void pl_interned_cs_free(gpointer p) {
+    pl_interned_cs *ic = (pl_interned_cs *) p;
+    g_free(ic->addr);
+    g_free(ic);
+}
+
+static guint pl_cs_hash(gconstpointer p) {
+    const pl_interned_cs *ic = (const pl_interned_cs *) p;
+    guint h = 2166136261u;
+    size_t i;
+    for (i = 0; i < ic->n; i++) {
+        h = (h ^ (guint) (ic->addr[i] ^ (ic->addr[i] >> 32))) * 16777619u;
+    }
+    return h;
+}
+
+static gboolean pl_cs_equal(gconstpointer a, gconstpointer b) {
+    const pl_interned_cs *x = (const pl_interned_cs *) a;
+    const pl_interned_cs *y = (const pl_interned_cs *) b;
+    return x->n == y->n && 0 == memcmp(x->addr, y->addr, x->n * sizeof(uint64_t));
+}
+
+static void pl_intern_str(char **where, void *opaque) {
+    char *s = *where;
+    // strings that look like tokens are always interned, so that readers
+    // never mistake one for a reference
+    if (s[0] != PANDALOG_INTERN_MARK && strlen(s) < PANDALOG_INTERN_MIN) {
+        return;
+    }
+    pl_interned_str *is = (pl_interned_str *) g_hash_table_lookup(pl_str_ids, s);
+    if (is == NULL) {
+        is = g_new(pl_interned_str, 1);
+        is->str = g_strdup(s);
+        is->token = g_strdup_printf("%c%u", PANDALOG_INTERN_MARK, pl_strs->len);
+        g_ptr_array_add(pl_strs, is);
+        g_hash_table_insert(pl_str_ids, is->str, is);
+    }
+    pl_undo u;
+    memset(&u, 0, sizeof(u));
+    u.str_where = where;
+    u.str_was = s;
+    g_array_append_val(pl_undos, u);
+    *where = is->token;
+}
+
+static void pl_intern_cs(Panda__CallStack *cs, void *opaque) {
+    if (cs->n_addr == 0) return;
+    pl_interned_cs key = { cs->n_addr, (uint64_t *) cs->addr, 0 };
+    pl_interned_cs *ic = (pl_interned_cs *) g_hash_table_lookup(pl_cs_ids, &key);
+    if (ic == NULL) {
+        ic = g_new(pl_interned_cs, 1);
+        ic->n = cs->n_addr;
+        ic->addr = (uint64_t *) g_memdup(cs->addr, cs->n_addr * sizeof(uint64_t));
+        ic->id = pl_css->len;
+        g_ptr_array_add(pl_css, ic);
+        g_hash_table_insert(pl_cs_ids, ic, ic);
+    }
+    pl_undo u;
+    memset(&u, 0, sizeof(u));
+    u.cs = cs;
+    u.cs_was = *cs;
+    g_array_append_val(pl_undos, u);
+    cs->n_addr = 0;
+    cs->addr = NULL;
+    cs->has_interned = 1;
+    cs->interned = ic->id;
+}
+
+// put the caller's entry back the way it was
+static void pl_intern_undo(void) {
+    guint i;
+    for (i = 0; i < pl_undos->len; i++) {
+        pl_undo *u = &g_array_index(pl_undos, pl_undo, i);
+        if (u->cs) {
+            *u->cs = u->cs_was;
+        }
+        else {
+            *u->str_where = u->str_was;
+        }
+    }
+    g_array_set_size(pl_undos, 0);
+}
+
+static void pl_append(pl_job *job, const void *p, size_t n) {
+    pl_reserve(&job->buf, &job->cap, job->len + n);
+    memcpy(job->buf + job->len, p, n);
+    job->len += n;
+}
+
+// append pl_fill's interning tables to the chunk and start new ones
+static void pl_emit_tables(pl_job *job) {
+    uint32_t i, n;
+    job->info.records_size = job->len;
+    n = pl_strs->len;
+    pl_append(job, &n, 4);
+    for (i = 0; i < n; i++) {
+        pl_interned_str *is = (pl_interned_str *) g_ptr_array_index(pl_strs, i);
+        uint32_t len = strlen(is->str);
+        pl_append(job, &len, 4);
+        pl_append(job, is->str, len + 1);
+    }
+    n = pl_css->len;
+    pl_append(job, &n, 4);
+    for (i = 0; i < n; i++) {
+        pl_interned_cs *ic = (pl_interned_cs *) g_ptr_array_index(pl_css, i);
+        uint32_t count = ic->n;
+        pl_append(job, &count, 4);
+        pl_append(job, ic->addr, ic->n * sizeof(uint64_t));
+    }
+    g_hash_table_remove_all(pl_str_ids);
+    g_hash_table_remove_all(pl_cs_ids);
+    g_ptr_array_set_size(pl_strs, 0);
+    g_ptr_array_set_size(pl_css, 0);
+}
+
+// an empty chunk for the guest thread to fill
+static pl_job *pl_job_get(void) {
+    qemu_mutex_lock(&pl_lock);
+    pl_job *job = pl_free_jobs;
+    if (job) {
+        pl_free_jobs = job->next;
+    }
+    qemu_mutex_unlock(&pl_lock);
+    if (job == NULL) {
+        job = (pl_job *) calloc(1, sizeof(pl_job));
+        pl_reserve(&job->buf, &job->cap, PANDALOG_CHUNK_SIZE);
+    }
+    job->len = 0;
+    memset(&job->info, 0, sizeof(job->info));
+    job->info.first_entry = pl_num_entries;
+    pl_fill_has_instr = 0;
+    memset(pl_type_hist, 0,
+           panda__log_entry__descriptor.n_fields * sizeof(uint32_t));
+    return job;
+}
+
+// writer: called without pl_lock, but only ever by one thread at a time
+static void pl_write_chunk(pl_job *job) {
+    job->info.offset = ftello(pandalog_fp);
+    pl_write(&job->info.zsize, 8);
+    pl_write(&job->info.size, 8);
+    pl_write(&job->info.records_size, 8);
+    pl_write(&job->info.min_instr, 8);
+    pl_write(&job->info.max_instr, 8);
+    pl_write(&job->info.num_entries, 4);
+    pl_write(job->zbuf, job->zsize);
+}
+
+// worker: compress a chunk, then write out whatever is next in line
+static void pl_compress_task(void *payload) {
+    pl_job *job = (pl_job *) payload;
+    job->zsize = compressBound(job->len);
+    pl_reserve(&job->zbuf, &job->zcap, job->zsize);
+    int ret = compress2(job->zbuf, &job->zsize, job->buf, job->len,
+                        Z_DEFAULT_COMPRESSION);
+    assert (ret == Z_OK);
+    job->info.zsize = job->zsize;
+    job->info.size = job->len;
+
+    qemu_mutex_lock(&pl_lock);
+    pl_done[job->seq % PANDALOG_MAX_INFLIGHT] = job;
+    if (pl_writer_busy) {
+        // the busy writer will pick it up
+        qemu_mutex_unlock(&pl_lock);
+        return;
+    }
+    pl_writer_busy = 1;
+    while ((job = pl_done[pl_seq_write % PANDALOG_MAX_INFLIGHT]) != NULL) {
+        pl_done[pl_seq_write % PANDALOG_MAX_INFLIGHT] = NULL;
+        qemu_mutex_unlock(&pl_lock);
+        pl_write_chunk(job);
+        qemu_mutex_lock(&pl_lock);
+        pl_add_chunk_info(&job->info);
+        job->next = pl_free_jobs;
+        pl_free_jobs = job;
+        pl_seq_write++;
+        qemu_cond_broadcast(&pl_cond);
+    }
+    pl_writer_busy = 0;
+    qemu_mutex_unlock(&pl_lock);
+}
+
+// hand the chunk we have been filling to the workers
+static void pl_submit_chunk(void) {
+    pl_job *job = pl_fill;
+    if (job->info.num_entries == 0) return;
+
+    pl_emit_tables(job);
+    if (!pl_fill_has_instr) {
+        // keep max_instr monotonic for pandalog_seek
+        job->info.min_instr = job->info.max_instr = pl_last_max_instr;
+    }
+    pl_last_max_instr = job->info.max_instr;
+
+    unsigned i, n_fields = panda__log_entry__descriptor.n_fields;
+    for (i = 0; i < n_fields; i++) {
+        if (pl_type_hist[i]) job->info.ntypes++;
+    }
+    job->info.types = (pandalog_type_count *)
+        malloc(job->info.ntypes * sizeof(pandalog_type_count) + 1);
+    uint32_t j = 0;
+    for (i = 0; i < n_fields; i++) {
+        if (pl_type_hist[i] == 0) continue;
+        job->info.types[j].tag = panda__log_entry__descriptor.fields[i].id;
+        job->info.types[j].count = pl_type_hist[i];
+        j++;
+    }
+
+    qemu_mutex_lock(&pl_lock);
+    while (pl_seq_submit - pl_seq_write >= PANDALOG_MAX_INFLIGHT) {
+        qemu_cond_wait(&pl_cond, &pl_lock);
+    }
+    job->seq = pl_seq_submit++;
+    qemu_mutex_unlock(&pl_lock);
+    panda_work_submit(&pandalog_fp, pl_compress_task, job, NULL, 0);
+    pl_fill = pl_job_get();
+}
+
+static void pl_write_index(void) {
+    uint64_t index_offset = ftello(pandalog_fp);
+    uint32_t i;
+    pl_write(&pl_nchunks, 4);
+    for (i = 0; i < pl_nchunks; i++) {
+        pandalog_chunk_info *ci = &pl_chunks[i];
+        pl_write(&ci->offset, 8);
+        pl_write(&ci->zsize, 8);
+        pl_write(&ci->size, 8);
+        pl_write(&ci->records_size, 8);
+        pl_write(&ci->min_instr, 8);
+        pl_write(&ci->max_instr, 8);
+        pl_write(&ci->first_entry, 8);
+        pl_write(&ci->num_entries, 4);
+        pl_write(&ci->ntypes, 4);
+        pl_write(ci->types, ci->ntypes * sizeof(pandalog_type_count));
+    }
+    fseeko(pandalog_fp, PANDALOG_INDEX_OFFSET_POS, SEEK_SET);
+    pl_write(&index_offset, 8);
+}
+
+static void pl_writer_open(void) {
+    uint32_t version = PANDALOG_VERSION;
+    uint32_t chunk_size = PANDALOG_CHUNK_SIZE;
+    uint64_t index_offset = 0;
+    pl_write(PANDALOG_MAGIC, 8);
+    pl_write(&version, 4);
+    pl_write(&chunk_size, 4);
+    pl_write(&index_offset, 8);
+    qemu_mutex_init(&pl_lock);
+    qemu_cond_init(&pl_cond);
+    pl_type_hist = (uint32_t *)
+        malloc(panda__log_entry__descriptor.n_fields * sizeof(uint32_t));
+    pl_strs = g_ptr_array_new_with_free_func(pl_interned_str_free);
+    pl_str_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    pl_css = g_ptr_array_new_with_free_func(pl_interned_cs_free);
+    pl_cs_ids = g_hash_table_new(pl_cs_hash, pl_cs_equal);
+    pl_undos = g_array_new(FALSE, FALSE, sizeof(pl_undo));
+    pl_fill = pl_job_get();
+}
+
+static void pl_writer_close(void) {
+    pl_submit_chunk();
+    qemu_mutex_lock(&pl_lock);
+    while (pl_seq_write != pl_seq_submit) {
+        qemu_cond_wait(&pl_cond, &pl_lock);
+    }
+    qemu_mutex_unlock(&pl_lock);
+    pl_write_index();
+
+    pl_fill->next = pl_free_jobs;
+    pl_free_jobs = pl_fill;
+    pl_fill = 0;
+    while (pl_free_jobs) {
+        pl_job *job = pl_free_jobs;
+        pl_free_jobs = job->next;
+        free(job->buf);
+        free(job->zbuf);
+        free(job);
+    }
+    free(pl_type_hist);
+    pl_type_hist = 0;
+    g_hash_table_destroy(pl_str_ids);
+    g_hash_table_destroy(pl_cs_ids);
+    g_ptr_array_free(pl_strs, TRUE);
+    g_ptr_array_free(pl_css, TRUE);
+    g_array_free(pl_undos, TRUE);
+}
+#endif
+
+static int pl_read_index(uint64_t index_offset) {
+    uint32_t i, n;
+    if (fseeko(pandalog_fp, index_offset, SEEK_SET) != 0) return 0;
+    if (!pl_read(&n, 4)) return 0;
+    for (i = 0; i < n; i++) {
+        pandalog_chunk_info ci;
+        if (!(pl_read(&ci.offset, 8) && pl_read(&ci.zsize, 8)
+              && pl_read(&ci.size, 8) && pl_read(&ci.records_size, 8)
+              && pl_read(&ci.min_instr, 8)
+              && pl_read(&ci.max_instr, 8) && pl_read(&ci.first_entry, 8)
+              && pl_read(&ci.num_entries, 4) && pl_read(&ci.ntypes, 4))) {
+            return 0;
+        }
+        ci.types = (pandalog_type_count *)
+            malloc(ci.ntypes * sizeof(pandalog_type_count) + 1);
+        if (!pl_read(ci.types, ci.ntypes * sizeof(pandalog_type_count))) {
+            free(ci.types);
+            return 0;
+        }
+        pl_add_chunk_info(&ci);
+    }
+    return 1;
+}
+
+// no index (log was not closed): walk the chunk headers
+static void pl_rebuild_index(void) {
+    uint64_t offset = PANDALOG_HEADER_SIZE;
+    uint64_t first_entry = 0;
+    while (1) {
+        pandalog_chunk_info ci;
+        memset(&ci, 0, sizeof(ci));
+        if (fseeko(pandalog_fp, offset, SEEK_SET) != 0) break;
+        if (!(pl_read(&ci.zsize, 8) && pl_read(&ci.size, 8)
+              && pl_read(&ci.records_size, 8)
+              && pl_read(&ci.min_instr, 8) && pl_read(&ci.max_instr, 8)
+              && pl_read(&ci.num_entries, 4))) {
+            break;
+        }
+        // a chunk cut short by a crash ends the log
+        if (fseeko(pandalog_fp, ci.zsize - 1, SEEK_CUR) != 0
+            || fgetc(pandalog_fp) == EOF) {
+            break;
+        }
+        ci.offset = offset;
+        ci.first_entry = first_entry;
+        pl_add_chunk_info(&ci);
+        first_entry += ci.num_entries;
+        offset += PANDALOG_CHUNK_HEADER_SIZE + ci.zsize;
+    }
+    printf ("pandalog has no index; recovered %u chunks\n", pl_nchunks);
+}
+
+// Reading. A cursor holds one decompressed chunk, with its interning
+// tables, and an arena for the entries unpacked from it. The
+// pandalog_read_* functions use pl_main; tools that read chunks in
+// parallel get a cursor per thread. Chunks are read with pread, so
+// cursors share the log's file descriptor without locking.
+
+typedef struct pl_rd_cs {
+    uint32_t n;
+    const unsigned char *addr;  // n u64s, maybe unaligned
+} pl_rd_cs;
+
+typedef struct pl_arena_block {
+    struct pl_arena_block *next;
+    size_t size;
+    size_t used;
+} pl_arena_block;
+
+struct pandalog_cursor {
+    // current chunk, records then tables
+    unsigned char *chunk;
+    size_t chunk_len;           // of the records
+    size_t chunk_cap;
+    int64_t chunk_index;
+    size_t pos;                 // of the next record
+    // compressed chunk
+    unsigned char *zbuf;
+    size_t zbuf_cap;
+    // interning tables of the current chunk
+    const char **strs;
+    uint32_t nstrs;
+    pl_rd_cs *css;
+    uint32_t ncss;
+    // entries are bump-allocated out of a list of blocks that is
+    // rewound, not freed, by pl_arena_reset
+    pl_arena_block *arena_head;
+    pl_arena_block *arena_cur;
+    ProtobufCAllocator allocator;
+};
+
+static pandalog_cursor pl_main;
+
+#define PANDALOG_ARENA_BLOCK (1024 * 1024)
+
+static void *pl_arena_alloc(void *allocator_data, size_t size) {
+    pandalog_cursor *c = (pandalog_cursor *) allocator_data;
+    // keep everything 16-byte aligned
+    size = (size + 15) & ~(size_t) 15;
+    while (c->arena_cur == 0 || c->arena_cur->used + size > c->arena_cur->size) {
+        if (c->arena_cur && c->arena_cur->next) {
+            c->arena_cur = c->arena_cur->next;
+            c->arena_cur->used = 0;
+            continue;
+        }
+        size_t bsize = size > PANDALOG_ARENA_BLOCK ? size : PANDALOG_ARENA_BLOCK;
+        // header padded to 16 bytes as well
+        pl_arena_block *b = (pl_arena_block *) malloc(32 + bsize);
+        assert (b != NULL);
+        b->next = 0;
+        b->size = bsize;
+        b->used = 0;
+        if (c->arena_cur) {
+            c->arena_cur->next = b;
+        }
+        else {
+            c->arena_head = b;
+        }
+        c->arena_cur = b;
+    }
+    void *p = (char *) c->arena_cur + 32 + c->arena_cur->used;
+    c->arena_cur->used += size;
+    return p;
+}
+
+static void pl_arena_free(void *allocator_data, void *pointer) {
+    // released all at once by pl_arena_reset
+}
+
+static void pl_arena_reset(pandalog_cursor *c) {
+    c->arena_cur = c->arena_head;
+    if (c->arena_cur) {
+        c->arena_cur->used = 0;
+    }
+}
+
+static void pl_cursor_init(pandalog_cursor *c) {
+    memset(c, 0, sizeof(*c));
+    c->chunk_index = -1;
+    c->allocator.alloc = pl_arena_alloc;
+    c->allocator.free = pl_arena_free;
+    c->allocator.allocator_data = c;
+}
+
+static void pl_cursor_destroy(pandalog_cursor *c) {
+    while (c->arena_head) {
+        pl_arena_block *b = c->arena_head;
+        c->arena_head = b->next;
+        free(b);
+    }
+    free(c->chunk);
+    free(c->zbuf);
+    free(c->strs);
+    free(c->css);
+    pl_cursor_init(c);
+}
+
+static uint32_t pl_get_u32(const unsigned char **p) {
+    uint32_t v;
+    memcpy(&v, *p, 4);
+    *p += 4;
+    return v;
+}
+
+static void pl_load_tables(pandalog_cursor *c, const unsigned char *p,
+                           const unsigned char *end) {
+    uint32_t i;
+    assert (p + 4 <= end);
+    c->nstrs = pl_get_u32(&p);
+    c->strs = (const char **) realloc(c->strs, (c->nstrs + 1) * sizeof(char *));
+    for (i = 0; i < c->nstrs; i++) {
+        uint32_t len = pl_get_u32(&p);
+        assert (p + len + 1 <= end);
+        c->strs[i] = (const char *) p;
+        p += len + 1;
+    }
+    assert (p + 4 <= end);
+    c->ncss = pl_get_u32(&p);
+    c->css = (pl_rd_cs *) realloc(c->css, (c->ncss + 1) * sizeof(pl_rd_cs));
+    for (i = 0; i < c->ncss; i++) {
+        c->css[i].n = pl_get_u32(&p);
+        assert (p + c->css[i].n * 8 <= end);
+        c->css[i].addr = p;
+        p += c->css[i].n * 8;
+    }
+}
+
+// what pl_resolve_* need: where to look ids up, how to allocate
+typedef struct pl_resolve_ctx {
+    pandalog_cursor *c;
+    ProtobufCAllocator *a;      // NULL: malloc
+} pl_resolve_ctx;
+
+static void *pl_alloc(ProtobufCAllocator *a, size_t n) {
+    return a ? a->alloc(a->allocator_data, n) : malloc(n);
+}
+
+static void pl_dealloc(ProtobufCAllocator *a, void *p) {
+    if (a) a->free(a->allocator_data, p);
+    else free(p);
+}
+
+// undo the interning done by pandalog_write_entry
+static void pl_resolve_str(char **where, void *opaque) {
+    pl_resolve_ctx *ctx = (pl_resolve_ctx *) opaque;
+    char *s = *where;
+    if (s[0] != PANDALOG_INTERN_MARK) return;
+    unsigned long id = strtoul(s + 1, NULL, 10);
+    if (id >= ctx->c->nstrs) return;
+    size_t len = strlen(ctx->c->strs[id]);
+    char *r = (char *) pl_alloc(ctx->a, len + 1);
+    memcpy(r, ctx->c->strs[id], len + 1);
+    pl_dealloc(ctx->a, s);
+    *where = r;
+}
+
+static void pl_resolve_cs(Panda__CallStack *cs, void *opaque) {
+    pl_resolve_ctx *ctx = (pl_resolve_ctx *) opaque;
+    if (!cs->has_interned || cs->interned >= ctx->c->ncss) return;
+    pl_rd_cs *rc = &ctx->c->css[cs->interned];
+    if (cs->addr) pl_dealloc(ctx->a, cs->addr);
+    cs->addr = (uint64_t *) pl_alloc(ctx->a, rc->n * sizeof(uint64_t) + 1);
+    memcpy(cs->addr, rc->addr, rc->n * sizeof(uint64_t));
+    cs->n_addr = rc->n;
+    cs->has_interned = 0;
+}
+
+static void pl_resolve(pandalog_cursor *c, Panda__LogEntry *ple,
+                       ProtobufCAllocator *a) {
+    pl_resolve_ctx ctx = { c, a };
+    // v1 logs have no interning
+    if (pandalog_fp == 0) return;
+    pl_walk((ProtobufCMessage *) ple, pl_resolve_str, pl_resolve_cs, &ctx);
+}
+
+static void pl_load_chunk(pandalog_cursor *c, uint32_t i) {
+    pandalog_chunk_info *ci = &pl_chunks[i];
+    pl_reserve(&c->zbuf, &c->zbuf_cap, ci->zsize);
+    pl_reserve(&c->chunk, &c->chunk_cap, ci->size);
+    ssize_t nr = pread(fileno(pandalog_fp), c->zbuf, ci->zsize,
+                       ci->offset + PANDALOG_CHUNK_HEADER_SIZE);
+    assert (nr == (ssize_t) ci->zsize);
+    uLongf size = ci->size;
+    int ret = uncompress(c->chunk, &size, c->zbuf, ci->zsize);
+    assert (ret == Z_OK && size == ci->size);
+    assert (ci->records_size <= size);
+    pl_load_tables(c, c->chunk + ci->records_size, c->chunk + size);
+    c->chunk_len = ci->records_size;
+    c->chunk_index = i;
+    c->pos = 0;
+}
+
+// Entry type filter (pandalog_set_filter): bitmap of field numbers
+#define PANDALOG_MAX_FILTER_TAG 1024
+static int pl_filter_on = 0;
+static uint64_t pl_filter[PANDALOG_MAX_FILTER_TAG / 64];
+
+static inline int pl_filter_has(uint64_t tag) {
+    return tag < PANDALOG_MAX_FILTER_TAG
+        && (pl_filter[tag / 64] & (1ULL << (tag % 64)));
+}
+
+// Could this chunk hold an entry that passes the filter? Chunks without
+// a histogram (index rebuilt after a crash) have to be looked at.
+static int pl_chunk_may_match(const pandalog_chunk_info *ci) {
+    uint32_t i;
+    if (!pl_filter_on || ci->ntypes == 0) return 1;
+    for (i = 0; i < ci->ntypes; i++) {
+        if (pl_filter_has(ci->types[i].tag)) return 1;
+    }
+    return 0;
+}
+
+static const uint8_t *pl_varint(const uint8_t *p, const uint8_t *end,
+                                uint64_t *v) {
+    unsigned shift = 0;
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (uint64_t) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+        shift += 7;
+    }
+    return NULL;
+}
+
+// Does the packed entry set any field in the filter? Walks the top-level
+// protobuf keys without unpacking anything.
+static int pl_entry_passes(const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    uint64_t key, v;
+    if (!pl_filter_on) return 1;
+    while (p < end) {
+        if (!(p = pl_varint(p, end, &key))) return 0;
+        if (pl_filter_has(key >> 3)) return 1;
+        switch (key & 7) {
+        case 0: // varint
+            if (!(p = pl_varint(p, end, &v))) return 0;
+            break;
+        case 1: // 64-bit
+            p += 8;
+            break;
+        case 2: // length-delimited
+            if (!(p = pl_varint(p, end, &v))) return 0;
+            if (v > (uint64_t) (end - p)) return 0;
+            p += v;
+            break;
+        case 5: // 32-bit
+            p += 4;
+            break;
+        default: // groups are not used in pandalog.proto
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// make c->pos point at a record, loading the next chunk if needed
+static int pl_next_record(pandalog_cursor *c) {
+    while (c->pos >= c->chunk_len) {
+        int64_t i = c->chunk_index + 1;
+        while (i < pl_nchunks && !pl_chunk_may_match(&pl_chunks[i])) i++;
+        if (i >= pl_nchunks) return 0;
+        pl_load_chunk(c, i);
+    }
+    return 1;
+}
+
+static uint32_t pl_record_len(pandalog_cursor *c) {
+    uint32_t len;
+    memcpy(&len, c->chunk + c->pos, 4);
+    return len;
+}
+
+static uint64_t pl_record_instr(pandalog_cursor *c) {
+    uint64_t instr;
+    memcpy(&instr, c->chunk + c->pos + 4, 8);
+    return instr;
+}
+
+static void pl_skip_record(pandalog_cursor *c) {
+    c->pos += PANDALOG_RECORD_HEADER_SIZE + pl_record_len(c);
+}
+
+
 
 // open for read or write
 void pandalog_open(const char *path, const char *mode) {
-    pandalog_file = gzopen(path, mode);
+    pandalog_writing = (mode[0] == 'w');
+#ifdef PANDALOG_READER
+    assert (!pandalog_writing);
+#endif
+    pandalog_fp = fopen(path, pandalog_writing ? "wb" : "rb");
+    assert (pandalog_fp != NULL);
+#ifndef PANDALOG_READER
+    if (pandalog_writing) {
+        pl_writer_open();
+        return;
+    }
+#endif
+    char magic[8];
+    uint32_t version, chunk_size;
+    uint64_t index_offset;
+    if (!(pl_read(magic, 8) && 0 == memcmp(magic, PANDALOG_MAGIC, 8))) {
+        // v1: one gzip stream
+        fclose(pandalog_fp);
+        pandalog_fp = 0;
+        pandalog_file = gzopen(path, mode);
+        return;
+    }
+    int ok = pl_read(&version, 4) && pl_read(&chunk_size, 4)
+        && pl_read(&index_offset, 8);
+    assert (ok && version == PANDALOG_VERSION);
+    if (index_offset == 0 || !pl_read_index(index_offset)) {
+        pl_nchunks = 0;
+        pl_rebuild_index();
+    }
+    pl_cursor_init(&pl_main);
 }
 
 
 int  pandalog_close(void) {
-    return gzclose(pandalog_file);  
+    int ret;
+    if (pandalog_fp == 0) {
+        return gzclose(pandalog_file);
+    }
+#ifndef PANDALOG_READER
+    if (pandalog_writing) {
+        pl_writer_close();
+    }
+#endif
+    ret = fclose(pandalog_fp);
+    pandalog_fp = 0;
+    uint32_t i;
+    for (i = 0; i < pl_nchunks; i++) {
+        free(pl_chunks[i].types);
+    }
+    free(pl_chunks);
+    pl_chunks = 0;
+    pl_nchunks = pl_chunks_cap = 0;
+    pl_cursor_destroy(&pl_main);
+    return ret;
 }
 
 extern int panda_in_main_loop;
@@ -51,57 +920,218 @@ extern int panda_in_main_loop;
 
 #ifndef PANDALOG_READER
 void pandalog_write_entry(Panda__LogEntry *entry) {
-    // fill in required fields. 
-    // NOTE: any other fields will already have been filled in 
-    // by the plugin that made this call.  
+    // fill in required fields.
+    // NOTE: any other fields will already have been filled in
+    // by the plugin that made this call.
     if (panda_in_main_loop) {
         entry->pc = panda_current_pc(cpu_single_env);
         entry->instr = rr_get_guest_instr_count ();
     }
-    else {        
+    else {
         entry->pc = -1;
         entry->instr = -1;
     }
-    size_t n = panda__log_entry__get_packed_size(entry);   
-    resize_pandalog(n);
-    panda__log_entry__pack(entry, pandalog_buf);
-    // write size of log entry
-    int x = gzwrite(pandalog_file, (void *) &n, sizeof(n));
-    //printf ("x=%d\n", x);
-    if (x == 0) {
-      printf("gzwrite for pandalog failed\n");
-    }
+    pl_walk((ProtobufCMessage *) entry, pl_intern_str, pl_intern_cs, NULL);
+    uint32_t n = panda__log_entry__get_packed_size(entry);
+    pl_job *job = pl_fill;
+    pl_reserve(&job->buf, &job->cap,
+               job->len + PANDALOG_RECORD_HEADER_SIZE + n);
+    // record header: size of log entry and its instr
+    memcpy(job->buf + job->len, &n, 4);
+    memcpy(job->buf + job->len + 4, &entry->instr, 8);
     // and then the entry itself
-    x=gzwrite(pandalog_file, pandalog_buf, n);        
-    //printf ("x=%d\n", x);
-    if (x == 0) {
-      printf("gzwrite for pandalog failed\n");
+    panda__log_entry__pack(entry, job->buf + job->len + PANDALOG_RECORD_HEADER_SIZE);
+    job->len += PANDALOG_RECORD_HEADER_SIZE + n;
+    pl_intern_undo();
+
+    if (entry->instr != (uint64_t) -1) {
+        if (!pl_fill_has_instr) {
+            job->info.min_instr = job->info.max_instr = entry->instr;
+            pl_fill_has_instr = 1;
+        }
+        if (entry->instr < job->info.min_instr) job->info.min_instr = entry->instr;
+        if (entry->instr > job->info.max_instr) job->info.max_instr = entry->instr;
+    }
+    unsigned i;
+    for (i = 0; i < panda__log_entry__descriptor.n_fields; i++) {
+        if (pl_field_present(entry, &panda__log_entry__descriptor.fields[i])) {
+            pl_type_hist[i]++;
+        }
+    }
+    job->info.num_entries++;
+    pl_num_entries++;
+    if (job->len >= PANDALOG_CHUNK_SIZE) {
+        pl_submit_chunk();
     }
 }
 #endif
 
+// Next packed entry that passes the filter, or NULL at the end of the log.
+// Valid until the next call.
+static const uint8_t *pl_next_packed(uint32_t *len) {
+    pandalog_cursor *c = &pl_main;
+    if (pandalog_fp == 0) {
+        // v1
+        while (1) {
+            // read the size of the log entry
+            size_t n,nbr;
+            nbr = gzread(pandalog_file, (void *) &n, sizeof(n));
+            if (nbr == 0) {
+                return NULL;
+            }
+            resize_pandalog(n);
+            // and then read the entry iself
+            gzread(pandalog_file, pandalog_buf, n);
+            if (pl_entry_passes(pandalog_buf, n)) {
+                *len = n;
+                return pandalog_buf;
+            }
+        }
+    }
+    while (pl_next_record(c)) {
+        uint32_t n = pl_record_len(c);
+        const uint8_t *p = c->chunk + c->pos + PANDALOG_RECORD_HEADER_SIZE;
+        c->pos += PANDALOG_RECORD_HEADER_SIZE + n;
+        if (pl_entry_passes(p, n)) {
+            *len = n;
+            return p;
+        }
+    }
+    return NULL;
+}
+
 Panda__LogEntry *pandalog_read_entry(void) {
-    // read the size of the log entry
-    size_t n,nbr;
-    nbr = gzread(pandalog_file, (void *) &n, sizeof(n));
-    if (nbr == 0) {
+    uint32_t n;
+    const uint8_t *p = pl_next_packed(&n);
+    if (p == NULL) {
         return NULL;
     }
-    resize_pandalog(n);
-    // and then read the entry iself
-    gzread(pandalog_file, pandalog_buf, n);
     // and unpack it
-    Panda__LogEntry *ple = panda__log_entry__unpack(NULL, n, pandalog_buf);                                             
+    Panda__LogEntry *ple = panda__log_entry__unpack(NULL, n, p);
     if (ple == NULL) {
 	return (Panda__LogEntry *)1; //yay special values
     }
+    pl_resolve(&pl_main, ple, NULL);
     return ple;
 }
 
 
-void pandalog_free_entry(Panda__LogEntry *entry) {    
+size_t pandalog_read_batch(Panda__LogEntry **entries, size_t max) {
+    size_t i = 0;
+    uint32_t n;
+    const uint8_t *p;
+    pl_arena_reset(&pl_main);
+    while (i < max && (p = pl_next_packed(&n)) != NULL) {
+        Panda__LogEntry *ple =
+            panda__log_entry__unpack(&pl_main.allocator, n, p);
+        // skip entries that do not unpack
+        if (ple != NULL) {
+            pl_resolve(&pl_main, ple, &pl_main.allocator);
+            entries[i++] = ple;
+        }
+    }
+    return i;
+}
+
+void pandalog_set_filter(const uint32_t *tags, size_t n) {
+    size_t i;
+    memset(pl_filter, 0, sizeof(pl_filter));
+    for (i = 0; i < n; i++) {
+        assert (tags[i] < PANDALOG_MAX_FILTER_TAG);
+        pl_filter[tags[i] / 64] |= 1ULL << (tags[i] % 64);
+    }
+    pl_filter_on = (n > 0);
+}
+
+
+void pandalog_free_entry(Panda__LogEntry *entry) {
     panda__log_entry__free_unpacked(entry, NULL);
 }
 
 
+int pandalog_seek(uint64_t instr) {
+    if (pandalog_fp == 0 || pl_nchunks == 0) return -1;
+    // first chunk that could hold instr
+    uint32_t lo = 0, hi = pl_nchunks;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pl_chunks[mid].max_instr < instr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == pl_nchunks) return -1;
+    pl_load_chunk(&pl_main, lo);
+    while (pl_next_record(&pl_main)) {
+        if (pl_record_instr(&pl_main) >= instr) return 0;
+        pl_skip_record(&pl_main);
+    }
+    return -1;
+}
+
+int pandalog_seek_entry(uint64_t n) {
+    if (pandalog_fp == 0 || pl_nchunks == 0) return -1;
+    // last chunk starting at or before n
+    uint32_t lo = 0, hi = pl_nchunks;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pl_chunks[mid].first_entry <= n) lo = mid;
+        else hi = mid;
+    }
+    pandalog_chunk_info *ci = &pl_chunks[lo];
+    if (n < ci->first_entry || n >= ci->first_entry + ci->num_entries) return -1;
+    pl_load_chunk(&pl_main, lo);
+    uint64_t i;
+    for (i = ci->first_entry; i < n; i++) {
+        pl_skip_record(&pl_main);
+    }
+    return 0;
+}
 
+uint32_t pandalog_num_chunks(void) {
+    return pl_nchunks;
+}
+
+const pandalog_chunk_info *pandalog_get_chunk_info(uint32_t i) {
+    assert (i < pl_nchunks);
+    return &pl_chunks[i];
+}
+
+
+pandalog_cursor *pandalog_cursor_new(void) {
+    pandalog_cursor *c = (pandalog_cursor *) malloc(sizeof(pandalog_cursor));
+    assert (c != NULL);
+    pl_cursor_init(c);
+    return c;
+}
+
+void pandalog_cursor_free(pandalog_cursor *c) {
+    pl_cursor_destroy(c);
+    free(c);
+}
+
+int pandalog_cursor_load(pandalog_cursor *c, uint32_t i) {
+    assert (pandalog_fp != 0 && i < pl_nchunks);
+    c->chunk_len = c->pos = 0;
+    if (!pl_chunk_may_match(&pl_chunks[i])) return 0;
+    pl_load_chunk(c, i);
+    return 1;
+}
+
+Panda__LogEntry *pandalog_cursor_next(pandalog_cursor *c, uint64_t min_instr,
+                                      uint64_t max_instr) {
+    pl_arena_reset(c);
+    while (c->pos < c->chunk_len) {
+        uint32_t n = pl_record_len(c);
+        uint64_t instr = pl_record_instr(c);
+        const uint8_t *p = c->chunk + c->pos + PANDALOG_RECORD_HEADER_SIZE;
+        c->pos += PANDALOG_RECORD_HEADER_SIZE + n;
+        if (instr < min_instr || instr > max_instr || !pl_entry_passes(p, n)) {
+            continue;
+        }
+        Panda__LogEntry *ple = panda__log_entry__unpack(&c->allocator, n, p);
+        if (ple != NULL) {
+            pl_resolve(c, ple, &c->allocator);
+            return ple;
+        }
+    }
+    return NULL;
+}
@@ -1,7 +1,7 @@
-
 #ifndef __PANDALOG_H_
 #define __PANDALOG_H_
 
+#include <stdint.h>
 #include "pandalog.pb-c.h"
 
 
@@ -24,5 +24,97 @@ void pandalog_free_entry(Panda__LogEntry *entry);
 
 extern int pandalog;
 
-#endif
 
+// pandalog v2 file layout (all integers little-endian):
+//
+//   header    "PANDALG2", u32 version, u32 chunk size, u64 index offset
+//   chunk*    u64 zsize, u64 size, u64 records size, u64 min instr,
+//             u64 max instr, u32 num entries, then zsize bytes of zlib
+//             data which inflate to
+//               num entries records of
+//                 u32 len, u64 instr, len bytes of packed Panda__LogEntry
+//               (at records size) the chunk's interning tables
+//                 u32 n, n * (u32 len, len bytes, NUL)     strings
+//                 u32 n, n * (u32 count, count * u64)      call stacks
+//   index     u32 num chunks, then per chunk the pandalog_chunk_info
+//             fields below, with the histogram as ntypes (u32 tag,
+//             u32 count) pairs
+//
+// The index offset in the header is filled in by pandalog_close. If it
+// is zero (qemu died), readers rebuild the index from the chunk headers,
+// without the type histograms. Old (v1) logs, a single gzip stream of
+// size_t-prefixed entries, can still be read sequentially.
+//
+// Strings (of PANDALOG_INTERN_MIN chars or more) and CallStacks in
+// entries are interned per chunk: a packed string holds
+// PANDALOG_INTERN_MARK followed by its table index in decimal, and a
+// packed CallStack has no addrs and its table index in `interned`.
+// pandalog_read_entry and pandalog_read_batch put the real values back.
+
+#define PANDALOG_MAGIC "PANDALG2"
+#define PANDALOG_VERSION 2
+// uncompressed bytes of entries per chunk
+#define PANDALOG_CHUNK_SIZE (4 * 1024 * 1024)
+#define PANDALOG_INTERN_MIN 8
+#define PANDALOG_INTERN_MARK '\x01'
+
+typedef struct pandalog_type_count {
+    uint32_t tag;       // Panda__LogEntry field number
+    uint32_t count;     // entries in the chunk with that field set
+} pandalog_type_count;
+
+typedef struct pandalog_chunk_info {
+    uint64_t offset;        // file offset of the chunk header
+    uint64_t zsize;         // compressed size
+    uint64_t size;          // uncompressed size
+    uint64_t records_size;  // uncompressed size without the tables
+    uint64_t min_instr;     // instr range of the entries, ignoring
+    uint64_t max_instr;     //   entries written outside the main loop
+    uint64_t first_entry;   // index of the chunk's first entry in the log
+    uint32_t num_entries;
+    uint32_t ntypes;
+    pandalog_type_count *types;
+} pandalog_chunk_info;
+
+// Random access, v2 logs only. Both return 0 on success and -1 if there
+// is no such entry (or the log is v1); the next pandalog_read_entry then
+// returns the entry sought.
+// Position at the first entry with instr >= instr
+int pandalog_seek(uint64_t instr);
+// Position at the n-th entry (counting from 0)
+int pandalog_seek_entry(uint64_t n);
+
+uint32_t pandalog_num_chunks(void);
+const pandalog_chunk_info *pandalog_get_chunk_info(uint32_t i);
+
+// Batch reading, for post-processing tools. Fills entries[] with up to max
+// entries and returns how many, 0 at the end of the log. The entries are
+// unpacked into an arena that the next pandalog_read_batch call reuses:
+// do not free them or keep pointers to them across calls.
+size_t pandalog_read_batch(Panda__LogEntry **entries, size_t max);
+
+// Only return entries that set at least one of the given Panda__LogEntry
+// fields, by field number (the tag in pandalog.proto, or ->id of a field in
+// panda__log_entry__descriptor). Entries are checked before they are unpacked,
+// and v2 chunks whose type histogram rules them out are not decompressed.
+// Applies to pandalog_read_entry too. n == 0 turns the filter off.
+void pandalog_set_filter(const uint32_t *tags, size_t n);
+
+// Per-thread chunk readers, v2 logs only, for tools that process chunks in
+// parallel. A cursor has its own decompression buffers and entry arena, so
+// one cursor per thread may read the open log concurrently. The filter is
+// shared and must not change while cursors are in use.
+typedef struct pandalog_cursor pandalog_cursor;
+pandalog_cursor *pandalog_cursor_new(void);
+void pandalog_cursor_free(pandalog_cursor *c);
+// Decompress chunk i into the cursor. Returns 0, and leaves the cursor
+// empty, if the filter rules the chunk out.
+int pandalog_cursor_load(pandalog_cursor *c, uint32_t i);
+// Next entry of the loaded chunk with min_instr <= instr <= max_instr that
+// passes the filter, or NULL at the end of the chunk. Records outside the
+// range are skipped without being unpacked. The entry is valid until the
+// next call; do not free it.
+Panda__LogEntry *pandalog_cursor_next(pandalog_cursor *c, uint64_t min_instr,
+                                      uint64_t max_instr);
+
+#endif
@@ -0,0 +1,539 @@
+// cd panda/qemu/panda
+// g++ -g -O2 -o pandalog_query pandalog_query.cpp pandalog.c pandalog.pb-c.c -L/usr/local/lib -lprotobuf-c -I .. -lz -D PANDALOG_READER  -std=c++11 -pthread
+//
+// pandalog_query [-s start_instr] [-e end_instr] [-p pc|lo-hi] [-a asid]
+//                [-t field,...] [-j threads] [-c dir] plog
+//
+// Prints the entries that match all the given predicates as JSON, one
+// entry per line, or with -c writes them to dir as column files (see
+// docs/pandalog.md). -t keeps entries that set at least one of the named
+// Panda__LogEntry fields, e.g. -t asid,process. v2 logs are processed a
+// chunk per thread, and chunks that the index shows cannot match are not
+// decompressed.
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pandalog.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// predicates
+static uint64_t min_instr = 0;
+static uint64_t max_instr = UINT64_MAX;
+static bool have_range = false;
+static uint64_t min_pc = 0;
+static uint64_t max_pc = UINT64_MAX;
+static const ProtobufCFieldDescriptor *asid_field = NULL;
+static uint64_t asid_value;
+
+static const ProtobufCMessageDescriptor *entry_desc = &panda__log_entry__descriptor;
+
+static size_t elem_size(const ProtobufCFieldDescriptor *f) {
+    switch (f->type) {
+    case PROTOBUF_C_TYPE_INT32: case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32: case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_FIXED32: case PROTOBUF_C_TYPE_FLOAT:
+    case PROTOBUF_C_TYPE_ENUM:
+        return 4;
+    case PROTOBUF_C_TYPE_INT64: case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64: case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64: case PROTOBUF_C_TYPE_DOUBLE:
+        return 8;
+    case PROTOBUF_C_TYPE_BOOL:
+        return sizeof(protobuf_c_boolean);
+    case PROTOBUF_C_TYPE_STRING:
+        return sizeof(char *);
+    case PROTOBUF_C_TYPE_BYTES:
+        return sizeof(ProtobufCBinaryData);
+    case PROTOBUF_C_TYPE_MESSAGE:
+        return sizeof(ProtobufCMessage *);
+    }
+    return 0;
+}
+
+static bool is_signed(const ProtobufCFieldDescriptor *f) {
+    return f->type == PROTOBUF_C_TYPE_INT32 || f->type == PROTOBUF_C_TYPE_SINT32
+        || f->type == PROTOBUF_C_TYPE_SFIXED32 || f->type == PROTOBUF_C_TYPE_INT64
+        || f->type == PROTOBUF_C_TYPE_SINT64 || f->type == PROTOBUF_C_TYPE_SFIXED64
+        || f->type == PROTOBUF_C_TYPE_ENUM;
+}
+
+static bool is_float(const ProtobufCFieldDescriptor *f) {
+    return f->type == PROTOBUF_C_TYPE_FLOAT || f->type == PROTOBUF_C_TYPE_DOUBLE;
+}
+
+static bool is_scalar(const ProtobufCFieldDescriptor *f) {
+    return f->type != PROTOBUF_C_TYPE_STRING && f->type != PROTOBUF_C_TYPE_BYTES
+        && f->type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+static bool present(const ProtobufCMessage *m, const ProtobufCFieldDescriptor *f) {
+    const char *base = (const char *) m;
+    if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+        return *(const size_t *) (base + f->quantifier_offset) != 0;
+    }
+    if (!is_scalar(f) && f->type != PROTOBUF_C_TYPE_BYTES) {
+        return *(void * const *) (base + f->offset) != NULL;
+    }
+    if (f->label == PROTOBUF_C_LABEL_OPTIONAL) {
+        return *(const protobuf_c_boolean *) (base + f->quantifier_offset) != 0;
+    }
+    return true;
+}
+
+// integer scalar at p, widened to 64 bits (signed ones sign-extended)
+static uint64_t int_value(const ProtobufCFieldDescriptor *f, const void *p) {
+    switch (elem_size(f)) {
+    case 8:
+        return *(const uint64_t *) p;
+    default:
+        if (is_signed(f)) return (uint64_t) (int64_t) *(const int32_t *) p;
+        return *(const uint32_t *) p;
+    }
+}
+
+static double float_value(const ProtobufCFieldDescriptor *f, const void *p) {
+    if (f->type == PROTOBUF_C_TYPE_FLOAT) return *(const float *) p;
+    return *(const double *) p;
+}
+
+static bool matches(const Panda__LogEntry *ple) {
+    // the instr range was checked on the record headers
+    if (ple->pc < min_pc || ple->pc > max_pc) return false;
+    if (asid_field) {
+        const ProtobufCMessage *m = (const ProtobufCMessage *) ple;
+        if (!present(m, asid_field)) return false;
+        if (int_value(asid_field, (const char *) m + asid_field->offset) != asid_value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// JSON lines
+
+static void json_string(std::string &out, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20) {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+static void json_message(std::string &out, const ProtobufCMessage *m);
+
+static void json_value(std::string &out, const ProtobufCFieldDescriptor *f, const void *p) {
+    char buf[32];
+    switch (f->type) {
+    case PROTOBUF_C_TYPE_STRING:
+        json_string(out, *(char * const *) p, strlen(*(char * const *) p));
+        return;
+    case PROTOBUF_C_TYPE_BYTES: {
+        static const char hex[] = "0123456789abcdef";
+        const ProtobufCBinaryData *b = (const ProtobufCBinaryData *) p;
+        out += '"';
+        for (size_t i = 0; i < b->len; i++) {
+            out += hex[b->data[i] >> 4];
+            out += hex[b->data[i] & 15];
+        }
+        out += '"';
+        return;
+    }
+    case PROTOBUF_C_TYPE_MESSAGE:
+        json_message(out, *(ProtobufCMessage * const *) p);
+        return;
+    case PROTOBUF_C_TYPE_BOOL:
+        out += *(const protobuf_c_boolean *) p ? "true" : "false";
+        return;
+    case PROTOBUF_C_TYPE_ENUM: {
+        const ProtobufCEnumValue *ev = protobuf_c_enum_descriptor_get_value(
+            (const ProtobufCEnumDescriptor *) f->descriptor, *(const int *) p);
+        if (ev) {
+            json_string(out, ev->name, strlen(ev->name));
+            return;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (is_float(f)) {
+        snprintf(buf, sizeof(buf), "%.17g", float_value(f, p));
+    }
+    else if (is_signed(f)) {
+        snprintf(buf, sizeof(buf), "%" PRId64, (int64_t) int_value(f, p));
+    }
+    else {
+        snprintf(buf, sizeof(buf), "%" PRIu64, int_value(f, p));
+    }
+    out += buf;
+}
+
+static void json_message(std::string &out, const ProtobufCMessage *m) {
+    const ProtobufCMessageDescriptor *d = m->descriptor;
+    const char *base = (const char *) m;
+    bool first = true;
+    out += '{';
+    for (unsigned i = 0; i < d->n_fields; i++) {
+        const ProtobufCFieldDescriptor *f = &d->fields[i];
+        if (!present(m, f)) continue;
+        if (!first) out += ',';
+        first = false;
+        json_string(out, f->name, strlen(f->name));
+        out += ':';
+        if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+            size_t n = *(const size_t *) (base + f->quantifier_offset);
+            const char *v = *(char * const *) (base + f->offset);
+            out += '[';
+            for (size_t j = 0; j < n; j++) {
+                if (j) out += ',';
+                json_value(out, f, v + j * elem_size(f));
+            }
+            out += ']';
+        }
+        else {
+            json_value(out, f, base + f->offset);
+        }
+    }
+    out += '}';
+}
+
+
+// Columns. Every non-repeated scalar or string field of Panda__LogEntry
+// gets a column: <name>.u64, .i64 or .f64 holding a little-endian 8 byte
+// value per row, or for strings <name>.off (rows + 1 u64 offsets) and
+// <name>.str (the bytes). Optional fields also get <name>.valid, a byte
+// per row that is 1 if the field was set; unset rows hold 0 or "".
+
+struct column_def {
+    const ProtobufCFieldDescriptor *f;
+    FILE *data;
+    FILE *off;
+    FILE *valid;
+    uint64_t str_len;       // bytes written to .str so far
+};
+
+static std::vector<column_def> column_defs;
+
+struct column_chunk {
+    std::vector<uint64_t> vals;     // strings: end offsets within strs
+    std::string strs;
+    std::vector<uint8_t> valid;
+};
+
+// what a worker produces for one chunk
+struct chunk_result {
+    std::string json;
+    std::vector<column_chunk> cols;
+    size_t rows;
+};
+
+static const char *column_dir = NULL;
+
+static FILE *column_file(const char *name, const char *ext) {
+    std::string path = std::string(column_dir) + "/" + name + "." + ext;
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        perror(path.c_str());
+        exit(1);
+    }
+    return fp;
+}
+
+static void columns_open(void) {
+    mkdir(column_dir, 0777);
+    for (unsigned i = 0; i < entry_desc->n_fields; i++) {
+        const ProtobufCFieldDescriptor *f = &entry_desc->fields[i];
+        if (f->label == PROTOBUF_C_LABEL_REPEATED) continue;
+        if (!is_scalar(f) && f->type != PROTOBUF_C_TYPE_STRING) continue;
+        column_def cd = { f, NULL, NULL, NULL, 0 };
+        if (f->type == PROTOBUF_C_TYPE_STRING) {
+            uint64_t zero = 0;
+            cd.data = column_file(f->name, "str");
+            cd.off = column_file(f->name, "off");
+            fwrite(&zero, 8, 1, cd.off);
+        }
+        else {
+            cd.data = column_file(f->name, is_float(f) ? "f64" : is_signed(f) ? "i64" : "u64");
+        }
+        if (f->label != PROTOBUF_C_LABEL_REQUIRED) {
+            cd.valid = column_file(f->name, "valid");
+        }
+        column_defs.push_back(cd);
+    }
+}
+
+static void columns_close(void) {
+    for (size_t i = 0; i < column_defs.size(); i++) {
+        fclose(column_defs[i].data);
+        if (column_defs[i].off) fclose(column_defs[i].off);
+        if (column_defs[i].valid) fclose(column_defs[i].valid);
+    }
+}
+
+static void columns_add(chunk_result &r, const Panda__LogEntry *ple) {
+    const ProtobufCMessage *m = (const ProtobufCMessage *) ple;
+    for (size_t i = 0; i < column_defs.size(); i++) {
+        const ProtobufCFieldDescriptor *f = column_defs[i].f;
+        column_chunk &cc = r.cols[i];
+        const void *p = (const char *) m + f->offset;
+        bool set = present(m, f);
+        if (f->type == PROTOBUF_C_TYPE_STRING) {
+            if (set) cc.strs += *(char * const *) p;
+            cc.vals.push_back(cc.strs.size());
+        }
+        else if (!set) {
+            cc.vals.push_back(0);
+        }
+        else if (is_float(f)) {
+            double d = float_value(f, p);
+            uint64_t v;
+            memcpy(&v, &d, 8);
+            cc.vals.push_back(v);
+        }
+        else {
+            cc.vals.push_back(int_value(f, p));
+        }
+        if (column_defs[i].valid) cc.valid.push_back(set);
+    }
+}
+
+static void columns_write(chunk_result &r) {
+    for (size_t i = 0; i < column_defs.size(); i++) {
+        column_def &cd = column_defs[i];
+        column_chunk &cc = r.cols[i];
+        if (cd.off) {
+            for (size_t j = 0; j < cc.vals.size(); j++) {
+                cc.vals[j] += cd.str_len;
+            }
+            fwrite(cc.strs.data(), 1, cc.strs.size(), cd.data);
+            fwrite(cc.vals.data(), 8, cc.vals.size(), cd.off);
+            cd.str_len += cc.strs.size();
+        }
+        else {
+            fwrite(cc.vals.data(), 8, cc.vals.size(), cd.data);
+        }
+        if (cd.valid) fwrite(cc.valid.data(), 1, cc.valid.size(), cd.valid);
+    }
+}
+
+static void add_entry(chunk_result &r, const Panda__LogEntry *ple) {
+    if (!matches(ple)) return;
+    r.rows++;
+    if (column_dir) {
+        columns_add(r, ple);
+    }
+    else {
+        json_message(r.json, (const ProtobufCMessage *) ple);
+        r.json += '\n';
+    }
+}
+
+static void emit(chunk_result &r) {
+    if (column_dir) columns_write(r);
+    else fwrite(r.json.data(), 1, r.json.size(), stdout);
+}
+
+static void reset(chunk_result &r) {
+    r.json.clear();
+    r.cols.assign(column_defs.size(), column_chunk());
+    r.rows = 0;
+}
+
+
+// Chunks are handed out to workers in order and their results emitted in
+// order. Workers stay at most `window` chunks ahead of the output.
+
+static std::vector<uint32_t> todo;          // chunks that may match
+static std::atomic<size_t> next_todo(0);
+static std::vector<chunk_result *> done;    // by position in todo
+static size_t emitted = 0;
+static size_t window;
+static std::mutex lock;
+static std::condition_variable cond;
+
+static void worker(void) {
+    pandalog_cursor *c = pandalog_cursor_new();
+    while (1) {
+        size_t t = next_todo++;
+        if (t >= todo.size()) break;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            while (t >= emitted + window) cond.wait(l);
+        }
+        chunk_result *r = new chunk_result;
+        reset(*r);
+        if (pandalog_cursor_load(c, todo[t])) {
+            Panda__LogEntry *ple;
+            while ((ple = pandalog_cursor_next(c, min_instr, max_instr)) != NULL) {
+                add_entry(*r, ple);
+            }
+        }
+        std::lock_guard<std::mutex> l(lock);
+        done[t] = r;
+        cond.notify_all();
+    }
+    pandalog_cursor_free(c);
+}
+
+static uint64_t run_chunks(unsigned nthreads) {
+    uint64_t rows = 0;
+    for (uint32_t i = 0; i < pandalog_num_chunks(); i++) {
+        const pandalog_chunk_info *ci = pandalog_get_chunk_info(i);
+        // entries from outside the main loop are not in the chunk's
+        // instr range, but they are never in a requested range either
+        if (have_range && (ci->num_entries == 0 || ci->max_instr < min_instr
+                           || ci->min_instr > max_instr)) {
+            continue;
+        }
+        todo.push_back(i);
+    }
+    done.assign(todo.size(), NULL);
+    window = 4 * nthreads;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    while (emitted < todo.size()) {
+        chunk_result *r;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            while (done[emitted] == NULL) cond.wait(l);
+            r = done[emitted];
+        }
+        emit(*r);
+        rows += r->rows;
+        delete r;
+        std::lock_guard<std::mutex> l(lock);
+        emitted++;
+        cond.notify_all();
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return rows;
+}
+
+// v1 logs have no chunks: read them sequentially
+static uint64_t run_sequential(void) {
+    uint64_t rows = 0;
+    Panda__LogEntry *batch[1024];
+    size_t i, n;
+    chunk_result r;
+    reset(r);
+    while ((n = pandalog_read_batch(batch, 1024)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (batch[i]->instr < min_instr || batch[i]->instr > max_instr) continue;
+            add_entry(r, batch[i]);
+        }
+        emit(r);
+        rows += r.rows;
+        reset(r);
+    }
+    return rows;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: pandalog_query [-s start_instr] [-e end_instr] [-p pc|lo-hi] [-a asid]\n"
+                    "                      [-t field,...] [-j threads] [-c dir] plog\n");
+    exit(1);
+}
+
+static const ProtobufCFieldDescriptor *field(const char *name) {
+    const ProtobufCFieldDescriptor *f =
+        protobuf_c_message_descriptor_get_field_by_name(entry_desc, name);
+    if (f == NULL) {
+        fprintf(stderr, "no field %s in Panda__LogEntry\n", name);
+        exit(1);
+    }
+    return f;
+}
+
+int main (int argc, char **argv) {
+    std::vector<uint32_t> tags;
+    unsigned nthreads = std::thread::hardware_concurrency();
+    int opt;
+    while ((opt = getopt(argc, argv, "s:e:p:a:t:j:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            min_instr = strtoull(optarg, NULL, 0);
+            have_range = true;
+            break;
+        case 'e':
+            max_instr = strtoull(optarg, NULL, 0);
+            have_range = true;
+            break;
+        case 'p': {
+            char *end;
+            min_pc = max_pc = strtoull(optarg, &end, 0);
+            if (*end == '-') max_pc = strtoull(end + 1, NULL, 0);
+            break;
+        }
+        case 'a':
+            asid_field = field("asid");
+            asid_value = strtoull(optarg, NULL, 0);
+            break;
+        case 't': {
+            std::string names(optarg);
+            size_t pos = 0;
+            while (pos <= names.size()) {
+                size_t comma = names.find(',', pos);
+                if (comma == std::string::npos) comma = names.size();
+                tags.push_back(field(names.substr(pos, comma - pos).c_str())->id);
+                pos = comma + 1;
+            }
+            break;
+        }
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            column_dir = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1) usage();
+    if (nthreads == 0) nthreads = 1;
+    // with a range, skip the entries written outside the main loop
+    if (have_range && max_instr == UINT64_MAX) max_instr = UINT64_MAX - 1;
+    // an asid predicate needs entries that have one
+    if (asid_field && tags.empty()) tags.push_back(asid_field->id);
+
+    pandalog_open(argv[optind], "r");
+    pandalog_set_filter(tags.data(), tags.size());
+    if (column_dir) columns_open();
+    uint64_t rows = pandalog_num_chunks() ? run_chunks(nthreads) : run_sequential();
+    if (column_dir) {
+        columns_close();
+        fprintf(stderr, "%" PRIu64 " rows\n", rows);
+    }
+    pandalog_close();
+    return 0;
+}
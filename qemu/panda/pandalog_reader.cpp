@@ -1,6 +1,8 @@
-
 // cd panda/qemu/panda
 // g++ -g -o pandalog_reader pandalog_reader.cpp pandalog.c pandalog.pb-c.c pandalog_print.c -L/usr/local/lib -lprotobuf-c -I .. -lz -D PANDALOG_READER  -std=c++11
+//
+// pandalog_reader plog [start_instr [end_instr]]
+// With an instr range, only that window of a (v2) log is decompressed.
 
 #define __STDC_FORMAT_MACROS
 
@@ -15,16 +17,26 @@
 
 int main (int argc, char **argv) {
     pandalog_open(argv[1], "r");
-    Panda__LogEntry *ple;
-    while (1) {
-        ple = pandalog_read_entry();
-	if (ple == (Panda__LogEntry *)1) {
-	    continue;
-	}
-        if (ple == NULL) {
-	    break;
+    uint64_t end_instr = UINT64_MAX;
+    if (argc > 2) {
+        if (pandalog_seek(strtoull(argv[2], NULL, 0)) != 0) {
+            return 0;
+        }
+    }
+    if (argc > 3) {
+        end_instr = strtoull(argv[3], NULL, 0);
+    }
+    Panda__LogEntry *batch[1024];
+    size_t i, n;
+    while ((n = pandalog_read_batch(batch, 1024)) > 0) {
+        for (i = 0; i < n; i++) {
+            Panda__LogEntry *ple = batch[i];
+            if (ple->instr > end_instr && ple->instr != (uint64_t) -1) {
+                pandalog_close();
+                return 0;
+            }
+            pprint_ple(ple);
         }
-	pprint_ple(ple);
-	panda__log_entry__free_unpacked(ple, NULL);
     }
+    pandalog_close();
 }
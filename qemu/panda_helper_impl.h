@@ -13,10 +13,15 @@
 PANDAENDCOMMENT */
 void helper_panda_insn_exec(target_ulong pc) {
     // PANDA instrumentation: before basic block 
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_INSN_EXEC) {
         plist->entry.insn_exec(env, pc);
     }
 }
 
+// Out-of-line part of panda_insn_call_if(), once the condition held
+void helper_panda_insn_call(void *fn, target_ulong pc) {
+    ((int (*)(CPUState *, target_ulong)) fn)(env, pc);
+}
+
 
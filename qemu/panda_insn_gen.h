@@ -0,0 +1,113 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+
+/* Code generation for the inline instruction actions plugins queue from
+   their PANDA_CB_INSN_TRANSLATE callbacks (see panda_insn_count() and
+   friends in panda_plugin.h). Included by the target translators after
+   cpu_env is declared, like gen-icount.h, and after they define
+   panda_insn_env_global(), which maps a CPUState offset to the TCG global
+   caching that field, if there is one.  */
+
+static inline void gen_panda_insn_count(panda_insn_action *a)
+{
+    TCGv_ptr p = tcg_const_ptr((tcg_target_long)a->counter);
+    TCGv_i64 t = tcg_temp_new_i64();
+    tcg_gen_ld_i64(t, p, 0);
+    tcg_gen_addi_i64(t, t, 1);
+    tcg_gen_st_i64(t, p, 0);
+    tcg_temp_free_i64(t);
+    tcg_temp_free_ptr(p);
+}
+
+static inline void gen_panda_insn_record_pc(panda_insn_action *a,
+                                            target_ulong pc)
+{
+    panda_pc_ring *ring = a->ring;
+    TCGv_ptr r = tcg_const_ptr((tcg_target_long)ring);
+    TCGv_i32 pos = tcg_temp_new_i32();
+    TCGv_i32 idx = tcg_temp_new_i32();
+    TCGv_ptr slot = tcg_temp_new_ptr();
+    TCGv v = tcg_const_tl(pc);
+
+    /* ring->buf[ring->pos++ & ring->mask] = pc */
+    tcg_gen_ld_i32(pos, r, offsetof(panda_pc_ring, pos));
+    tcg_gen_andi_i32(idx, pos, ring->mask);
+    tcg_gen_addi_i32(pos, pos, 1);
+    tcg_gen_st_i32(pos, r, offsetof(panda_pc_ring, pos));
+    tcg_gen_shli_i32(idx, idx, sizeof(target_ulong) == 8 ? 3 : 2);
+    tcg_gen_ext_i32_ptr(slot, idx);
+    tcg_gen_addi_ptr(slot, slot, (tcg_target_long)ring->buf);
+    tcg_gen_st_tl(v, slot, 0);
+
+    tcg_temp_free(v);
+    tcg_temp_free_ptr(slot);
+    tcg_temp_free_i32(idx);
+    tcg_temp_free_i32(pos);
+    tcg_temp_free_ptr(r);
+}
+
+static inline void gen_panda_insn_call_if(panda_insn_action *a,
+                                          target_ulong pc)
+{
+    static const TCGCond inverse[] = {
+        [PANDA_INSN_IF_EQ] = TCG_COND_NE,
+        [PANDA_INSN_IF_NE] = TCG_COND_EQ,
+        [PANDA_INSN_IF_LTU] = TCG_COND_GEU,
+        [PANDA_INSN_IF_GEU] = TCG_COND_LTU,
+    };
+    int skip = gen_new_label();
+    TCGv v, g;
+    TCGv_ptr fn;
+
+    /* registers live in TCG globals within a block, so env is only
+       up to date for fields that have none */
+    if (panda_insn_env_global(a->env_offset, &g)) {
+        tcg_gen_brcondi_tl(inverse[a->cond], g, a->value, skip);
+    } else {
+        v = tcg_temp_new();
+        tcg_gen_ld_tl(v, cpu_env, a->env_offset);
+        tcg_gen_brcondi_tl(inverse[a->cond], v, a->value, skip);
+        tcg_temp_free(v);
+    }
+    fn = tcg_const_ptr((tcg_target_long)a->fn);
+    v = tcg_const_tl(pc);
+    gen_helper_panda_insn_call(fn, v);
+    tcg_temp_free(v);
+    tcg_temp_free_ptr(fn);
+    gen_set_label(skip);
+}
+
+/* Emit and clear whatever was queued for the instruction at pc */
+static inline void gen_panda_insn_actions(target_ulong pc)
+{
+    int i;
+    for (i = 0; i < panda_insn_nactions; i++) {
+        panda_insn_action *a = &panda_insn_actions[i];
+        switch (a->kind) {
+        case PANDA_INSN_ACTION_COUNT:
+            gen_panda_insn_count(a);
+            break;
+        case PANDA_INSN_ACTION_RECORD_PC:
+            gen_panda_insn_record_pc(a, pc);
+            break;
+        case PANDA_INSN_ACTION_CALL_IF:
+            gen_panda_insn_call_if(a, pc);
+            break;
+        }
+    }
+    if (panda_insn_nactions) {
+        panda_insn_actions_emitted = true;
+    }
+    panda_insn_nactions = 0;
+}
@@ -27,8 +27,13 @@ PANDAENDCOMMENT */
 #include "tcg-llvm.h"
 #endif
 
+#ifdef CONFIG_SOFTMMU
+#include "rr_log.h"
+#endif
+
 #include <dlfcn.h>
 #include <string.h>
+#include <time.h>
 
 
 // WARNING: this is all gloriously un-thread-safe
@@ -36,6 +41,16 @@ PANDAENDCOMMENT */
 // Array of pointers to PANDA callback lists, one per callback type
 panda_cb_list *panda_cbs[PANDA_CB_LAST];
 
+// Flat tables built from panda_cbs; types with no enabled callbacks all
+// share the empty table
+static panda_cb_entry panda_cb_table_empty[1];
+panda_cb_entry *panda_cb_table[PANDA_CB_LAST] = {
+    [0 ... PANDA_CB_LAST - 1] = panda_cb_table_empty
+};
+uint64_t panda_cb_mask = 0;
+// Tables replaced while a hook site may still be walking them
+static GSList *panda_cb_table_garbage = NULL;
+
 // Storage for command line options
 char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
 int panda_argc;
@@ -54,6 +69,17 @@ bool panda_please_flush_tb = false;
 bool panda_update_pc = false;
 bool panda_use_memcb = false;
 bool panda_tb_chaining = true;
+bool panda_insn_classify = false;
+panda_insn_info panda_cur_insn;
+// Number of callbacks registered with panda_register_memcb_filtered
+static int panda_memcb_nfiltered = 0;
+// Sorted guest PCs of the instructions that touched a TLB_PANDA_MEMCB page
+static GArray *panda_memcb_pcs = NULL;
+static void panda_memcb_flush_range(int type, const panda_memcb_filter *f);
+
+panda_insn_action panda_insn_actions[PANDA_INSN_ACTIONS_MAX];
+int panda_insn_nactions = 0;
+bool panda_insn_actions_emitted = false;
 
 
 
@@ -141,12 +167,22 @@ static void panda_delete_plugin(int i) {
 void panda_do_unload_plugin(int plugin_idx){
     void *plugin = panda_plugins[plugin_idx].plugin;
     void (*uninit_fn)(void *) = dlsym(plugin, "uninit_plugin");
+    // uninit should see the results of all the work handed out so far
+    panda_work_flush(plugin);
+#ifdef CONFIG_SOFTMMU
+    // and every access batched up before it
+    if (panda_mem_batch_len) {
+        panda_mem_batch_flush(cpu_single_env ? cpu_single_env : first_cpu);
+    }
+#endif
     if(!uninit_fn) {
         fprintf(stderr, "Couldn't get symbol %s: %s\n", "uninit_plugin", dlerror());
     }
     else {
         uninit_fn(plugin);
     }
+    // and nothing may run once the plugin's code is gone
+    panda_work_flush(plugin);
     panda_unregister_callbacks(plugin);
     panda_delete_plugin(plugin_idx);
     dlclose(plugin);
@@ -187,21 +223,366 @@ void * panda_get_plugin_by_name(const char *plugin_name) {
     return NULL;
 }
 
+/*
+ * Callback cost accounting.
+ *
+ * While panda_cb_profiling is on, PANDA_CB_FOREACH calls
+ * panda_cb_prof_tick() before each callback and once more at the end of
+ * the table. Each tick closes the timing of the previous entry of the same
+ * walk and opens one for the current entry. A small stack of open timings
+ * handles callbacks that trigger other callbacks; times are inclusive.
+ */
+bool panda_cb_profiling = false;
+
+static GPtrArray *panda_cb_stats = NULL;
+// PPP stats, keyed by callback function
+static GHashTable *panda_ppp_stats = NULL;
+
+#define PANDA_CB_PROF_DEPTH 32
+static struct {
+    panda_cb_entry *pcb;
+    uint64_t t0;
+} panda_cb_prof_stack[PANDA_CB_PROF_DEPTH];
+static int panda_cb_prof_depth = 0;
+
+static const char *panda_cb_type_names[PANDA_CB_LAST] = {
+    [PANDA_CB_BEFORE_BLOCK_TRANSLATE] = "before_block_translate",
+    [PANDA_CB_AFTER_BLOCK_TRANSLATE] = "after_block_translate",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] = "before_block_exec_invalidate_opt",
+    [PANDA_CB_BEFORE_BLOCK_EXEC] = "before_block_exec",
+    [PANDA_CB_AFTER_BLOCK_EXEC] = "after_block_exec",
+    [PANDA_CB_INSN_TRANSLATE] = "insn_translate",
+    [PANDA_CB_INSN_EXEC] = "insn_exec",
+    [PANDA_CB_VIRT_MEM_READ] = "virt_mem_read",
+    [PANDA_CB_VIRT_MEM_WRITE] = "virt_mem_write",
+    [PANDA_CB_PHYS_MEM_READ] = "phys_mem_read",
+    [PANDA_CB_PHYS_MEM_WRITE] = "phys_mem_write",
+    [PANDA_CB_VIRT_MEM_BEFORE_READ] = "virt_mem_before_read",
+    [PANDA_CB_VIRT_MEM_BEFORE_WRITE] = "virt_mem_before_write",
+    [PANDA_CB_PHYS_MEM_BEFORE_READ] = "phys_mem_before_read",
+    [PANDA_CB_PHYS_MEM_BEFORE_WRITE] = "phys_mem_before_write",
+    [PANDA_CB_VIRT_MEM_AFTER_READ] = "virt_mem_after_read",
+    [PANDA_CB_VIRT_MEM_AFTER_WRITE] = "virt_mem_after_write",
+    [PANDA_CB_PHYS_MEM_AFTER_READ] = "phys_mem_after_read",
+    [PANDA_CB_PHYS_MEM_AFTER_WRITE] = "phys_mem_after_write",
+    [PANDA_CB_HD_READ] = "hd_read",
+    [PANDA_CB_HD_WRITE] = "hd_write",
+    [PANDA_CB_GUEST_HYPERCALL] = "guest_hypercall",
+    [PANDA_CB_MONITOR] = "monitor",
+    [PANDA_CB_CPU_RESTORE_STATE] = "cpu_restore_state",
+    [PANDA_CB_BEFORE_REPLAY_LOADVM] = "before_replay_loadvm",
+#ifndef CONFIG_SOFTMMU
+    [PANDA_CB_USER_BEFORE_SYSCALL] = "user_before_syscall",
+    [PANDA_CB_USER_AFTER_SYSCALL] = "user_after_syscall",
+#endif
+#ifdef CONFIG_PANDA_VMI
+    [PANDA_CB_VMI_AFTER_FORK] = "vmi_after_fork",
+    [PANDA_CB_VMI_AFTER_EXEC] = "vmi_after_exec",
+    [PANDA_CB_VMI_AFTER_CLONE] = "vmi_after_clone",
+#endif
+    [PANDA_CB_VMI_PGD_CHANGED] = "vmi_pgd_changed",
+    [PANDA_CB_REPLAY_HD_TRANSFER] = "replay_hd_transfer",
+    [PANDA_CB_REPLAY_NET_TRANSFER] = "replay_net_transfer",
+    [PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM] = "replay_before_cpu_physical_mem_rw_ram",
+    [PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM] = "replay_after_cpu_physical_mem_rw_ram",
+    [PANDA_CB_REPLAY_HANDLE_PACKET] = "replay_handle_packet",
+    [PANDA_CB_MEM_BATCH] = "mem_batch",
+};
+
+const char *panda_cb_type_name(int type) {
+    if (type < 0) return "ppp";
+    if (type >= PANDA_CB_LAST || panda_cb_type_names[type] == NULL) return "?";
+    return panda_cb_type_names[type];
+}
+
+uint64_t panda_cb_prof_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void panda_cb_stat_name(panda_cb_stat *st) {
+    int i;
+    for (i = 0; i < nb_panda_plugins; i++) {
+        if (panda_plugins[i].plugin == st->owner) {
+            strncpy(st->plugin_name, panda_plugins[i].name,
+                    sizeof(st->plugin_name) - 1);
+            return;
+        }
+    }
+}
+
+// Internal: stats record for (owner, type), created on first use
+static panda_cb_stat *panda_cb_stat_get(void *owner, panda_cb_type type) {
+    guint i;
+    panda_cb_stat *st;
+    if (panda_cb_stats == NULL) panda_cb_stats = g_ptr_array_new();
+    for (i = 0; i < panda_cb_stats->len; i++) {
+        st = g_ptr_array_index(panda_cb_stats, i);
+        if (st->owner == owner && st->type == type) return st;
+    }
+    st = g_new0(panda_cb_stat, 1);
+    st->owner = owner;
+    st->type = type;
+    panda_cb_stat_name(st);
+    g_ptr_array_add(panda_cb_stats, st);
+    return st;
+}
+
+// Internal: catch the plugin's name before it goes away
+static void panda_cb_stats_unload(void *plugin) {
+    guint i;
+    if (panda_cb_stats == NULL) return;
+    for (i = 0; i < panda_cb_stats->len; i++) {
+        panda_cb_stat *st = g_ptr_array_index(panda_cb_stats, i);
+        if (st->owner == plugin && st->plugin_name[0] == '\0') {
+            panda_cb_stat_name(st);
+        }
+    }
+}
+
+bool panda_cb_prof_tick(panda_cb_entry *pcb) {
+    uint64_t now = panda_cb_prof_clock();
+    int i;
+    // Close the previous entry of this walk. Anything above it was left
+    // open by a walk that didn't run to the end.
+    for (i = panda_cb_prof_depth - 1; i >= 0; i--) {
+        if (panda_cb_prof_stack[i].pcb + 1 == pcb) {
+            panda_cb_stat *st = panda_cb_prof_stack[i].pcb->stat;
+            st->calls++;
+            st->ns += now - panda_cb_prof_stack[i].t0;
+            panda_cb_prof_depth = i;
+            break;
+        }
+    }
+    if (pcb->entry.cbaddr != NULL && panda_cb_prof_depth < PANDA_CB_PROF_DEPTH) {
+        panda_cb_prof_stack[panda_cb_prof_depth].pcb = pcb;
+        panda_cb_prof_stack[panda_cb_prof_depth].t0 = now;
+        panda_cb_prof_depth++;
+    }
+    return true;
+}
+
+void panda_cb_prof_enable(bool enable) {
+    panda_cb_prof_depth = 0;
+    panda_cb_profiling = enable;
+}
+
+void panda_ppp_prof_charge(const char *name, void *fn, uint64_t ns) {
+    panda_cb_stat *st;
+    if (panda_ppp_stats == NULL) {
+        panda_ppp_stats = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    st = g_hash_table_lookup(panda_ppp_stats, fn);
+    if (st == NULL) {
+        Dl_info info;
+        st = g_new0(panda_cb_stat, 1);
+        st->type = -1;
+        st->ppp_name = name;
+        st->fn = fn;
+        // PPP callbacks don't know their plugin; ask the loader
+        if (dladdr(fn, &info) && info.dli_fname) {
+            char *path = g_strdup(info.dli_fname);
+            strncpy(st->plugin_name, basename(path), sizeof(st->plugin_name) - 1);
+            g_free(path);
+        }
+        g_hash_table_insert(panda_ppp_stats, fn, st);
+        if (panda_cb_stats == NULL) panda_cb_stats = g_ptr_array_new();
+        g_ptr_array_add(panda_cb_stats, st);
+    }
+    st->calls++;
+    st->ns += ns;
+}
+
+void panda_cb_prof_foreach(void (*fn)(const panda_cb_stat *st, void *opaque),
+                           void *opaque) {
+    guint i;
+    if (panda_cb_stats == NULL) return;
+    for (i = 0; i < panda_cb_stats->len; i++) {
+        panda_cb_stat *st = g_ptr_array_index(panda_cb_stats, i);
+        if (st->calls) fn(st, opaque);
+    }
+}
+
+// Internal: rebuild the flat table for one callback type from its list
+static void panda_cb_table_rebuild(panda_cb_type type) {
+    panda_cb_list *plist;
+    panda_cb_entry *table;
+    int n = 0;
+
+    for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->enabled) n++;
+    }
+    if (n == 0) {
+        table = panda_cb_table_empty;
+        panda_cb_mask &= ~PANDA_CB_BIT(type);
+    }
+    else {
+        // one extra, zeroed, entry ends the table
+        table = g_new0(panda_cb_entry, n + 1);
+        n = 0;
+        for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (plist->enabled) {
+                table[n].entry = plist->entry;
+                table[n].owner = plist->owner;
+                table[n].filter = plist->filter;
+                table[n].stat = panda_cb_stat_get(plist->owner, type);
+                n++;
+            }
+        }
+        panda_cb_mask |= PANDA_CB_BIT(type);
+    }
+    if (panda_cb_table[type] != panda_cb_table_empty) {
+        panda_cb_table_garbage = g_slist_prepend(panda_cb_table_garbage,
+                                                 panda_cb_table[type]);
+    }
+    panda_cb_table[type] = table;
+}
+
+static void panda_cb_tables_rebuild(void) {
+    int i;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_table_rebuild(i);
+    }
+}
+
+void panda_cb_tables_gc(void) {
+    if (panda_cb_table_garbage == NULL) return;
+    g_slist_free_full(panda_cb_table_garbage, g_free);
+    panda_cb_table_garbage = NULL;
+}
+
+// Internal: push a callback node onto the front of its list
+static void panda_cb_list_link(panda_cb_type type, panda_cb_list *node) {
+    node->prev = NULL;
+    node->next = panda_cbs[type];
+    if(panda_cbs[type] != NULL) {
+        panda_cbs[type]->prev = node;
+    }
+    panda_cbs[type] = node;
+    panda_cb_table_rebuild(type);
+}
+
+// Internal: take a callback node out of its list without freeing it
+static void panda_cb_list_unlink(panda_cb_type type, panda_cb_list *node) {
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        panda_cbs[type] = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+    panda_cb_table_rebuild(type);
+}
+
 void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     panda_cb_list *new_list = g_new0(panda_cb_list,1);
     new_list->entry = cb;
     new_list->owner = plugin;
-    new_list->prev = NULL;
-    new_list->next = NULL;
     new_list->enabled = true;
-    if(panda_cbs[type] != NULL) {
-        new_list->next = panda_cbs[type];
-        panda_cbs[type]->prev = new_list;
+    panda_cb_list_link(type, new_list);
+}
+
+/*
+ * Instruction windows.
+ *
+ * A window callback lives outside panda_cbs until the replay reaches
+ * start_instr, and is taken out again at end_instr, so the callback loops
+ * never see it (and don't pay for it) outside the window.  The
+ * instrumentation a window asks for is owned by the window code: we only
+ * turn off what we turned on ourselves.
+ */
+typedef struct panda_cb_window panda_cb_window;
+struct panda_cb_window {
+    panda_cb_list *node;
+    panda_cb_type type;
+    uint64_t start_instr;
+    uint64_t end_instr;
+    uint32_t instrumentation;
+    bool open;
+    panda_cb_window *next;
+};
+
+static panda_cb_window *panda_windows = NULL;
+// Instr count of the next window boundary, -1 if there is none
+uint64_t panda_window_next_boundary = (uint64_t) -1;
+#ifdef CONFIG_SOFTMMU
+// Instrumentation we switched on on behalf of open windows
+static uint32_t panda_window_owned = 0;
+// Set while rr_num_instr_before_next_interrupt has been pulled in to stop
+// at a boundary (panda_window_clamp_at); saved_interrupt holds the instr
+// count of the real next interrupt, or -1 if that wasn't known
+static bool panda_window_clamped = false;
+static uint64_t panda_window_clamp_at = 0;
+static uint64_t panda_window_saved_interrupt = 0;
+
+// A plugin that switches instrumentation on or off itself takes it over,
+// so closing a window won't turn it off under the plugin
+static inline void panda_windows_disown(uint32_t instrumentation) {
+    panda_window_owned &= ~instrumentation;
+}
+
+static void panda_windows_recompute(uint64_t now) {
+    panda_cb_window *w;
+    panda_window_next_boundary = (uint64_t) -1;
+    for (w = panda_windows; w != NULL; w = w->next) {
+        uint64_t b;
+        if (w->open) b = w->end_instr;
+        else if (w->end_instr > now) b = w->start_instr;
+        else continue; // already over
+        if (b < panda_window_next_boundary) panda_window_next_boundary = b;
     }
-    panda_cbs[type] = new_list;
+}
+#else
+static inline void panda_windows_disown(uint32_t instrumentation) {}
+#endif
+
+void panda_register_callback_window(void *plugin, panda_cb_type type, panda_cb cb,
+                                    uint64_t start_instr, uint64_t end_instr,
+                                    uint32_t instrumentation) {
+    assert (start_instr < end_instr);
+    panda_cb_window *w = g_new0(panda_cb_window, 1);
+    w->node = g_new0(panda_cb_list, 1);
+    w->node->entry = cb;
+    w->node->owner = plugin;
+    w->node->enabled = true;
+    w->type = type;
+    w->start_instr = start_instr;
+    w->end_instr = end_instr;
+    w->instrumentation = instrumentation;
+    w->open = false;
+    w->next = panda_windows;
+    panda_windows = w;
+    // windows open at the next boundary check, which also works out
+    // where the first boundary is
+    if (start_instr < panda_window_next_boundary)
+        panda_window_next_boundary = start_instr;
+}
+
+static void panda_unregister_windows(void *plugin) {
+    panda_cb_window **pw = &panda_windows;
+    while (*pw != NULL) {
+        panda_cb_window *w = *pw;
+        if (w->node->owner == plugin) {
+            if (w->open)
+                panda_cb_list_unlink(w->type, w->node);
+            *pw = w->next;
+            g_free(w->node);
+            g_free(w);
+        }
+        else {
+            pw = &w->next;
+        }
+    }
+    // Leave the instrumentation to the next boundary check
+    panda_window_next_boundary = 0;
 }
 
 void panda_unregister_callbacks(void *plugin) {
+    panda_cb_stats_unload(plugin);
+    // Windowed callbacks first, so an open one isn't freed twice
+    panda_unregister_windows(plugin);
     // Remove callbacks
     int i;
     for (i = 0; i < PANDA_CB_LAST; i++) {
@@ -210,18 +591,20 @@ void panda_unregister_callbacks(void *plugin) {
         while(plist != NULL) {
             if (plist->owner == plugin) {
                 panda_cb_list *old_plist = plist;
-                // Unlink
-                if (plist->prev)
-                    plist->prev->next = plist->next;
-                if (plist->next)
-                    plist->next->prev = plist->prev;
-                if (!plist->prev && !plist->next){
-                    // List is now empty
-                    panda_cbs[i] = NULL;
-                }
                 // Advance the pointer
                 plist = plist->next;
-                // Free the entry we just unlinked
+                // Unlink and free the entry
+                panda_cb_list_unlink(i, old_plist);
+                // Translated code may point into the plugin
+                if (i == PANDA_CB_INSN_TRANSLATE && panda_insn_actions_emitted) {
+                    panda_do_flush_tb();
+                }
+                if (old_plist->filter) {
+                    panda_memcb_flush_range(i, old_plist->filter);
+                    g_free(old_plist->filter);
+                    panda_memcb_nfiltered--;
+                    panda_do_flush_tb();
+                }
                 g_free(old_plist);
             }
             else {
@@ -243,6 +626,14 @@ void panda_enable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    // closed windows aren't on any list
+    panda_cb_window *w;
+    for (w = panda_windows; w != NULL; w = w->next) {
+        if (w->node->owner == plugin) {
+            w->node->enabled = true;
+        }
+    }
+    panda_cb_tables_rebuild();
 }
 
 void panda_disable_plugin(void *plugin) {
@@ -257,6 +648,14 @@ void panda_disable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    // closed windows aren't on any list
+    panda_cb_window *w;
+    for (w = panda_windows; w != NULL; w = w->next) {
+        if (w->node->owner == plugin) {
+            w->node->enabled = false;
+        }
+    }
+    panda_cb_tables_rebuild();
 }
 
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
@@ -276,6 +675,10 @@ panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
 bool panda_flush_tb(void) {
     if(panda_please_flush_tb) {
         panda_please_flush_tb = false;
+        // The blocks instrumented for them go with the flush
+        if (panda_memcb_pcs) {
+            g_array_set_size(panda_memcb_pcs, 0);
+        }
         return true;
     }
     else return false;
@@ -286,21 +689,32 @@ void panda_do_flush_tb(void) {
 }
 
 void panda_enable_precise_pc(void) {
+    panda_windows_disown(PANDA_WINDOW_PRECISE_PC);
     panda_update_pc = true;
 }
 
 void panda_disable_precise_pc(void) {
+    panda_windows_disown(PANDA_WINDOW_PRECISE_PC);
     panda_update_pc = false;
 }
 
 void panda_enable_memcb(void) {
+    panda_windows_disown(PANDA_WINDOW_MEMCB);
     panda_use_memcb = true;
 }
 
 void panda_disable_memcb(void) {
+    panda_windows_disown(PANDA_WINDOW_MEMCB);
     panda_use_memcb = false;
 }
 
+void panda_enable_insn_class(void) {
+    if (!panda_insn_classify) {
+        panda_insn_classify = true;
+        panda_do_flush_tb();
+    }
+}
+
 void panda_enable_tb_chaining(void){
     panda_tb_chaining = true;
 }
@@ -311,6 +725,7 @@ void panda_disable_tb_chaining(void){
 
 #ifdef CONFIG_LLVM
 void panda_enable_llvm(void){
+    panda_windows_disown(PANDA_WINDOW_LLVM);
     panda_do_flush_tb();
     execute_llvm = 1;
     generate_llvm = 1;
@@ -320,6 +735,7 @@ void panda_enable_llvm(void){
 extern CPUState *env;
 
 void panda_disable_llvm(void){
+    panda_windows_disown(PANDA_WINDOW_LLVM);
     execute_llvm = 0;
     generate_llvm = 0;
     tb_flush(env);
@@ -337,6 +753,349 @@ void panda_disable_llvm_helpers(void){
 
 #endif
 
+#ifdef CONFIG_SOFTMMU
+static void panda_windows_set_instrumentation(uint32_t wanted) {
+    uint32_t on = wanted & ~panda_window_owned;
+    uint32_t off = panda_window_owned & ~wanted;
+
+    if ((on & PANDA_WINDOW_MEMCB) && !panda_use_memcb) {
+        panda_enable_memcb();
+        panda_window_owned |= PANDA_WINDOW_MEMCB;
+        panda_do_flush_tb();
+    }
+    if (off & PANDA_WINDOW_MEMCB) {
+        panda_disable_memcb();
+        panda_window_owned &= ~PANDA_WINDOW_MEMCB;
+        panda_do_flush_tb();
+    }
+    if ((on & PANDA_WINDOW_PRECISE_PC) && !panda_update_pc) {
+        panda_enable_precise_pc();
+        panda_window_owned |= PANDA_WINDOW_PRECISE_PC;
+        panda_do_flush_tb();
+    }
+    if (off & PANDA_WINDOW_PRECISE_PC) {
+        panda_disable_precise_pc();
+        panda_window_owned &= ~PANDA_WINDOW_PRECISE_PC;
+        panda_do_flush_tb();
+    }
+#ifdef CONFIG_LLVM
+    if ((on & PANDA_WINDOW_LLVM) && !execute_llvm) {
+        panda_enable_llvm();
+        panda_window_owned |= PANDA_WINDOW_LLVM;
+    }
+    if (off & PANDA_WINDOW_LLVM) {
+        panda_disable_llvm();
+        panda_window_owned &= ~PANDA_WINDOW_LLVM;
+    }
+#endif
+}
+
+void panda_windows_update(void) {
+    uint64_t now = rr_get_guest_instr_count();
+    if (now < panda_window_next_boundary) return;
+
+    if (panda_window_clamped) {
+        // we stopped short of the next interrupt to get here; put it back,
+        // unless rr_fill_queue has set a real countdown since
+        if (rr_num_instr_before_next_interrupt == panda_window_clamp_at - now) {
+            if (panda_window_saved_interrupt == (uint64_t) -1)
+                rr_num_instr_before_next_interrupt = -1;
+            else
+                rr_num_instr_before_next_interrupt = panda_window_saved_interrupt - now;
+        }
+        panda_window_clamped = false;
+    }
+
+    uint32_t wanted = 0;
+    panda_cb_window *w;
+    for (w = panda_windows; w != NULL; w = w->next) {
+        bool inside = (now >= w->start_instr && now < w->end_instr);
+        if (inside && !w->open) {
+            panda_cb_list_link(w->type, w->node);
+            w->open = true;
+        }
+        else if (!inside && w->open) {
+            panda_cb_list_unlink(w->type, w->node);
+            w->open = false;
+        }
+        if (w->open) wanted |= w->instrumentation;
+    }
+    panda_windows_set_instrumentation(wanted);
+    panda_windows_recompute(now);
+}
+
+void panda_windows_clamp(TranslationBlock *tb) {
+    if (panda_window_next_boundary == (uint64_t) -1 || panda_window_clamped) return;
+    uint64_t now = rr_get_guest_instr_count();
+    uint64_t dist = panda_window_next_boundary - now;
+    // Only bother if the boundary lands inside this TB and before the next
+    // interrupt; the replay truncation in cpu_exec does the retranslation.
+    if (rr_num_instr_before_next_interrupt == 0 || tb->num_guest_insns <= dist ||
+        rr_num_instr_before_next_interrupt <= dist) return;
+    if (rr_num_instr_before_next_interrupt == (uint64_t) -1)
+        panda_window_saved_interrupt = -1;
+    else
+        panda_window_saved_interrupt = now + rr_num_instr_before_next_interrupt;
+    rr_num_instr_before_next_interrupt = dist;
+    panda_window_clamp_at = panda_window_next_boundary;
+    panda_window_clamped = true;
+}
+#endif
+
+static panda_insn_action *panda_insn_action_new(panda_insn_action_kind kind) {
+    assert(panda_insn_nactions < PANDA_INSN_ACTIONS_MAX);
+    panda_insn_action *a = &panda_insn_actions[panda_insn_nactions++];
+    memset(a, 0, sizeof(*a));
+    a->kind = kind;
+    return a;
+}
+
+void panda_insn_count(uint64_t *counter) {
+    panda_insn_action_new(PANDA_INSN_ACTION_COUNT)->counter = counter;
+}
+
+void panda_insn_record_pc(panda_pc_ring *ring) {
+    assert((ring->mask & (ring->mask + 1)) == 0);
+    panda_insn_action_new(PANDA_INSN_ACTION_RECORD_PC)->ring = ring;
+}
+
+void panda_insn_call_if(size_t env_offset, panda_insn_cond cond,
+                        target_ulong value,
+                        int (*fn)(CPUState *env, target_ulong pc)) {
+    assert(env_offset + sizeof(target_ulong) <= sizeof(CPUState));
+    panda_insn_action *a = panda_insn_action_new(PANDA_INSN_ACTION_CALL_IF);
+    a->env_offset = env_offset;
+    a->cond = cond;
+    a->value = value;
+    a->fn = fn;
+}
+
+/*
+ * Filtered memory callbacks.
+ *
+ * These sit on the normal callback lists with a filter attached. They don't
+ * turn on panda_use_memcb; instead cpu_gen_code asks
+ * panda_memcb_tb_may_match() about every TB it translates, and only those
+ * that can hit a filter's PC range go through the instrumented helpers.
+ *
+ * A filter with an address range but no PC range can't pick TBs up front.
+ * tlb_set_page marks the TLB entries of the pages it covers with
+ * TLB_PANDA_MEMCB instead (panda_memcb_page_prot), so accesses to them leave
+ * the TCG fast path. An uninstrumented TB that makes one is retranslated
+ * (panda_memcb_retranslate) and the instruction's PC remembered here, so
+ * that the TBs containing it are instrumented until the next TB flush.
+ */
+
+// Large ranges are cheaper to flush from the TLB all at once
+#define PANDA_MEMCB_FLUSH_PAGES 64
+
+static inline bool panda_memcb_by_page(const panda_memcb_filter *f) {
+    return f->pc_end == 0 && f->addr_end != 0;
+}
+
+static inline bool panda_memcb_type_is_phys(int type) {
+    switch (type) {
+    case PANDA_CB_PHYS_MEM_READ:
+    case PANDA_CB_PHYS_MEM_WRITE:
+    case PANDA_CB_PHYS_MEM_BEFORE_READ:
+    case PANDA_CB_PHYS_MEM_BEFORE_WRITE:
+    case PANDA_CB_PHYS_MEM_AFTER_READ:
+    case PANDA_CB_PHYS_MEM_AFTER_WRITE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool panda_memcb_type_is_write(int type) {
+    switch (type) {
+    case PANDA_CB_VIRT_MEM_WRITE:
+    case PANDA_CB_PHYS_MEM_WRITE:
+    case PANDA_CB_VIRT_MEM_BEFORE_WRITE:
+    case PANDA_CB_PHYS_MEM_BEFORE_WRITE:
+    case PANDA_CB_VIRT_MEM_AFTER_WRITE:
+    case PANDA_CB_PHYS_MEM_AFTER_WRITE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Drops the TLB entries of the pages f marks, so they are refilled with
+// the current filters. Physical pages can't be looked up in the TLB.
+static void panda_memcb_flush_range(int type, const panda_memcb_filter *f) {
+#ifdef CONFIG_SOFTMMU
+    CPUState *cpu;
+    uint64_t page;
+    if (!panda_memcb_by_page(f)) return;
+    if (panda_memcb_type_is_phys(type) || f->addr_end <= f->addr_start ||
+        ((f->addr_end - 1) >> TARGET_PAGE_BITS) -
+        (f->addr_start >> TARGET_PAGE_BITS) >= PANDA_MEMCB_FLUSH_PAGES) {
+        for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+            tlb_flush(cpu, 1);
+        }
+        return;
+    }
+    for (page = f->addr_start & TARGET_PAGE_MASK; page < f->addr_end;
+         page += TARGET_PAGE_SIZE) {
+        for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+            tlb_flush_page(cpu, page);
+        }
+    }
+#endif
+}
+
+void panda_register_memcb_filtered(void *plugin, panda_cb_type type, panda_cb cb,
+                                   const panda_memcb_filter *filter) {
+    assert(type >= PANDA_CB_VIRT_MEM_READ && type <= PANDA_CB_PHYS_MEM_AFTER_WRITE);
+    assert(filter != NULL);
+    panda_cb_list *node = g_new0(panda_cb_list, 1);
+    node->entry = cb;
+    node->owner = plugin;
+    node->enabled = true;
+    node->filter = g_memdup(filter, sizeof(*filter));
+    panda_memcb_nfiltered++;
+    panda_cb_list_link(type, node);
+    if (panda_memcb_by_page(filter)) {
+        panda_memcb_flush_range(type, filter);
+    } else {
+        panda_do_flush_tb();
+    }
+}
+
+/*
+ * Replaces the filter of the plugin's filtered callbacks of this type.
+ * The TB cache is flushed only if the choice of TBs to instrument changes,
+ * and a new address range only flushes the TLB entries of the pages it
+ * and the old one cover; plugins may move the address range as often as
+ * they like.
+ */
+void panda_update_memcb_filter(void *plugin, panda_cb_type type,
+                               const panda_memcb_filter *filter) {
+    panda_cb_list *plist;
+    panda_memcb_filter old;
+    bool flush = false;
+    assert(type >= PANDA_CB_VIRT_MEM_READ && type <= PANDA_CB_PHYS_MEM_AFTER_WRITE);
+    for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->owner != plugin || plist->filter == NULL) continue;
+        old = *plist->filter;
+        if (old.pc_start != filter->pc_start || old.pc_end != filter->pc_end ||
+            (old.addr_end == 0) != (filter->addr_end == 0)) {
+            flush = true;
+        }
+        // the callback tables point at this copy
+        *plist->filter = *filter;
+        if (old.addr_start != filter->addr_start ||
+            old.addr_end != filter->addr_end ||
+            panda_memcb_by_page(&old) != panda_memcb_by_page(filter)) {
+            panda_memcb_flush_range(type, &old);
+            panda_memcb_flush_range(type, filter);
+        }
+    }
+    if (flush) {
+        panda_do_flush_tb();
+    }
+}
+
+#ifdef CONFIG_SOFTMMU
+panda_mem_access panda_mem_batch_buf[PANDA_MEM_BATCH_SIZE];
+size_t panda_mem_batch_len = 0;
+
+void panda_mem_batch_flush(CPUState *env) {
+    panda_cb_entry *plist;
+    // Reset first: a callback that touches guest memory mustn't recurse
+    size_t n = panda_mem_batch_len;
+    panda_mem_batch_len = 0;
+    PANDA_CB_FOREACH(plist, PANDA_CB_MEM_BATCH) {
+        plist->entry.mem_batch(env, panda_mem_batch_buf, n);
+    }
+}
+
+bool panda_memcb_gen = false;
+
+// Index of the first remembered PC >= pc
+static guint panda_memcb_pc_index(target_ulong pc) {
+    guint lo = 0, hi = panda_memcb_pcs->len;
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        if (g_array_index(panda_memcb_pcs, target_ulong, mid) < pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void panda_memcb_watch_pc(target_ulong pc) {
+    guint i;
+    if (panda_memcb_pcs == NULL) {
+        panda_memcb_pcs = g_array_new(FALSE, FALSE, sizeof(target_ulong));
+    }
+    i = panda_memcb_pc_index(pc);
+    if (i < panda_memcb_pcs->len &&
+        g_array_index(panda_memcb_pcs, target_ulong, i) == pc) {
+        return;
+    }
+    g_array_insert_val(panda_memcb_pcs, i, pc);
+}
+
+bool panda_memcb_tb_may_match(TranslationBlock *tb) {
+    int i;
+    guint j;
+    panda_cb_list *plist;
+    if (panda_memcb_nfiltered == 0) return false;
+    // Disabled plugins count too, so enabling one needn't flush
+    for (i = PANDA_CB_VIRT_MEM_READ; i <= PANDA_CB_PHYS_MEM_AFTER_WRITE; i++) {
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            panda_memcb_filter *f = plist->filter;
+            if (f == NULL) continue;
+            if (f->pc_end == 0) {
+                // An address range is left to the TLB
+                if (f->addr_end == 0) return true;
+                continue;
+            }
+            if (tb->pc < f->pc_end && tb->pc + tb->size > f->pc_start) {
+                return true;
+            }
+        }
+    }
+    if (panda_memcb_pcs == NULL) return false;
+    j = panda_memcb_pc_index(tb->pc);
+    return j < panda_memcb_pcs->len &&
+        g_array_index(panda_memcb_pcs, target_ulong, j) < tb->pc + tb->size;
+}
+
+int panda_memcb_page_prot(target_ulong vaddr, target_phys_addr_t paddr) {
+    int i, prot = 0;
+    uint64_t page;
+    panda_cb_list *plist;
+    if (panda_memcb_nfiltered == 0) return 0;
+    for (i = PANDA_CB_VIRT_MEM_READ; i <= PANDA_CB_PHYS_MEM_AFTER_WRITE; i++) {
+        page = panda_memcb_type_is_phys(i) ? paddr : vaddr;
+        page &= TARGET_PAGE_MASK;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            panda_memcb_filter *f = plist->filter;
+            if (f == NULL || !panda_memcb_by_page(f)) continue;
+            if (page < f->addr_end && page + TARGET_PAGE_SIZE > f->addr_start) {
+                prot |= panda_memcb_type_is_write(i) ? PAGE_WRITE : PAGE_READ;
+            }
+        }
+    }
+    return prot;
+}
+
+target_ulong panda_current_asid(CPUState *env) {
+#if defined(TARGET_I386)
+    return env->cr[3];
+#elif defined(TARGET_ARM)
+    return env->cp15.c2_base0;
+#else
+    return 0;
+#endif
+}
+#endif
+
 void panda_memsavep(FILE *f) {
 #ifdef CONFIG_SOFTMMU
     if (!f) return;
@@ -596,11 +1355,34 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
-    panda_cb_list *plist;
+    panda_cb_entry *plist;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(plist, PANDA_CB_MONITOR) {
         plist->entry.monitor(mon, cmd);
     }
 }
 
+static void hmp_panda_print_stat(const panda_cb_stat *st, void *opaque) {
+    Monitor *mon = opaque;
+    monitor_printf(mon, "%-24s %-28s %12" PRIu64 " %12.3f %10.1f\n",
+                   st->plugin_name[0] ? st->plugin_name : "?",
+                   st->type < 0 ? st->ppp_name : panda_cb_type_name(st->type),
+                   st->calls, st->ns / 1e9, (double) st->ns / st->calls);
+}
+
+void hmp_panda_plugin_profile(Monitor *mon, const QDict *qdict) {
+    const char *action = qdict_get_try_str(qdict, "action");
+    if (action && strcmp(action, "on") == 0) {
+        panda_cb_prof_enable(true);
+    }
+    else if (action && strcmp(action, "off") == 0) {
+        panda_cb_prof_enable(false);
+    }
+    else {
+        monitor_printf(mon, "%-24s %-28s %12s %12s %10s\n",
+                       "plugin", "callback", "calls", "seconds", "ns/call");
+        panda_cb_prof_foreach(hmp_panda_print_stat, mon);
+    }
+}
+
 #endif // CONFIG_SOFTMMU
@@ -50,7 +50,6 @@ typedef enum panda_cb_type {
     PANDA_CB_PHYS_MEM_AFTER_READ,     
     PANDA_CB_PHYS_MEM_AFTER_WRITE,    
 
-
     PANDA_CB_HD_READ,           // Each HDD read
     PANDA_CB_HD_WRITE,          // Each HDD write
     PANDA_CB_GUEST_HYPERCALL,   // Hypercall from the guest (e.g. CPUID)
@@ -72,9 +71,21 @@ typedef enum panda_cb_type {
     PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM,  // in replay, just before RAM case of cpu_physical_mem_rw
     PANDA_CB_REPLAY_AFTER_CPU_PHYSICAL_MEM_RW_RAM,   // in replay, just after RAM case of cpu_physical_mem_rw
     PANDA_CB_REPLAY_HANDLE_PACKET,    // in replay, packet in / out
+    // new types go here, so the values of the ones above don't change
+    PANDA_CB_MEM_BATCH,         // Memory accesses of a block, all at once
     PANDA_CB_LAST
 } panda_cb_type;
 
+// One load or store, as delivered to PANDA_CB_MEM_BATCH
+typedef struct panda_mem_access {
+    target_ulong pc;
+    target_ulong vaddr;
+    target_phys_addr_t paddr;
+    uint64_t value;         // zero-extended
+    uint8_t size;
+    uint8_t is_write;
+} panda_mem_access;
+
 // Union of all possible callback function types
 typedef union panda_cb {
     /* Callback ID: PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT
@@ -191,7 +202,9 @@ typedef union panda_cb {
         This instrumentation is implemented by generating a call to a
         helper function just before the instruction itself is generated.
         This is fairly expensive, which is why it's only enabled via
-        the PANDA_CB_INSN_TRANSLATE callback.
+        the PANDA_CB_INSN_TRANSLATE callback. Plugins that only count
+        or log instructions should use the inline actions instead
+        (panda_insn_count() and friends).
     
     */
     int (*insn_exec)(CPUState *env, target_ulong pc);
@@ -467,6 +480,25 @@ typedef union panda_cb {
     */
     int (*phys_mem_after_write)(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
+/* Callback ID: PANDA_CB_MEM_BATCH
+
+       mem_batch: called with the memory accesses made since the last call,
+       at the end of each basic block that made any (and earlier if the
+       buffer fills up). Needs panda_enable_memcb(), like the other memory
+       callbacks. Accesses are in program order; pc is only exact with
+       precise PCs enabled.
+
+       Arguments:
+        CPUState *env: the current CPU state
+        const panda_mem_access *acc: the accesses
+        size_t n: number of entries in acc
+
+       Return value:
+        unused
+
+    */
+    int (*mem_batch)(CPUState *env, const panda_mem_access *acc, size_t n);
+
     
 
 
@@ -692,8 +724,74 @@ typedef union panda_cb {
  */
   int (*replay_net_transfer)(CPUState *env, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes);
 
+  /* Any of the above, for code that doesn't care which one it is */
+  void *cbaddr;
+
 } panda_cb;
 
+// Inline instruction actions. Called from a PANDA_CB_INSN_TRANSLATE
+// callback, these add code that runs before the instruction being
+// translated, without the helper call PANDA_CB_INSN_EXEC needs. Whatever
+// they point to must stay valid until the plugin is unloaded.
+typedef struct panda_pc_ring {
+    target_ulong *buf;  // mask + 1 entries
+    uint32_t mask;      // size - 1, size a power of two
+    uint32_t pos;       // total number of PCs recorded
+} panda_pc_ring;
+
+typedef enum panda_insn_cond {
+    PANDA_INSN_IF_EQ,
+    PANDA_INSN_IF_NE,
+    PANDA_INSN_IF_LTU,
+    PANDA_INSN_IF_GEU,
+} panda_insn_cond;
+
+// ++*counter
+void panda_insn_count(uint64_t *counter);
+// ring->buf[ring->pos++ & ring->mask] = pc
+void panda_insn_record_pc(panda_pc_ring *ring);
+// fn(env, pc), but only if the target_ulong at env_offset in CPUState
+// compares to value as cond says
+void panda_insn_call_if(size_t env_offset, panda_insn_cond cond,
+                        target_ulong value,
+                        int (*fn)(CPUState *env, target_ulong pc));
+
+typedef enum panda_insn_action_kind {
+    PANDA_INSN_ACTION_COUNT,
+    PANDA_INSN_ACTION_RECORD_PC,
+    PANDA_INSN_ACTION_CALL_IF,
+} panda_insn_action_kind;
+
+typedef struct panda_insn_action {
+    panda_insn_action_kind kind;
+    uint64_t *counter;
+    panda_pc_ring *ring;
+    size_t env_offset;
+    panda_insn_cond cond;
+    target_ulong value;
+    int (*fn)(CPUState *env, target_ulong pc);
+} panda_insn_action;
+
+// Actions queued for the instruction being translated; emitted and
+// cleared by gen_panda_insn_actions() (panda_insn_gen.h)
+#define PANDA_INSN_ACTIONS_MAX 16
+extern panda_insn_action panda_insn_actions[PANDA_INSN_ACTIONS_MAX];
+extern int panda_insn_nactions;
+// Set once generated code refers to plugin data
+extern bool panda_insn_actions_emitted;
+
+// Predicate for a filtered memory callback; see
+// panda_register_memcb_filtered(). Zeroed fields match anything.
+typedef struct panda_memcb_filter {
+    uint64_t addr_start;    // [addr_start, addr_end) of the accessed address,
+    uint64_t addr_end;      // virtual or physical as the callback type says
+    target_ulong pc_start;  // [pc_start, pc_end) of the accessing code
+    target_ulong pc_end;
+    target_ulong asid;      // only checked if match_asid
+    bool match_asid;
+    uint32_t sizes;         // OR of the access sizes (1|2|4|8) to match
+} panda_memcb_filter;
+
 // Doubly linked list that stores a callback, along with its owner
 typedef struct _panda_cb_list panda_cb_list;
 struct _panda_cb_list {
@@ -702,11 +800,67 @@ struct _panda_cb_list {
     panda_cb_list *next;
     panda_cb_list *prev;
     bool enabled;
+    panda_memcb_filter *filter;     // NULL unless registered filtered
 };
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist);
 void panda_enable_plugin(void *plugin);
 void panda_disable_plugin(void *plugin);
 
+// Call count and time spent in one plugin's callbacks of one type, kept
+// while panda_cb_profiling is on. PPP callbacks (PPP_RUN_CB) get one per
+// callback function, with type -1.
+typedef struct panda_cb_stat {
+    void *owner;            // plugin handle (NULL for PPP)
+    char plugin_name[256];  // filled in while the plugin is loaded
+    int type;
+    const char *ppp_name;   // PPP callback name
+    void *fn;               // PPP callback function
+    uint64_t calls;
+    uint64_t ns;
+} panda_cb_stat;
+
+// Flat copy of the enabled callbacks of one type, in list order and ended
+// by an entry whose cbaddr is NULL. The tables are rebuilt whenever the
+// lists above change, so hook sites walk an array instead of the list:
+//
+//     panda_cb_entry *plist;
+//     PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_EXEC) {
+//         plist->entry.before_block_exec(env, tb);
+//     }
+typedef struct panda_cb_entry {
+    panda_cb entry;
+    void *owner;
+    const panda_memcb_filter *filter;
+    panda_cb_stat *stat;
+} panda_cb_entry;
+
+extern panda_cb_entry *panda_cb_table[PANDA_CB_LAST];
+// Bit PANDA_CB_BIT(type) is set iff there is an enabled callback of that type
+extern uint64_t panda_cb_mask;
+extern bool panda_cb_profiling;
+
+#define PANDA_CB_BIT(type) (1ULL << (type))
+#define panda_cb_any(type) unlikely(panda_cb_mask & PANDA_CB_BIT(type))
+// With profiling on, every step of the walk goes through
+// panda_cb_prof_tick(), which times the callback just run
+#define PANDA_CB_FOREACH(pcb, type) \
+    for (pcb = panda_cb_table[type]; \
+         (unlikely(panda_cb_profiling) ? panda_cb_prof_tick(pcb) : true) && \
+         pcb->entry.cbaddr != NULL; \
+         pcb++)
+
+bool panda_cb_prof_tick(panda_cb_entry *pcb);
+void panda_cb_prof_enable(bool enable);
+uint64_t panda_cb_prof_clock(void);
+void panda_ppp_prof_charge(const char *name, void *fn, uint64_t ns);
+void panda_cb_prof_foreach(void (*fn)(const panda_cb_stat *st, void *opaque),
+                           void *opaque);
+const char *panda_cb_type_name(int type);
+
+// Frees tables replaced since the last call; only safe where no hook site
+// can be walking one (cpu_exec calls it between blocks)
+void panda_cb_tables_gc(void);
+
 // Structure to store metadata about a plugin
 typedef struct panda_plugin {
     char name[256];     // Currently basename(filename)
@@ -715,6 +869,32 @@ typedef struct panda_plugin {
 
 void   panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
 void   panda_unregister_callbacks(void *plugin);
+
+// Instrumentation a callback window needs while it is open
+#define PANDA_WINDOW_MEMCB      (1 << 0)
+#define PANDA_WINDOW_PRECISE_PC (1 << 1)
+#define PANDA_WINDOW_LLVM       (1 << 2)
+
+// Registers a callback that only runs during replay while the guest
+// instruction count is in [start_instr, end_instr). The instrumentation
+// flags are switched on when the window opens and off again once no open
+// window needs them.
+void   panda_register_callback_window(void *plugin, panda_cb_type type, panda_cb cb,
+                                      uint64_t start_instr, uint64_t end_instr,
+                                      uint32_t instrumentation);
+
+// Registers one of the PANDA_CB_{VIRT,PHYS}_MEM_* callbacks that only runs
+// for accesses matching filter (which is copied). Unlike callbacks used
+// with panda_enable_memcb(), this doesn't instrument every memory access:
+// only TBs whose code can match the filter's PC range are translated with
+// memory instrumentation, and the rest of the filter is checked before the
+// callback is called.
+void   panda_register_memcb_filtered(void *plugin, panda_cb_type type, panda_cb cb,
+                                     const panda_memcb_filter *filter);
+// Changes the filter of the plugin's filtered callbacks of this type. This
+// only flushes the TB cache if the PC range changes.
+void   panda_update_memcb_filter(void *plugin, panda_cb_type type,
+                                 const panda_memcb_filter *filter);
 bool   panda_load_plugin(const char *filename);
 bool   panda_add_arg(const char *arg, int arglen);
 void * panda_get_plugin_by_name(const char *name);
@@ -727,12 +907,55 @@ void   panda_unload_plugins(void);
 #ifdef CONFIG_SOFTMMU
 int panda_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf, int len, int is_write);
 target_phys_addr_t panda_virt_to_phys(CPUState *env, target_ulong addr);
+// Drop the virtual-to-physical cache used by panda_virtual_memory_rw and
+// panda_virt_to_phys. tlb_flush and tlb_flush_page already do this; call it
+// if you change guest page tables or MMU state behind QEMU's back.
+void panda_v2p_cache_flush(void);
 #endif
 
 // is_write == 1 means this is a write to the virtual memory addr of the contents of buf.
 // is_write == 0 is a read from that addr into buf.  
 int panda_virtual_memory_rw(CPUState *env, target_ulong addr, uint8_t *buf, int len, int is_write);
 
+// Instruction classification, done by the translators while
+// panda_insn_classify is on (panda_enable_insn_class()). During a
+// PANDA_CB_INSN_TRANSLATE callback, panda_cur_insn describes the
+// instruction being translated; afterwards each TB carries the classified
+// instruction it ends with in tb->panda_insn_{cls,pc,target}.
+typedef enum panda_insn_class {
+    PANDA_INSN_NONE = 0,
+    PANDA_INSN_CALL,            // direct or indirect call (incl. far call)
+    PANDA_INSN_RET,
+    PANDA_INSN_SYSCALL,         // syscall, sysenter, svc/swi
+    PANDA_INSN_SYSRET,          // sysret, sysexit
+    PANDA_INSN_INT,             // software interrupt (int n, int3, into)
+    PANDA_INSN_IRET,
+    PANDA_INSN_JMP_INDIRECT,
+} panda_insn_class;
+
+typedef struct panda_insn_info {
+    panda_insn_class cls;
+    target_ulong pc;
+    target_ulong target;        // direct branch target, or -1 if unknown
+} panda_insn_info;
+
+extern bool panda_insn_classify;
+extern panda_insn_info panda_cur_insn;
+// Turning it on flushes the TB cache so every block gets classified
+void panda_enable_insn_class(void);
+
+// Background work for plugins (panda_worker.c). The payload belongs to
+// PANDA once submitted and is released with free_fn (if any) after fn has
+// run on a worker thread. fn must not touch emulator state.
+typedef void (*panda_work_fn)(void *payload);
+// Run in submission order, one at a time, among the plugin's serial tasks
+#define PANDA_WORK_SERIAL (1 << 0)
+void panda_work_submit(void *plugin, panda_work_fn fn, void *payload,
+                       panda_work_fn free_fn, int flags);
+// Wait until the plugin's tasks (everyone's, if plugin is NULL) are done.
+// Must not be called from a task.
+void panda_work_flush(void *plugin);
+
 bool panda_flush_tb(void);
 
 void panda_do_flush_tb(void);
@@ -748,6 +971,34 @@ void panda_enable_tb_chaining(void);
 void panda_disable_tb_chaining(void);
 void panda_memsavep(FILE *f);
 
+#ifdef CONFIG_SOFTMMU
+// Called from cpu_exec during replay: open/close windows whose boundary has
+// been reached, and keep the next TB from running across a boundary.
+void panda_windows_update(void);
+void panda_windows_clamp(TranslationBlock *tb);
+
+extern uint64_t panda_window_next_boundary;
+
+// Accesses buffered for PANDA_CB_MEM_BATCH. TCG runs one CPU at a time and
+// the buffer is flushed at the end of every block, so it is never shared
+// between CPUs.
+#define PANDA_MEM_BATCH_SIZE 4096
+extern panda_mem_access panda_mem_batch_buf[PANDA_MEM_BATCH_SIZE];
+extern size_t panda_mem_batch_len;
+void panda_mem_batch_flush(CPUState *env);
+
+// Whether the TB being translated gets memory instrumentation. Set by
+// cpu_gen_code for each TB, before either the TCG backend or the LLVM
+// translator sees it, and read by both.
+extern bool panda_memcb_gen;
+bool panda_memcb_tb_may_match(TranslationBlock *tb);
+// PAGE_READ/PAGE_WRITE if filtered callbacks without a PC range watch
+// those accesses to the page; tlb_set_page marks them TLB_PANDA_MEMCB
+int panda_memcb_page_prot(target_ulong vaddr, target_phys_addr_t paddr);
+// Instruments the TBs containing pc from now on (panda_memcb_retranslate)
+void panda_memcb_watch_pc(target_ulong pc);
+#endif
+
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
@@ -788,4 +1039,54 @@ char** str_split(char* a_str, const char a_delim);
 char *panda_plugin_path(const char *name);
 void panda_require(const char *plugin_name);
 
+#ifdef CONFIG_SOFTMMU
+// Called from the softmmu helpers after each access while there is a
+// PANDA_CB_MEM_BATCH callback
+static inline void panda_mem_batch_add(CPUState *env, target_ulong vaddr,
+                                       target_phys_addr_t paddr, int size,
+                                       uint64_t value, bool is_write) {
+    panda_mem_access *a = &panda_mem_batch_buf[panda_mem_batch_len++];
+    a->pc = env->panda_guest_pc;
+    a->vaddr = vaddr;
+    a->paddr = paddr;
+    a->value = value;
+    a->size = size;
+    a->is_write = is_write;
+    if (unlikely(panda_mem_batch_len == PANDA_MEM_BATCH_SIZE)) {
+        panda_mem_batch_flush(env);
+    }
+}
+
+// Address space of the code currently running (CR3 on x86, TTBR0 on ARM)
+target_ulong panda_current_asid(CPUState *env);
+
+// Called from the softmmu helpers for every filtered memory callback.
+// Without precise PCs the PC range is checked against the current TB.
+static inline bool panda_memcb_match(const panda_memcb_filter *f,
+                                     CPUState *env, uint64_t addr, int size) {
+    if (likely(f == NULL)) return true;
+    if (f->sizes && !(f->sizes & size)) return false;
+    if (f->addr_end &&
+        (addr >= f->addr_end || addr + size <= f->addr_start)) {
+        return false;
+    }
+    if (f->pc_end) {
+        if (panda_update_pc) {
+            if (env->panda_guest_pc < f->pc_start ||
+                env->panda_guest_pc >= f->pc_end) {
+                return false;
+            }
+        }
+        else if (env->current_tb) {
+            TranslationBlock *tb = env->current_tb;
+            if (tb->pc >= f->pc_end || tb->pc + tb->size <= f->pc_start) {
+                return false;
+            }
+        }
+    }
+    if (f->match_asid && panda_current_asid(env) != f->asid) return false;
+    return true;
+}
+#endif
+
 #endif
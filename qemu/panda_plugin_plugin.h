@@ -3,6 +3,8 @@
 #define __PANDA_PLUGIN_PLUGIN_H_
 
 #include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 /*
 
@@ -85,6 +87,20 @@ void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) {	\
 extern cb_name##_t ppp_##cb_name##_cb[PPP_MAX_CB]; \
 extern int ppp_##cb_name##_num_cb;
 
+/*
+  Callback profiling, used by PPP_RUN_CB.  These are also declared in
+  panda_plugin.h, but plugins using PPP need not include that.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern bool panda_cb_profiling;
+uint64_t panda_cb_prof_clock(void);
+void panda_ppp_prof_charge(const char *name, void *fn, uint64_t ns);
+#ifdef __cplusplus
+}
+#endif
+
 /*
   And employ this where you want the callback functions to be called 
 */
@@ -94,7 +110,16 @@ extern int ppp_##cb_name##_num_cb;
     int ppp_cb_ind;							\
     for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
       if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
-	ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;			\
+        if (panda_cb_profiling) {					\
+          uint64_t ppp_t0 = panda_cb_prof_clock();			\
+	  ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;		\
+          panda_ppp_prof_charge(#cb_name,				\
+              (void *) ppp_##cb_name##_cb[ppp_cb_ind],			\
+              panda_cb_prof_clock() - ppp_t0);				\
+        }								\
+        else {								\
+	  ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;		\
+        }								\
       }									\
     }									\
   }
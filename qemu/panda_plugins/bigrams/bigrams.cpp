@@ -36,6 +36,7 @@ extern "C" {
 #include <algorithm>
 
 #include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
 #include "pandalog.h"
 #include "../callstack_instr/callstack_instr_ext.h"
 
@@ -60,7 +61,7 @@ struct text_counter {
     std::map<unsigned short,unsigned int> hist;
 };
 
-std::map<prog_point,text_counter> text_tracker;
+prog_point_map<text_counter> text_tracker;
 //FILE *text_memlog;
 
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
@@ -128,8 +129,9 @@ void uninit_plugin(void *self) {
     uint32_t target_ulong_size = sizeof(target_ulong);
     fwrite(&target_ulong_size, sizeof(uint32_t), 1, mem_report);
 
-    std::map<prog_point,text_counter>::iterator it;
-    for(it = text_tracker.begin(); it != text_tracker.end(); it++) {
+    std::vector<prog_point_map<text_counter>::entry *> sorted = text_tracker.sorted();
+    for(size_t i = 0; i < sorted.size(); i++) {
+        prog_point_map<text_counter>::entry *it = sorted[i];
         // Skip low-data entries
         if (it->second.num_bytes < 80) continue;
 
@@ -36,10 +36,13 @@ extern "C" {
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
-#include <list>
+#include <map>
+#include <vector>
 #include <fstream>
 #include <algorithm>
 
+#include "../common/prog_point_map.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
@@ -49,38 +52,167 @@ void uninit_plugin(void *);
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
+#include "bufmon_int_fns.h"
+
 }
 
 struct bufdesc { target_ulong buf; target_ulong size; target_ulong cr3; };
 
-std::list<bufdesc> bufs;
+// Buffers by id; removed ones have size 0 and their ids are reused
+std::vector<bufdesc> bufs;
+std::vector<uint32_t> free_ids;
+
+// The index: for each page of each address space, the buffers that
+// overlap it. An access touches at most two pages, so finding the buffers
+// it overlaps costs two lookups however many buffers there are.
+// page_bufs counts the buffers on each page over all address spaces, so
+// the (expensive) prog point is only computed for accesses to pages that
+// have some.
+#define BUF_PAGE_BITS 12
+
+typedef std::pair<target_ulong,target_ulong> asid_page;
+typedef hash_pair<target_ulong, target_ulong, hash_target_ulong, hash_target_ulong> hash_asid_page;
+prog_point_map<std::vector<uint32_t>, asid_page, hash_asid_page> buf_index;
+prog_point_map<uint32_t, target_ulong, hash_target_ulong> page_bufs;
+
+// Starts and ends of the buffers, for the range the callbacks are
+// filtered on
+std::map<target_ulong,int> buf_starts;
+std::map<target_ulong,int> buf_ends;
+panda_memcb_filter mem_filter;
+bool mem_enabled = true;
+void *plugin_self;
+
 FILE *mem_report;
 
+static inline target_ulong buf_last(const bufdesc &b) {
+    return b.buf + b.size - 1;
+}
+
+static void set_filter(uint64_t start, uint64_t end) {
+    if (start == mem_filter.addr_start && end == mem_filter.addr_end) return;
+    mem_filter.addr_start = start;
+    mem_filter.addr_end = end;
+    panda_update_memcb_filter(plugin_self, PANDA_CB_VIRT_MEM_READ, &mem_filter);
+    panda_update_memcb_filter(plugin_self, PANDA_CB_VIRT_MEM_WRITE, &mem_filter);
+}
+
+// Narrow the callbacks to the accesses that can hit a buffer. The filter
+// has no PC range, so PANDA only instruments the code that touches the
+// pages in it. With no buffers at all the callbacks are switched off and
+// the filter shrinks to the null page: a zeroed filter would instrument
+// every block.
+static void update_filter(void) {
+    if (buf_starts.empty()) {
+        set_filter(0, 1);
+        if (mem_enabled) panda_disable_plugin(plugin_self);
+        mem_enabled = false;
+        return;
+    }
+    uint64_t end = (uint64_t) buf_ends.rbegin()->first + 1;
+    // The end of a buffer up to the top of a 64-bit address space doesn't
+    // fit; an end of 0 would match anything
+    if (end == 0) end = ~(uint64_t) 0;
+    set_filter(buf_starts.begin()->first, end);
+    if (!mem_enabled) panda_enable_plugin(plugin_self);
+    mem_enabled = true;
+}
+
+static void count_bound(std::map<target_ulong,int> &m, target_ulong v, int d) {
+    int &n = m[v];
+    n += d;
+    if (n == 0) m.erase(v);
+}
+
+void bufmon_add_buffer(target_ulong buf, target_ulong size, target_ulong asid) {
+    if (size == 0) return;
+    bufdesc b = { buf, size, asid };
+    if (buf_last(b) < buf) {
+        // wraps around; keep what fits
+        b.size = -buf;
+    }
+    uint32_t id;
+    if (free_ids.empty()) {
+        id = bufs.size();
+        bufs.push_back(b);
+    }
+    else {
+        id = free_ids.back();
+        free_ids.pop_back();
+        bufs[id] = b;
+    }
+    for (target_ulong pg = b.buf >> BUF_PAGE_BITS; pg <= buf_last(b) >> BUF_PAGE_BITS; pg++) {
+        buf_index[asid_page(asid, pg)].push_back(id);
+        page_bufs[pg]++;
+        if (pg == (target_ulong) -1 >> BUF_PAGE_BITS) break;
+    }
+    count_bound(buf_starts, b.buf, 1);
+    count_bound(buf_ends, buf_last(b), 1);
+    update_filter();
+}
+
+int bufmon_remove_buffer(target_ulong buf, target_ulong asid) {
+    std::vector<uint32_t> *first = buf_index.find(asid_page(asid, buf >> BUF_PAGE_BITS));
+    if (first == NULL) return 0;
+    std::vector<uint32_t> gone;
+    for (size_t i = 0; i < first->size(); i++) {
+        bufdesc &b = bufs[(*first)[i]];
+        if (b.buf == buf && b.cr3 == asid) gone.push_back((*first)[i]);
+    }
+    for (size_t i = 0; i < gone.size(); i++) {
+        uint32_t id = gone[i];
+        bufdesc &b = bufs[id];
+        for (target_ulong pg = b.buf >> BUF_PAGE_BITS; pg <= buf_last(b) >> BUF_PAGE_BITS; pg++) {
+            std::vector<uint32_t> &ids = *buf_index.find(asid_page(asid, pg));
+            ids.erase(std::find(ids.begin(), ids.end(), id));
+            (*page_bufs.find(pg))--;
+            if (pg == (target_ulong) -1 >> BUF_PAGE_BITS) break;
+        }
+        count_bound(buf_starts, b.buf, -1);
+        count_bound(buf_ends, buf_last(b), -1);
+        b.size = 0;
+        free_ids.push_back(id);
+    }
+    if (!gone.empty()) update_filter();
+    return gone.size();
+}
+
+static void report(prog_point &p, target_ulong addr, target_ulong size,
+                   void *buf, bool is_write) {
+    fprintf(mem_report, "%s %" PRId64 " " TARGET_FMT_lx " " TARGET_FMT_lx " " 
+        TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx,
+        is_write ? "WRITE" : "READ", rr_get_guest_instr_count(),
+        p.caller, p.pc, p.cr3, addr, size);
+    for (size_t i = 0; i < size; i++) {
+        fprintf(mem_report, " %02x", *(((uint8_t *)buf)+i));
+    }
+    fprintf(mem_report, "\n");
+}
+
 int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf, bool is_write) {
+    target_ulong last = addr + size - 1;
+    target_ulong pg_first = addr >> BUF_PAGE_BITS, pg_last = last >> BUF_PAGE_BITS;
+    uint32_t *n_first = page_bufs.find(pg_first);
+    uint32_t *n_last = pg_last != pg_first ? page_bufs.find(pg_last) : NULL;
+    if ((n_first == NULL || *n_first == 0) && (n_last == NULL || *n_last == 0)) {
+        return 1;
+    }
+
     prog_point p = {};
     get_prog_point(env, &p);
 
-    std::list<bufdesc>::iterator it;
-    for(it = bufs.begin(); it != bufs.end(); it++) {
-        if (p.cr3 != it->cr3) continue;
-        target_ulong buf_first, buf_last;
-        buf_first = it->buf;
-        buf_last = it->buf + it->size - 1;
-        if ((addr <= buf_first && buf_first < addr+size) ||
-            (addr <= buf_last && buf_last < addr+size)   ||
-            (buf_first <= addr && addr <= buf_last)      || 
-            (buf_first <= addr+size && addr+size <= buf_last)) {
-
-            fprintf(mem_report, "%s %" PRId64 " " TARGET_FMT_lx " " TARGET_FMT_lx " " 
-                TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx,
-                is_write ? "WRITE" : "READ", rr_get_guest_instr_count(),
-                p.caller, p.pc, p.cr3, addr, size);
-            for (size_t i = 0; i < size; i++) {
-                fprintf(mem_report, " %02x", *(((uint8_t *)buf)+i));
+    for (target_ulong pg = pg_first; ; pg = pg_last) {
+        std::vector<uint32_t> *ids = buf_index.find(asid_page(p.cr3, pg));
+        for (size_t i = 0; ids && i < ids->size(); i++) {
+            const bufdesc &b = bufs[(*ids)[i]];
+            // on the second page, skip what the first page already had
+            if (pg != pg_first && (b.buf >> BUF_PAGE_BITS) <= pg_first) continue;
+            if (b.buf <= last && addr <= buf_last(b)) {
+                report(p, addr, size, buf, is_write);
             }
-            fprintf(mem_report, "\n");
         }
+        if (pg == pg_last) break;
     }
  
     return 1;
@@ -99,40 +231,46 @@ bool init_plugin(void *self) {
 
     printf("Initializing plugin bufmon\n");
 
+    plugin_self = self;
+
     // Need this to get EIP with our callbacks
     panda_enable_precise_pc();
-    // Enable memory logging
-    panda_enable_memcb();
 
+    mem_report = fopen("buffer_taps.txt", "w");
+    if(!mem_report) {
+        perror("fopen");
+        return false;
+    }
+
+    if(!init_callstack_instr_api()) return false;
+
+    // Memory callbacks are filtered on the range the buffers span, so
+    // there is no panda_enable_memcb(); update_filter() keeps the range
+    // up to date as buffers come and go.
+    mem_filter.addr_end = 1;
+    pcb.virt_mem_read = mem_read_callback;
+    panda_register_memcb_filtered(self, PANDA_CB_VIRT_MEM_READ, pcb, &mem_filter);
+    pcb.virt_mem_write = mem_write_callback;
+    panda_register_memcb_filtered(self, PANDA_CB_VIRT_MEM_WRITE, pcb, &mem_filter);
+
+    // Buffers may also be added at runtime by other plugins, so the file
+    // is optional
     std::ifstream buffile("search_buffers.txt");
     if (!buffile) {
-        printf("Couldn't open search_buffers.txt; no buffers to search for. Exiting.\n");
-        return false;
+        printf("Couldn't open search_buffers.txt; waiting for buffers from other plugins.\n");
     }
 
     bufdesc b = {};
-    while (buffile >> std::hex >> b.buf) {
+    while (buffile && buffile >> std::hex >> b.buf) {
         buffile >> std::hex >> b.size;
         buffile >> std::hex >> b.cr3;
 
         printf("Adding buffer [" TARGET_FMT_lx "," TARGET_FMT_lx "), CR3=" TARGET_FMT_lx "\n",
                b.buf, b.buf+b.size, b.cr3);
-        bufs.push_back(b);
+        bufmon_add_buffer(b.buf, b.size, b.cr3);
     }
     buffile.close();
-
-    mem_report = fopen("buffer_taps.txt", "w");
-    if(!mem_report) {
-        perror("fopen");
-        return false;
-    }
-
-    if(!init_callstack_instr_api()) return false;
-
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    update_filter();
 
     return true;
 }
@@ -0,0 +1,3 @@
+typedef void target_ulong;
+
+#include "bufmon_int_fns.h"
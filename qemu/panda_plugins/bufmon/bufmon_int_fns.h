@@ -0,0 +1,16 @@
+#ifndef __BUFMON_INT_FNS_H__
+#define __BUFMON_INT_FNS_H__
+
+
+// Public interface
+
+// Start monitoring [buf, buf+size) in the address space asid (the CR3 of
+// get_prog_point, so 0 for kernel-mode accesses)
+void bufmon_add_buffer(target_ulong buf, target_ulong size, target_ulong asid);
+
+// Stop monitoring the buffers that start at buf in asid, e.g. when they
+// are freed. Returns how many there were.
+int bufmon_remove_buffer(target_ulong buf, target_ulong asid);
+
+
+#endif
@@ -13,11 +13,6 @@
 PANDAENDCOMMENT */
 #define __STDC_FORMAT_MACROS
 
-#include <distorm.h>
-namespace distorm {
-#include <mnemonics.h>
-}
-
 extern "C" {
 
 #include "config.h"
@@ -34,7 +29,6 @@ bool translate_callback(CPUState *env, target_ulong pc);
 int exec_callback(CPUState *env, target_ulong pc);
 int before_block_exec(CPUState *env, TranslationBlock *tb);
 int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next_tb);
-int after_block_translate(CPUState *env, TranslationBlock *tb);
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
@@ -99,9 +93,6 @@ typedef target_ulong stackid;
 std::map<stackid, std::vector<stack_entry>> callstacks;
 // stackid -> function entry points
 std::map<stackid, std::vector<target_ulong>> function_stacks;
-// EIP -> instr_type
-std::map<target_ulong, instr_type> call_cache;
-int last_ret_size = 0;
 
 static inline bool in_kernelspace(CPUState *env) {
 #if defined(TARGET_I386)
@@ -199,98 +190,17 @@ static stackid get_stackid(CPUState *env, target_ulong addr) {
 #endif
 }
 
-instr_type disas_block(CPUState* env, target_ulong pc, int size) {
-    unsigned char *buf = (unsigned char *) malloc(size);
-    int err = panda_virtual_memory_rw(env, pc, buf, size, 0);
-    if (err == -1) printf("Couldn't read TB memory!\n");
-    instr_type res = INSTR_UNKNOWN;
-
-#if defined(TARGET_I386)
-    _DInst dec[256];
-    unsigned int dec_count = 0;
-    _DecodeType dt = (env->hflags & HF_LMA_MASK) ? Decode64Bits : Decode32Bits;
-
-    _CodeInfo ci;
-    ci.code = buf;
-    ci.codeLen = size;
-    ci.codeOffset = pc;
-    ci.dt = dt;
-    ci.features = DF_NONE;
-
-    distorm_decompose(&ci, dec, 256, &dec_count);
-    for (int i = dec_count - 1; i >= 0; i--) {
-        if (dec[i].flags == FLAG_NOT_DECODABLE) {
-            continue;
-        }
-
-        if (META_GET_FC(dec[i].meta) == FC_CALL) {
-            res = INSTR_CALL;
-            goto done;
-        }
-        else if (META_GET_FC(dec[i].meta) == FC_RET) {
-            // Ignore IRETs
-            if (dec[i].opcode == distorm::I_IRET) {
-                res = INSTR_UNKNOWN;
-            }
-            else {
-                // For debugging only
-                if (dec[i].ops[0].type == O_IMM)
-                    last_ret_size = dec[i].imm.sdword;
-                else
-                    last_ret_size = 0;
-                res = INSTR_RET;
-            }
-            goto done;
-        }
-        else if (META_GET_FC(dec[i].meta) == FC_SYS) {
-            res = INSTR_UNKNOWN;
-            goto done;
-        }
-        else {
-            res = INSTR_UNKNOWN;
-            goto done;
-        }
+// The translator records the control transfer that ends each TB (see
+// panda_enable_insn_class), so no separate disassembly pass is needed.
+static instr_type tb_instr_type(TranslationBlock *tb) {
+    switch (tb->panda_insn_cls) {
+    case PANDA_INSN_CALL:
+        return INSTR_CALL;
+    case PANDA_INSN_RET:
+        return INSTR_RET;
+    default:
+        return INSTR_UNKNOWN;
     }
-#elif defined(TARGET_ARM)
-    // Pretend thumb mode doesn't exist for now
-    // Pretend conditional execution doesn't exist for now
-    // This is super half-assed right now
-    
-    unsigned char *cur_instr;
-    for (cur_instr = buf+size-4; cur_instr >= buf; cur_instr -= 4) {
-        // Note: little-endian!
-        if (cur_instr[3] == 0xe1 &&
-            cur_instr[2] == 0x2f &&
-            cur_instr[1] == 0xff &&
-            cur_instr[0] == 0x1e) { // bx lr
-            res = INSTR_RET;
-            goto done;
-        }
-        else if ((cur_instr[3] & 0x0f) == 0x0b) {// bl
-            res = INSTR_CALL;
-            goto done;
-        }
-        else if (cur_instr[3] == 0xe1 &&
-                 cur_instr[2] == 0xa0 &&
-                 cur_instr[1] == 0xe0 &&
-                 cur_instr[0] == 0x0f) { // mov lr, pc
-            res = INSTR_CALL;
-            goto done;
-        }
-        else
-            continue;
-    }
-#endif
-
-done:
-    free(buf);
-    return res;
-}
-
-int after_block_translate(CPUState *env, TranslationBlock *tb) {
-    call_cache[tb->pc] = disas_block(env, tb->pc, tb->size);
-    
-    return 1;
 }
 
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
@@ -315,7 +225,7 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
 }
 
 int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next) {
-    instr_type tb_type = call_cache[tb->pc];
+    instr_type tb_type = tb_instr_type(tb);
 
     if (tb_type == INSTR_CALL) {
         stack_entry se = {tb->pc+tb->size,tb_type};
@@ -428,9 +338,8 @@ bool init_plugin(void *self) {
 
     panda_enable_memcb();
     panda_enable_precise_pc();
+    panda_enable_insn_class();
 
-    pcb.after_block_translate = after_block_translate;
-    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
     pcb.after_block_exec = after_block_exec;
     panda_register_callback(self, PANDA_CB_AFTER_BLOCK_EXEC, pcb);
     pcb.before_block_exec = before_block_exec;
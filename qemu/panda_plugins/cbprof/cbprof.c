@@ -0,0 +1,63 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+// Turns on PANDA callback cost accounting for the whole run and reports
+// it when unloaded: calls and time per (plugin, callback type), and per
+// PPP callback. The same numbers are available at any time with the
+// plugin_profile monitor command.
+
+#include "config.h"
+#include "qemu-common.h"
+#include "monitor.h"
+#include "cpu.h"
+
+#include "panda_plugin.h"
+#include "pandalog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+static void print_stat(const panda_cb_stat *st, void *opaque) {
+    const char *cb = st->type < 0 ? st->ppp_name : panda_cb_type_name(st->type);
+    const char *plugin = st->plugin_name[0] ? st->plugin_name : "?";
+    printf("%-24s %-28s %12" PRIu64 " %12.3f %10.1f\n", plugin, cb,
+           st->calls, st->ns / 1e9, (double) st->ns / st->calls);
+    if (pandalog) {
+        Panda__CallbackCost cc = PANDA__CALLBACK_COST__INIT;
+        cc.plugin = (char *) plugin;
+        cc.callback = (char *) cb;
+        cc.calls = st->calls;
+        cc.ns = st->ns;
+        Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+        ple.callback_cost = &cc;
+        pandalog_write_entry(&ple);
+    }
+}
+
+bool init_plugin(void *self) {
+    printf("Initializing plugin cbprof\n");
+    panda_cb_prof_enable(true);
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    printf("cbprof: callback costs (times include nested callbacks)\n");
+    printf("%-24s %-28s %12s %12s %10s\n",
+           "plugin", "callback", "calls", "seconds", "ns/call");
+    panda_cb_prof_foreach(print_stat, NULL);
+    panda_cb_prof_enable(false);
+}
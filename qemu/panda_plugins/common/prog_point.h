@@ -11,6 +11,9 @@
  * See the COPYING file in the top-level directory. 
  * 
 PANDAENDCOMMENT */
+#ifndef __PROG_POINT_H_
+#define __PROG_POINT_H_
+
 struct prog_point {
     target_ulong caller;
     target_ulong pc;
@@ -27,18 +30,29 @@ struct prog_point {
 #endif
 };
 
-#ifdef __GXX_EXPERIMENTAL_CXX0X__
+#ifdef __cplusplus
+
+// Finalizer of MurmurHash3: every input bit affects every output bit
+static inline uint64_t prog_point_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
-#include <functional>
 struct hash_prog_point{
     size_t operator()(const prog_point &p) const
     {
-        size_t h1 = std::hash<target_ulong>()(p.caller);
-        size_t h2 = std::hash<target_ulong>()(p.pc);
-        size_t h3 = std::hash<target_ulong>()(p.cr3);
-        return h1 ^ h2 ^ h3;
+        // Distinct odd multipliers, so that swapping or repeating fields
+        // (caller == pc, cr3 == 0 for every user-mode tap) doesn't collide
+        return prog_point_mix((uint64_t) p.pc * 0x9e3779b97f4a7c15ULL
+                              ^ (uint64_t) p.caller * 0xc2b2ae3d27d4eb4fULL
+                              ^ (uint64_t) p.cr3 * 0x165667b19e3779f9ULL);
     }
 };
 
+#endif
 
 #endif
@@ -0,0 +1,163 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+#ifndef __PROG_POINT_MAP_H_
+#define __PROG_POINT_MAP_H_
+
+// Hash map for per-tap-point state in plugins that look their state up on
+// every memory access. Entries live in one array (open addressing, linear
+// probing), so a lookup is a hash and usually one cache line instead of a
+// walk down a std::map.
+//
+//   prog_point_map<text_counter> text_tracker;
+//   text_counter &tc = text_tracker[p];
+//
+// Like std::map, operator[] value-initializes missing entries, and entries
+// have ->first and ->second. Unlike std::map, inserting may move entries,
+// so references from operator[] are only good until the next insertion
+// into the same map. Nothing is ever erased. Iteration follows the table
+// and depends only on the keys and the order they were inserted in;
+// sorted() gives the entries in key order, for reports that used to come
+// out of a std::map.
+//
+// Other keys work with a hash functor, e.g.
+//   prog_point_map<int, target_ulong, hash_target_ulong>
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "prog_point.h"
+
+struct hash_target_ulong {
+    size_t operator()(target_ulong v) const {
+        return prog_point_mix((uint64_t) v);
+    }
+};
+
+template <typename K1, typename K2, typename H1 = hash_prog_point,
+          typename H2 = hash_prog_point>
+struct hash_pair {
+    size_t operator()(const std::pair<K1,K2> &p) const {
+        return prog_point_mix(H1()(p.first) * 0x9e3779b97f4a7c15ULL ^ H2()(p.second));
+    }
+};
+
+template <typename V, typename K = prog_point, typename H = hash_prog_point>
+class prog_point_map {
+public:
+    struct entry {
+        K first;
+        V second;
+        bool used;
+    };
+
+    class iterator {
+    public:
+        iterator(entry *e, entry *end) : e(e), end(end) { skip(); }
+        entry &operator*() const { return *e; }
+        entry *operator->() const { return e; }
+        iterator &operator++() { e++; skip(); return *this; }
+        bool operator==(const iterator &o) const { return e == o.e; }
+        bool operator!=(const iterator &o) const { return e != o.e; }
+    private:
+        void skip() { while (e != end && !e->used) e++; }
+        entry *e;
+        entry *end;
+    };
+
+    prog_point_map() : count(0) {}
+
+    V &operator[](const K &k) {
+        if (table.empty()) {
+            table.resize(64);
+        }
+        entry *e = slot(k);
+        if (e->used) {
+            return e->second;
+        }
+        // keep the load at most 3/4
+        if ((count + 1) * 4 > table.size() * 3) {
+            grow();
+            e = slot(k);
+        }
+        e->first = k;
+        e->second = V();
+        e->used = true;
+        count++;
+        return e->second;
+    }
+
+    // NULL if k is not in the map
+    V *find(const K &k) {
+        if (table.empty()) return NULL;
+        entry *e = slot(k);
+        return e->used ? &e->second : NULL;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        table.clear();
+        count = 0;
+    }
+
+    iterator begin() {
+        return table.empty() ? iterator(NULL, NULL)
+            : iterator(&table[0], &table[0] + table.size());
+    }
+    iterator end() {
+        return table.empty() ? iterator(NULL, NULL)
+            : iterator(&table[0] + table.size(), &table[0] + table.size());
+    }
+
+    // The entries, ordered by key. Good until the next insertion.
+    std::vector<entry *> sorted() {
+        std::vector<entry *> v;
+        v.reserve(count);
+        for (size_t i = 0; i < table.size(); i++) {
+            if (table[i].used) v.push_back(&table[i]);
+        }
+        std::sort(v.begin(), v.end(), key_less);
+        return v;
+    }
+
+private:
+    static bool key_less(const entry *a, const entry *b) {
+        return a->first < b->first;
+    }
+
+    // the slot holding k, or the empty slot where it would go
+    entry *slot(const K &k) {
+        size_t mask = table.size() - 1;
+        size_t i = H()(k) & mask;
+        while (table[i].used && !(table[i].first == k)) {
+            i = (i + 1) & mask;
+        }
+        return &table[i];
+    }
+
+    void grow() {
+        std::vector<entry> old(table.size() * 2);
+        old.swap(table);
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].used) *slot(old[i].first) = old[i];
+        }
+    }
+
+    std::vector<entry> table;
+    size_t count;
+};
+
+#endif
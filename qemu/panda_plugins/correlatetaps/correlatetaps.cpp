@@ -36,6 +36,7 @@ extern "C" {
 #include <algorithm>
 
 #include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
 #include "pandalog.h"
 #include "../callstack_instr/callstack_instr_ext.h"
 
@@ -58,7 +59,8 @@ struct recent_addr {
 #define HISTORY_SIZE 5
 recent_addr history[HISTORY_SIZE];
 int history_pos = 0;
-std::map<std::pair<prog_point,prog_point>,int> correlated;
+typedef std::pair<prog_point,prog_point> tap_pair;
+prog_point_map<int, tap_pair, hash_pair<prog_point,prog_point> > correlated;
 
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf) {
@@ -129,11 +131,12 @@ void uninit_plugin(void *self) {
         return;
     }
 
-    std::map<std::pair<prog_point,prog_point>,int>::iterator it;
-    for(it = correlated.begin(); it != correlated.end(); it++) {
-        fwrite(&it->first.first, sizeof(prog_point), 1, mem_report);
-        fwrite(&it->first.second, sizeof(prog_point), 1, mem_report);
-        fwrite(&it->second, sizeof(int), 1, mem_report);
+    std::vector<prog_point_map<int, tap_pair, hash_pair<prog_point,prog_point> >::entry *> sorted =
+        correlated.sorted();
+    for(size_t i = 0; i < sorted.size(); i++) {
+        fwrite(&sorted[i]->first.first, sizeof(prog_point), 1, mem_report);
+        fwrite(&sorted[i]->first.second, sizeof(prog_point), 1, mem_report);
+        fwrite(&sorted[i]->second, sizeof(int), 1, mem_report);
     }
     fclose(mem_report);
 }
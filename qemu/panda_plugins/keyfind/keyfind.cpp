@@ -34,6 +34,7 @@ extern "C" {
 #include <map>
 
 #include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
 #include "pandalog.h"
 #include "../callstack_instr/callstack_instr_ext.h"
     
@@ -98,7 +99,7 @@ struct key_buf {
 };
 
 std::set<prog_point> matches;
-std::map<prog_point,key_buf> key_tracker;
+prog_point_map<key_buf> key_tracker;
 
 bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo *server_random,
                StringInfo *enc_msg, StringInfo *version, StringInfo *content_type,
@@ -214,9 +215,9 @@ int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
     // XXX DEBUG: Just check the one we KNOW is correct
     //if(p.caller != 0x0000000074ce9788 || p.pc != 0x0000000074ce82ef || p.cr3 != 0x000000003f9650e0) return 1;
 
+    key_buf *k = &key_tracker[p];
     for (unsigned int i = 0; i < size; i++) {
         uint8_t val = ((uint8_t *)buf)[i];
-        key_buf *k = &key_tracker[p];
         k->key[k->start++] = val;
         if (k->start == sizeof(k->key)) {
             k->start = 0;
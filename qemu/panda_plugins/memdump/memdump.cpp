@@ -38,6 +38,9 @@ extern "C" {
 #include <unistd.h>
 #include <sys/types.h>
 
+#include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
@@ -49,27 +52,16 @@ int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_
 
 }
 
-struct prog_point {
-    target_ulong caller;
-    target_ulong pc;
-    target_ulong cr3;
-    bool operator <(const prog_point &p) const {
-        return (this->pc < p.pc) || \
-               (this->pc == p.pc && this->caller < p.caller) || \
-               (this->pc == p.pc && this->caller == p.caller && this->cr3 < p.cr3);
-    }
-};
-
 struct fpos { unsigned long off; };
-std::map<prog_point,fpos> read_tracker;
-std::map<prog_point,fpos> write_tracker;
+prog_point_map<fpos> read_tracker;
+prog_point_map<fpos> write_tracker;
 FILE *read_log, *write_log;
 unsigned char *read_buf, *write_buf;
 unsigned long read_sz, write_sz;
 
 int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf,
-                       std::map<prog_point,fpos> &tracker, unsigned char *log) {
+                       prog_point_map<fpos> &tracker, unsigned char *log) {
     prog_point p = {};
 #ifdef TARGET_I386
     panda_virtual_memory_rw(env, env->regs[R_EBP]+4, (uint8_t *)&p.caller, 4, 0);
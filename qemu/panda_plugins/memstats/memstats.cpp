@@ -41,26 +41,24 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+int mem_batch_callback(CPUState *env, const panda_mem_access *acc, size_t n);
 
 }
 
 uint64_t bytes_read, bytes_written;
 uint64_t num_reads, num_writes;
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    bytes_written += size;
-    num_writes++;
-
-    return 1;
-}
-
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    bytes_read += size;
-    num_reads++;
+int mem_batch_callback(CPUState *env, const panda_mem_access *acc, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (acc[i].is_write) {
+            bytes_written += acc[i].size;
+            num_writes++;
+        }
+        else {
+            bytes_read += acc[i].size;
+            num_reads++;
+        }
+    }
     return 1;
 }
 
@@ -72,10 +70,9 @@ bool init_plugin(void *self) {
     // Enable memory logging
     panda_enable_memcb();
 
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    // We only count, so take the accesses a block at a time
+    pcb.mem_batch = mem_batch_callback;
+    panda_register_callback(self, PANDA_CB_MEM_BATCH, pcb);
 
     return true;
 }
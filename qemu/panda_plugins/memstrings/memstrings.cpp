@@ -31,9 +31,16 @@ extern "C" {
 #include <zlib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <math.h>
-#include <map>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -41,8 +48,7 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+int mem_batch_callback(CPUState *env, const panda_mem_access *acc, size_t n);
 
 }
 
@@ -58,87 +64,219 @@ struct ustring_pos {
     uint16_t ch[MAX_STRLEN];
 };
 
-std::map<target_ulong,string_pos> read_text_tracker;
-std::map<target_ulong,string_pos> write_text_tracker;
-std::map<target_ulong,ustring_pos> read_utext_tracker;
-std::map<target_ulong,ustring_pos> write_utext_tracker;
+// the strings in progress at one pc, one lookup for both
+struct pc_strings {
+    string_pos a;
+    ustring_pos u;
+};
+
+// per pc
+prog_point_map<pc_strings, target_ulong, hash_target_ulong> read_tracker;
+prog_point_map<pc_strings, target_ulong, hash_target_ulong> write_tracker;
 
 gzFile mem_report = NULL;
 int min_strlen;
+void *plugin_self;
+
+// Output. Strings are formatted into a buffer; full buffers go to the
+// PANDA worker pool, where a serial task compresses and writes them, so
+// the guest thread never waits for zlib. If more than OUT_MAX_INFLIGHT
+// buffers are waiting, the guest thread waits for the writer.
+
+#define OUT_BUF_SIZE (1 << 20)
+#define OUT_MAX_INFLIGHT 8
+
+struct out_buf {
+    size_t len;
+    char data[OUT_BUF_SIZE];
+};
+
+out_buf *out_cur;
+int out_inflight;
+
+static void out_write_task(void *payload) {
+    out_buf *ob = (out_buf *) payload;
+    gzwrite(mem_report, ob->data, ob->len);
+    __sync_fetch_and_sub(&out_inflight, 1);
+}
+
+static void out_free(void *payload) {
+    free(payload);
+}
+
+static void out_submit(void) {
+    if (out_cur->len == 0) return;
+    if (__sync_fetch_and_add(&out_inflight, 1) >= OUT_MAX_INFLIGHT) {
+        panda_work_flush(plugin_self);
+    }
+    panda_work_submit(plugin_self, out_write_task, out_cur, out_free, PANDA_WORK_SERIAL);
+    out_cur = (out_buf *) malloc(sizeof(out_buf));
+    out_cur->len = 0;
+}
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, bool is_write) {
+// one line of the report: instr count, colon, string
+static void emit(const char *s, size_t n) {
+    if (out_cur->len + n + 32 > OUT_BUF_SIZE) {
+        out_submit();
+    }
+    out_cur->len += sprintf(out_cur->data + out_cur->len, "%" PRIu64 ":",
+                            rr_get_guest_instr_count());
+    memcpy(out_cur->data + out_cur->len, s, n);
+    out_cur->len += n;
+    out_cur->data[out_cur->len++] = '\n';
+}
 
-    string_pos &sp = is_write ? write_text_tracker[pc] : read_text_tracker[pc];
-    ustring_pos &usp = is_write ? write_utext_tracker[pc] : read_utext_tracker[pc];
+static void emit_ascii(string_pos &sp) {
+    emit((const char *) sp.ch, sp.nch);
+}
+
+static void emit_utf16(ustring_pos &usp) {
+    gsize bytes_written = 0;
+    gchar *out_str = g_convert((gchar *)usp.ch, usp.nch*2,
+        "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
+    if (out_str) {
+        emit(out_str, bytes_written);
+        g_free(out_str);
+    }
+}
+
+// Classifiers. Printable is isprint() in the C locale, 0x20-0x7e, and
+// for UTF-16 code units above that, iswprint(). With SSE2 16 bytes (or
+// 8 code units) are checked at once; the common case is that they all
+// are printable ASCII.
+
+// length of the run of printable bytes at the start of p[0..n)
+static inline size_t printable_run(const uint8_t *p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // signed compares, so bias the bytes by 0x80 first
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    const __m128i lo = _mm_set1_epi8((char) (0x1f ^ 0x80));
+    const __m128i hi = _mm_set1_epi8((char) (0x7f ^ 0x80));
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + i)), bias);
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        unsigned bad = ~_mm_movemask_epi8(ok) & 0xffff;
+        if (bad) return i + __builtin_ctz(bad);
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] < 0x20 || p[i] > 0x7e) break;
+    }
+    return i;
+}
 
-    // ASCII
-    for (unsigned int i = 0; i < size; i++) {
-        uint8_t val = ((uint8_t *)buf)[i];
-        if (isprint(val)) {
-            sp.ch[sp.nch++] = val;
+static inline bool printable_unit(uint16_t u) {
+    if (u < 0x80) return u >= 0x20 && u < 0x7f;
+    return iswprint(u);
+}
+
+// length of the run of printable UTF-16LE code units at the start of
+// the n units at p
+static inline size_t printable_run_utf16(const uint8_t *p, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+#ifdef __SSE2__
+        if (i + 8 <= n) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (p + 2*i));
+            __m128i ok = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16(0x1f)),
+                                       _mm_cmplt_epi16(v, _mm_set1_epi16(0x7f)));
+            if (_mm_movemask_epi8(ok) == 0xffff) {
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        if (!printable_unit(p[2*i] | (p[2*i+1] << 8))) break;
+        i++;
+    }
+    return i;
+}
+
+static void scan_ascii(string_pos &sp, const uint8_t *buf, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t run = printable_run(buf + i, n - i);
+        while (run > 0) {
+            size_t k = std::min(run, (size_t) (MAX_STRLEN - 1 - sp.nch));
+            memcpy(sp.ch + sp.nch, buf + i, k);
+            sp.nch += k;
+            i += k;
+            run -= k;
             // If we max out the string, chop it
             if (sp.nch == MAX_STRLEN - 1) {
-                gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), sp.nch, sp.ch);
+                emit_ascii(sp);
                 sp.nch = 0;
             }
         }
-        else {
+        if (i < n) {
             // Don't bother with strings shorter than min
             if (sp.nch >= min_strlen) {
-                gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), sp.nch, sp.ch);
+                emit_ascii(sp);
             }
             sp.nch = 0;
+            i++;
         }
     }
+}
 
-    // Don't consider one-byte reads/writes for UTF-16
-    if (size < 2) {
-        return 1;
-    }
-
-    // UTF-16-LE
-    for (unsigned int i = 0; i < size; i+=2) {
-        uint8_t vall = ((uint8_t *)buf)[i];
-        uint8_t valh = ((uint8_t *)buf)[i+1];
-        uint16_t val = (valh << 8) | vall;
-        if (iswprint(val)) {
-            usp.ch[usp.nch++] = val;
-            // If we max out the string, chop it
+// n code units at buf
+static void scan_utf16(ustring_pos &usp, const uint8_t *buf, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t run = printable_run_utf16(buf + 2*i, n - i);
+        while (run > 0) {
+            size_t k = std::min(run, (size_t) (MAX_STRLEN - 1 - usp.nch));
+            memcpy(usp.ch + usp.nch, buf + 2*i, 2*k);
+            usp.nch += k;
+            i += k;
+            run -= k;
             if (usp.nch == MAX_STRLEN - 1) {
-                gsize bytes_written = 0;
-                gchar *out_str = g_convert((gchar *)usp.ch, usp.nch*2,
-                    "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-                gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-                g_free(out_str);
+                emit_utf16(usp);
                 usp.nch = 0;
             }
         }
-        else {
-            // Don't bother with strings shorter than min
+        if (i < n) {
             if (usp.nch >= min_strlen) {
-                gsize bytes_written = 0;
-                gchar *out_str = g_convert((gchar *)usp.ch, usp.nch*2,
-                    "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-                gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-                g_free(out_str);
+                emit_utf16(usp);
             }
             usp.nch = 0;
+            i++;
         }
     }
-
-    return 1;
 }
 
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, false);
-
-}
+// The accesses of a block come in one batch. Consecutive accesses by the
+// same pc, e.g. a rep movs or a copy loop, continue the same strings, so
+// their bytes are gathered and classified together. One-byte accesses
+// don't count for UTF-16.
+#define GATHER_MAX 4096
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, true);
+int mem_batch_callback(CPUState *env, const panda_mem_access *acc, size_t n) {
+    static uint8_t bytes[GATHER_MAX];
+    static uint8_t wbytes[GATHER_MAX];
+    size_t i = 0;
+    while (i < n) {
+        target_ulong pc = acc[i].pc;
+        bool is_write = acc[i].is_write;
+        size_t nb = 0, nw = 0;
+        for (; i < n && acc[i].pc == pc && acc[i].is_write == is_write
+                 && nb + 8 <= GATHER_MAX; i++) {
+            // the value's bytes as they were in the callback's buffer
+            uint64_t v = acc[i].value;
+            for (unsigned k = 0; k < acc[i].size; k++) {
+                bytes[nb++] = v >> (8 * k);
+            }
+            if (acc[i].size >= 2) {
+                memcpy(wbytes + nw, bytes + nb - acc[i].size, acc[i].size);
+                nw += acc[i].size;
+            }
+        }
+        pc_strings &ps = is_write ? write_tracker[pc] : read_tracker[pc];
+        scan_ascii(ps.a, bytes, nb);
+        scan_utf16(ps.u, wbytes, nw / 2);
+    }
+    return 1;
 }
 
 bool init_plugin(void *self) {
@@ -159,50 +297,38 @@ bool init_plugin(void *self) {
         perror("fopen");
         return false;
     }
+    plugin_self = self;
+    out_cur = (out_buf *) malloc(sizeof(out_buf));
+    out_cur->len = 0;
 
     // Need this to get EIP with our callbacks
     panda_enable_precise_pc();
     // Enable memory logging
     panda_enable_memcb();
 
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    pcb.mem_batch = mem_batch_callback;
+    panda_register_callback(self, PANDA_CB_MEM_BATCH, pcb);
 
     return true;
 }
 
 void uninit_plugin(void *self) {
     // Save any that we haven't flushed yet
-    for (auto &kvp : read_text_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), kvp.second.nch, kvp.second.ch);
-        }
+    for (auto &kvp : read_tracker) {
+        if (kvp.second.a.nch > min_strlen) emit_ascii(kvp.second.a);
     }
-    for (auto &kvp : write_text_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), kvp.second.nch, kvp.second.ch);
-        }
+    for (auto &kvp : write_tracker) {
+        if (kvp.second.a.nch > min_strlen) emit_ascii(kvp.second.a);
     }
-    for (auto &kvp : read_utext_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gsize bytes_written = 0;
-            gchar *out_str = g_convert((gchar *)kvp.second.ch, kvp.second.nch*2,
-                "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-            gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-            g_free(out_str);
-        }
+    for (auto &kvp : read_tracker) {
+        if (kvp.second.u.nch > min_strlen) emit_utf16(kvp.second.u);
     }
-    for (auto &kvp : write_utext_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gsize bytes_written = 0;
-            gchar *out_str = g_convert((gchar *)kvp.second.ch, kvp.second.nch*2,
-                "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-            gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-            g_free(out_str);
-        }
+    for (auto &kvp : write_tracker) {
+        if (kvp.second.u.nch > min_strlen) emit_utf16(kvp.second.u);
     }
+    out_submit();
+    panda_work_flush(self);
+    free(out_cur);
 
     gzclose(mem_report);
 }
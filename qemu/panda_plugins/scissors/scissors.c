@@ -4,6 +4,10 @@
  * to control beginning and end of new replay. Output goes to
  * a new replay named "scissors" by default (-panda-arg scissors:name
  * to change)
+ *
+ * If the recording has replay checkpoints (see -replay-checkpoints),
+ * replay starts from the last one before start instead of from the
+ * beginning of the recording.
  */
 
 #include <stdio.h>
@@ -41,6 +45,8 @@ static bool done = false;
 static RR_prog_point copy_entry(void);
 static void sassert(bool condition);
 
+#define SCISSORS_IO_BUF_SIZE (1 << 20)
+
 static void sassert(bool condition) {
     if (!condition) {
         printf("Assertion failure @ count %lu!\n", entry.header.prog_point.guest_instr_count);
@@ -100,19 +106,18 @@ static void write_entry(RR_log_entry *item) {
                     case RR_CALL_CPU_MEM_RW:
                         sassert(fwrite(&(args->variant.cpu_mem_rw_args),
                                     sizeof(args->variant.cpu_mem_rw_args), 1, newlog) == 1);
-                        //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
-                        //mz read the buffer
+                        //mz the queued entry already holds the buffer (possibly
+                        //mz mapped from the payload store); always write it inline
                         sassert(fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, newlog) > 0);
+                                    args->variant.cpu_mem_rw_args.len, newlog) ==
+                                args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         sassert(fwrite(&(args->variant.cpu_mem_unmap),
                                     sizeof(args->variant.cpu_mem_unmap), 1, newlog) == 1);
                         sassert(fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, newlog) > 0);
-                        //free(args->variant.cpu_mem_unmap.buf);
+                                    args->variant.cpu_mem_unmap.len, newlog) ==
+                                args->variant.cpu_mem_unmap.len);
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
@@ -133,10 +138,9 @@ static void write_entry(RR_log_entry *item) {
                     case RR_CALL_HANDLE_PACKET:
                         sassert(fwrite(&(args->variant.handle_packet_args), 
                                     sizeof(args->variant.handle_packet_args), 1, newlog) == 1);
-                        sassert(fwrite(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    newlog) == 1 /*> 0*/);
-                        //free(args->variant.handle_packet_args.buf);
+                        sassert(fwrite(args->variant.handle_packet_args.buf, 1,
+                                    args->variant.handle_packet_args.size,
+                                    newlog) == args->variant.handle_packet_args.size);
                         break;
 
                     default:
@@ -155,6 +159,25 @@ static void write_entry(RR_log_entry *item) {
     }
 }
 
+// Copy a device buffer from the old log to the new one. Buffers kept in the
+// payload store are written inline, since the new replay has no store.
+static void copy_payload(uint64_t len) {
+    uint8_t buf[4096];
+    if (rr_payload_is_ref(rr_nondet_log->deduped, len)) {
+        RR_payload_ref ref;
+        sassert(fread(&ref, sizeof(ref), 1, oldlog) == 1);
+        sassert(ref + len <= rr_nondet_log->payload_size);
+        sassert(fwrite(rr_nondet_log->payload_base + ref, 1, len, newlog) == len);
+        return;
+    }
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(buf));
+        sassert(fread(buf, 1, n, oldlog) == n);
+        sassert(fwrite(buf, 1, n, newlog) == n);
+        len -= n;
+    }
+}
+
 // Returns guest instr count (in old replay counting mode)
 static RR_prog_point copy_entry(void) {
     // Code copied from rr_log.c.
@@ -233,26 +256,14 @@ static RR_prog_point copy_entry(void) {
                                     sizeof(args->variant.cpu_mem_rw_args), 1, oldlog) == 1);
                         sassert(fwrite(&(args->variant.cpu_mem_rw_args),
                                     sizeof(args->variant.cpu_mem_rw_args), 1, newlog) == 1);
-                        //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
-                        //mz read the buffer
-                        sassert(fread(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, oldlog) > 0);
-                        sassert(fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, newlog) > 0);
+                        copy_payload(args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         sassert(fread(&(args->variant.cpu_mem_unmap),
                                     sizeof(args->variant.cpu_mem_unmap), 1, oldlog) == 1);
                         sassert(fwrite(&(args->variant.cpu_mem_unmap),
                                     sizeof(args->variant.cpu_mem_unmap), 1, newlog) == 1);
-                        args->variant.cpu_mem_unmap.buf = malloc(args->variant.cpu_mem_unmap.len);
-                        sassert(fread(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, oldlog) > 0);
-                        sassert(fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, newlog) > 0);
-                        //free(args->variant.cpu_mem_unmap.buf);
+                        copy_payload(args->variant.cpu_mem_unmap.len);
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
@@ -281,20 +292,7 @@ static RR_prog_point copy_entry(void) {
                                     sizeof(args->variant.handle_packet_args), 1, oldlog) == 1);
                         sassert(fwrite(&(args->variant.handle_packet_args), 
                                     sizeof(args->variant.handle_packet_args), 1, newlog) == 1);
-                        //mz XXX HACK
-                        args->old_buf_addr = (uint64_t) args->variant.handle_packet_args.buf;
-                        //mz buffer length in args->variant.cpu_mem_rw_args.len 
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.handle_packet_args.buf = 
-                            malloc(args->variant.handle_packet_args.size);
-                        //mz read the buffer 
-                        sassert(fread(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    oldlog) == 1 /*> 0*/);
-                        sassert(fwrite(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    newlog) == 1 /*> 0*/);
-                        //free(args->variant.handle_packet_args.buf);
+                        copy_payload(args->variant.handle_packet_args.size);
                         break;
 
                     default:
@@ -331,8 +329,11 @@ static void end_snip(void) {
     sassert(fwrite(&(end.kind), sizeof(end.kind), 1, newlog) == 1);
     sassert(fwrite(&(end.callsite_loc), sizeof(end.callsite_loc), 1, newlog) == 1);
 
+    // the new log has every buffer inline, so no payload store
+    RR_log_header hdr;
+    rr_log_header_init(&hdr, 0, prog_point);
     rewind(newlog);
-    fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
+    sassert(fwrite(&hdr, sizeof(hdr), 1, newlog) == 1);
     fclose(newlog);
 
     done = true;
@@ -342,7 +343,10 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
     uint64_t count = rr_prog_point.guest_instr_count;
     if (!snipping && count+tb->num_guest_insns > start_count) {
         sassert((oldlog = fopen(rr_nondet_log->name, "r")));
-        sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1);
+        setvbuf(oldlog, NULL, _IOFBF, SCISSORS_IO_BUF_SIZE);
+        RR_log_header orig_hdr;
+        sassert(rr_log_header_read(oldlog, &orig_hdr) != 0);
+        orig_last_prog_point = orig_hdr.last_prog_point;
         printf("Original ending prog point: ");
         rr_spit_prog_point(orig_last_prog_point);
 
@@ -355,10 +359,15 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
         printf("Writing entries to %s...\n", nondet_name);
         newlog = fopen(nondet_name, "w");
         sassert(newlog);
+        setvbuf(newlog, NULL, _IOFBF, SCISSORS_IO_BUF_SIZE);
         // We'll fix this up later.
         RR_prog_point prog_point = {0, 0, 0};
-        fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
+        RR_log_header hdr;
+        rr_log_header_init(&hdr, 0, prog_point);
+        sassert(fwrite(&hdr, sizeof(hdr), 1, newlog) == 1);
 
+        // Entries on the replay queue have already been read; copy
+        // those from memory and the rest straight from the log.
         fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
 
         RR_log_entry *item = rr_get_queue_head();
@@ -403,6 +412,9 @@ bool init_plugin(void *self) {
         end_count = panda_parse_uint64(args, "end", UINT64_MAX);
     }
 
+    // Skip ahead to the nearest checkpoint, if the recording has any.
+    rr_replay_start_instr = start_count;
+
     snprintf(nondet_name, 128, "%s-rr-nondet.log", name);
     snprintf(snp_name, 128, "%s-rr-snp", name);
 
@@ -0,0 +1,1076 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+// Parsing search patterns and compiling them into one automaton.
+//
+// Patterns are parsed into a small tree (byte sets, concatenation,
+// alternation, repeats). If every pattern turns out to be a plain string,
+// the automaton is an Aho-Corasick one. Otherwise the trees are turned
+// into one Thompson NFA, whose start state loops on every byte so that
+// matches may begin anywhere, and that is determinized (subset
+// construction) and minimized (Hopcroft).
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <map>
+#include <queue>
+
+#include "patterns.h"
+
+enum { P_SET, P_CAT, P_ALT, P_REP };
+
+// pattern flags
+#define PF_NOCASE 1     // i: ASCII letters match either case
+#define PF_WIDE   2     // w: UTF-16LE, every byte is followed by a 0
+#define PF_ASCII  4     // a: with w, match both forms
+
+// the full dense table of an Aho-Corasick automaton, above this it is sparse
+#define AC_DENSE_MAX (16 * 1024 * 1024)
+// NFA states, after bounded repeats are expanded
+#define NFA_MAX (1 << 22)
+#define MAX_REPEAT 1000
+#define MAX_DEPTH 100
+
+typedef std::vector<uint32_t> state_set;
+
+static inline bool set_has(const uint64_t *bits, unsigned b) {
+    return bits[b / 64] & (1ULL << (b % 64));
+}
+
+static inline void set_add(uint64_t *bits, unsigned b) {
+    bits[b / 64] |= 1ULL << (b % 64);
+}
+
+static void set_range(uint64_t *bits, unsigned lo, unsigned hi) {
+    for (unsigned b = lo; b <= hi; b++) set_add(bits, b);
+}
+
+// the byte, if the set holds exactly one, else -1
+static int set_single(const uint64_t *bits) {
+    int found = -1;
+    for (unsigned b = 0; b < 256; b++) {
+        if (!set_has(bits, b)) continue;
+        if (found >= 0) return -1;
+        found = b;
+    }
+    return found;
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// A regex escape; pos is at the backslash
+static bool parse_escape(const std::string &re, size_t &pos, uint64_t *bits,
+                         std::string &err) {
+    memset(bits, 0, 4 * sizeof(uint64_t));
+    pos++;
+    if (pos >= re.size()) {
+        err = "trailing \\";
+        return false;
+    }
+    char c = re[pos++];
+    switch (c) {
+    case 'x': {
+        int hi, lo;
+        if (pos + 2 > re.size() || (hi = hexval(re[pos])) < 0 || (lo = hexval(re[pos+1])) < 0) {
+            err = "\\x needs two hex digits";
+            return false;
+        }
+        pos += 2;
+        set_add(bits, hi * 16 + lo);
+        return true;
+    }
+    case 'n': set_add(bits, '\n'); return true;
+    case 'r': set_add(bits, '\r'); return true;
+    case 't': set_add(bits, '\t'); return true;
+    case '0': set_add(bits, 0); return true;
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S': {
+        for (unsigned b = 0; b < 256; b++) {
+            bool in;
+            switch (tolower(c)) {
+            case 'd': in = b >= '0' && b <= '9'; break;
+            case 'w': in = b < 128 && (isalnum(b) || b == '_'); break;
+            default:  in = b == ' ' || (b >= '\t' && b <= '\r'); break;
+            }
+            if (in != (bool) isupper(c)) set_add(bits, b);
+        }
+        return true;
+    }
+    default:
+        set_add(bits, (uint8_t) c);
+        return true;
+    }
+}
+
+int pattern_set::new_node(int op) {
+    node n;
+    n.op = op;
+    n.set = -1;
+    n.min = n.max = 0;
+    nodes.push_back(n);
+    return nodes.size() - 1;
+}
+
+int pattern_set::new_set(const byte_set &s, int flags) {
+    byte_set bs = s;
+    if (flags & PF_NOCASE) {
+        for (unsigned b = 'A'; b <= 'Z'; b++) {
+            if (set_has(s.bits, b) || set_has(s.bits, b + 32)) {
+                set_add(bs.bits, b);
+                set_add(bs.bits, b + 32);
+            }
+        }
+    }
+    sets.push_back(bs);
+    int n = new_node(P_SET);
+    nodes[n].set = sets.size() - 1;
+    if (!(flags & PF_WIDE)) return n;
+    byte_set zero = {{1, 0, 0, 0}};
+    sets.push_back(zero);
+    int z = new_node(P_SET);
+    nodes[z].set = sets.size() - 1;
+    return cat(n, z);
+}
+
+int pattern_set::cat(int a, int b) {
+    if (nodes[a].op == P_CAT) {
+        nodes[a].kids.push_back(b);
+        return a;
+    }
+    int n = new_node(P_CAT);
+    nodes[n].kids.push_back(a);
+    nodes[n].kids.push_back(b);
+    return n;
+}
+
+int pattern_set::alt(int a, int b) {
+    if (nodes[a].op == P_ALT) {
+        nodes[a].kids.push_back(b);
+        return a;
+    }
+    int n = new_node(P_ALT);
+    nodes[n].kids.push_back(a);
+    nodes[n].kids.push_back(b);
+    return n;
+}
+
+// {n}, {n,} or {n,m}; pos is at the brace
+bool pattern_set::parse_repeat(const std::string &s, size_t &pos, int &min, int &max,
+                               std::string &err) {
+    size_t end = s.find('}', pos);
+    if (end == std::string::npos) {
+        err = "missing }";
+        return false;
+    }
+    std::string r = s.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+    char *e;
+    min = strtol(r.c_str(), &e, 10);
+    if (e == r.c_str()) {
+        err = "bad repeat {" + r + "}";
+        return false;
+    }
+    if (*e == 0) {
+        max = min;
+    }
+    else if (*e == ',' && e[1] == 0) {
+        max = -1;
+    }
+    else if (*e == ',') {
+        char *e2;
+        max = strtol(e + 1, &e2, 10);
+        if (e2 == e + 1 || *e2 != 0) {
+            err = "bad repeat {" + r + "}";
+            return false;
+        }
+    }
+    else {
+        err = "bad repeat {" + r + "}";
+        return false;
+    }
+    if (min < 0 || min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min)) {
+        err = "bad repeat {" + r + "}";
+        return false;
+    }
+    return true;
+}
+
+// [...] in a regex; pos is just after the [
+bool pattern_set::parse_class(const std::string &re, size_t &pos, byte_set &s,
+                              std::string &err) {
+    bool negate = false;
+    bool first = true;
+    memset(&s, 0, sizeof(s));
+    if (pos < re.size() && re[pos] == '^') {
+        negate = true;
+        pos++;
+    }
+    while (pos < re.size() && (re[pos] != ']' || first)) {
+        first = false;
+        int lo;
+        if (re[pos] == '\\') {
+            byte_set e;
+            if (!parse_escape(re, pos, e.bits, err)) return false;
+            lo = set_single(e.bits);
+            if (lo < 0) {
+                for (int i = 0; i < 4; i++) s.bits[i] |= e.bits[i];
+                continue;
+            }
+        }
+        else {
+            lo = (uint8_t) re[pos++];
+        }
+        int hi = lo;
+        if (pos + 1 < re.size() && re[pos] == '-' && re[pos+1] != ']') {
+            pos++;
+            if (re[pos] == '\\') {
+                byte_set e;
+                if (!parse_escape(re, pos, e.bits, err)) return false;
+                hi = set_single(e.bits);
+            }
+            else {
+                hi = (uint8_t) re[pos++];
+            }
+            if (hi < lo) {
+                err = "bad range in []";
+                return false;
+            }
+        }
+        set_range(s.bits, lo, hi);
+    }
+    if (pos >= re.size()) {
+        err = "missing ]";
+        return false;
+    }
+    pos++;
+    if (negate) {
+        for (int i = 0; i < 4; i++) s.bits[i] = ~s.bits[i];
+    }
+    return true;
+}
+
+int pattern_set::parse_regex_atom(const std::string &re, size_t &pos, int flags,
+                                  int depth, std::string &err) {
+    byte_set s;
+    memset(&s, 0, sizeof(s));
+    char c = re[pos];
+    switch (c) {
+    case '(': {
+        pos++;
+        int n = parse_regex(re, pos, flags, depth + 1, err);
+        if (n < 0) return -1;
+        if (pos >= re.size() || re[pos] != ')') {
+            err = "missing )";
+            return -1;
+        }
+        pos++;
+        return n;
+    }
+    case '*': case '+': case '?': case '{':
+        err = std::string("nothing to repeat before ") + c;
+        return -1;
+    case '[':
+        pos++;
+        if (!parse_class(re, pos, s, err)) return -1;
+        return new_set(s, flags);
+    case '.':
+        pos++;
+        set_range(s.bits, 0, 255);
+        return new_set(s, flags);
+    case '\\':
+        if (!parse_escape(re, pos, s.bits, err)) return -1;
+        return new_set(s, flags);
+    default:
+        pos++;
+        set_add(s.bits, (uint8_t) c);
+        return new_set(s, flags);
+    }
+}
+
+// alternatives of sequences, up to a ) or the end
+int pattern_set::parse_regex(const std::string &re, size_t &pos, int flags,
+                             int depth, std::string &err) {
+    if (depth > MAX_DEPTH) {
+        err = "nested too deeply";
+        return -1;
+    }
+    int a = -1;
+    while (1) {
+        // an empty P_CAT matches the empty string
+        int seq = new_node(P_CAT);
+        while (pos < re.size() && re[pos] != '|' && re[pos] != ')') {
+            int atom = parse_regex_atom(re, pos, flags, depth, err);
+            if (atom < 0) return -1;
+            while (pos < re.size() && (re[pos] == '*' || re[pos] == '+'
+                                       || re[pos] == '?' || re[pos] == '{')) {
+                int min, max;
+                if (re[pos] == '{') {
+                    if (!parse_repeat(re, pos, min, max, err)) return -1;
+                }
+                else {
+                    min = re[pos] == '+' ? 1 : 0;
+                    max = re[pos] == '?' ? 1 : -1;
+                    pos++;
+                }
+                int r = new_node(P_REP);
+                nodes[r].kids.push_back(atom);
+                nodes[r].min = min;
+                nodes[r].max = max;
+                atom = r;
+            }
+            nodes[seq].kids.push_back(atom);
+        }
+        a = a < 0 ? seq : alt(a, seq);
+        if (pos < re.size() && re[pos] == '|') {
+            pos++;
+            continue;
+        }
+        return a;
+    }
+}
+
+static inline bool hex_sep(char c) {
+    return c == ':' || c == ' ' || c == '\t' || c == '\r';
+}
+
+// 4d, 4?, ??, a (= 0a), [30-39,5f] or ( ... | ... )
+int pattern_set::parse_hex_atom(const std::string &hex, size_t &pos, int depth,
+                                std::string &err) {
+    byte_set s;
+    memset(&s, 0, sizeof(s));
+    if (hex[pos] == '(') {
+        pos++;
+        int n = parse_hex(hex, pos, depth + 1, err);
+        if (n < 0) return -1;
+        if (pos >= hex.size() || hex[pos] != ')') {
+            err = "missing )";
+            return -1;
+        }
+        pos++;
+        return n;
+    }
+    if (hex[pos] == '[') {
+        bool negate = false;
+        pos++;
+        if (pos < hex.size() && hex[pos] == '^') {
+            negate = true;
+            pos++;
+        }
+        while (1) {
+            while (pos < hex.size() && (hex_sep(hex[pos]) || hex[pos] == ',')) pos++;
+            if (pos >= hex.size()) {
+                err = "missing ]";
+                return -1;
+            }
+            if (hex[pos] == ']') break;
+            char *e;
+            unsigned long lo = strtoul(hex.c_str() + pos, &e, 16), hi = lo;
+            if (e == hex.c_str() + pos || lo > 255) {
+                err = "bad byte in []";
+                return -1;
+            }
+            pos = e - hex.c_str();
+            if (pos < hex.size() && hex[pos] == '-') {
+                pos++;
+                hi = strtoul(hex.c_str() + pos, &e, 16);
+                if (e == hex.c_str() + pos || hi > 255 || hi < lo) {
+                    err = "bad range in []";
+                    return -1;
+                }
+                pos = e - hex.c_str();
+            }
+            set_range(s.bits, lo, hi);
+        }
+        pos++;
+        if (negate) {
+            for (int i = 0; i < 4; i++) s.bits[i] = ~s.bits[i];
+        }
+        return new_set(s, 0);
+    }
+    size_t start = pos;
+    while (pos < hex.size() && (hexval(hex[pos]) >= 0 || hex[pos] == '?')) pos++;
+    std::string tok = hex.substr(start, pos - start);
+    if (tok.size() == 1 && tok[0] != '?') {
+        set_add(s.bits, hexval(tok[0]));
+    }
+    else if (tok.size() == 2) {
+        for (unsigned b = 0; b < 256; b++) {
+            if ((tok[0] == '?' || (int) (b >> 4) == hexval(tok[0]))
+                && (tok[1] == '?' || (int) (b & 15) == hexval(tok[1]))) {
+                set_add(s.bits, b);
+            }
+        }
+    }
+    else {
+        err = "bad hex byte '" + (tok.empty() ? hex.substr(pos, 1) : tok) + "'";
+        return -1;
+    }
+    return new_set(s, 0);
+}
+
+int pattern_set::parse_hex(const std::string &hex, size_t &pos, int depth,
+                           std::string &err) {
+    if (depth > MAX_DEPTH) {
+        err = "nested too deeply";
+        return -1;
+    }
+    int a = -1;
+    while (1) {
+        int seq = new_node(P_CAT);
+        while (1) {
+            while (pos < hex.size() && hex_sep(hex[pos])) pos++;
+            if (pos >= hex.size() || hex[pos] == '|' || hex[pos] == ')') break;
+            int atom = parse_hex_atom(hex, pos, depth, err);
+            if (atom < 0) return -1;
+            if (pos < hex.size() && hex[pos] == '{') {
+                int r = new_node(P_REP);
+                if (!parse_repeat(hex, pos, nodes[r].min, nodes[r].max, err)) return -1;
+                nodes[r].kids.push_back(atom);
+                atom = r;
+            }
+            nodes[seq].kids.push_back(atom);
+        }
+        a = a < 0 ? seq : alt(a, seq);
+        if (pos < hex.size() && hex[pos] == '|') {
+            pos++;
+            continue;
+        }
+        return a;
+    }
+}
+
+int pattern_set::string_node(const std::string &s, int flags) {
+    int n = new_node(P_CAT);
+    for (size_t i = 0; i < s.size(); i++) {
+        byte_set bs;
+        memset(&bs, 0, sizeof(bs));
+        set_add(bs.bits, (uint8_t) s[i]);
+        int c = new_set(bs, flags);
+        nodes[n].kids.push_back(c);
+    }
+    return n;
+}
+
+int pattern_set::with_flags(const std::string &body, int flags, bool regex,
+                            std::string &err) {
+    if ((flags & PF_WIDE) && (flags & PF_ASCII)) {
+        int a = with_flags(body, flags & ~PF_WIDE, regex, err);
+        if (a < 0) return -1;
+        int w = with_flags(body, flags & ~PF_ASCII, regex, err);
+        if (w < 0) return -1;
+        int n = new_node(P_ALT);
+        nodes[n].kids.push_back(a);
+        nodes[n].kids.push_back(w);
+        return n;
+    }
+    if (!regex) return string_node(body, flags);
+    size_t pos = 0;
+    int n = parse_regex(body, pos, flags, 0, err);
+    if (n >= 0 && pos != body.size()) {
+        err = "unbalanced )";
+        return -1;
+    }
+    return n;
+}
+
+bool pattern_set::nullable(int n) {
+    node &nd = nodes[n];
+    switch (nd.op) {
+    case P_SET:
+        return false;
+    case P_CAT:
+        for (size_t i = 0; i < nd.kids.size(); i++) {
+            if (!nullable(nd.kids[i])) return false;
+        }
+        return true;
+    case P_ALT:
+        for (size_t i = 0; i < nd.kids.size(); i++) {
+            if (nullable(nd.kids[i])) return true;
+        }
+        return false;
+    default:
+        return nd.min == 0 || nullable(nd.kids[0]);
+    }
+}
+
+bool pattern_set::as_literal(int n, std::string &bytes) {
+    node &nd = nodes[n];
+    switch (nd.op) {
+    case P_SET: {
+        int b = set_single(sets[nd.set].bits);
+        if (b < 0) return false;
+        bytes += (char) b;
+        return true;
+    }
+    case P_CAT:
+        for (size_t i = 0; i < nd.kids.size(); i++) {
+            if (!as_literal(nd.kids[i], bytes)) return false;
+        }
+        return true;
+    case P_REP: {
+        std::string once;
+        if (nd.min != nd.max || !as_literal(nd.kids[0], once)) return false;
+        for (int i = 0; i < nd.min; i++) bytes += once;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+void pattern_set::add_literal(const std::string &bytes) {
+    search_pattern p;
+    p.text = bytes;
+    p.literal = true;
+    p.bytes = bytes;
+    p.root = -1;
+    patterns.push_back(p);
+}
+
+bool pattern_set::add(const std::string &line, std::string &err) {
+    search_pattern p;
+    p.text = line;
+    p.literal = false;
+    p.root = -1;
+    if (line.empty()) {
+        err = "empty pattern";
+        return false;
+    }
+    char delim = line[0];
+    if (delim == '"' || delim == '/') {
+        size_t end = line.rfind(delim);
+        if (end == 0) {
+            err = std::string("missing closing ") + delim;
+            return false;
+        }
+        std::string body = line.substr(1, end - 1);
+        int flags = 0;
+        for (size_t i = end + 1; i < line.size(); i++) {
+            switch (line[i]) {
+            case 'i': flags |= PF_NOCASE; break;
+            case 'w': flags |= PF_WIDE; break;
+            case 'a': flags |= PF_ASCII; break;
+            case ' ': case '\t': case '\r': break;
+            default:
+                err = std::string("unknown flag ") + line[i];
+                return false;
+            }
+        }
+        if (delim == '"' && flags == 0) {
+            // plain strings are taken as is, no escapes
+            p.literal = true;
+            p.bytes = body;
+        }
+        else {
+            p.root = with_flags(body, flags, delim == '/', err);
+            if (p.root < 0) return false;
+        }
+    }
+    else {
+        size_t pos = 0;
+        p.root = parse_hex(line, pos, 0, err);
+        if (p.root < 0) return false;
+        if (pos != line.size()) {
+            err = "unbalanced )";
+            return false;
+        }
+    }
+    if (!p.literal) {
+        if (nullable(p.root)) {
+            err = "pattern matches the empty string";
+            return false;
+        }
+        p.literal = as_literal(p.root, p.bytes);
+    }
+    else if (p.bytes.empty()) {
+        err = "empty pattern";
+        return false;
+    }
+    patterns.push_back(p);
+    return true;
+}
+
+bool pattern_set::compile(search_automaton &a, uint32_t max_states, std::string &err) {
+    for (size_t i = 0; i < patterns.size(); i++) {
+        if (!patterns[i].literal) return build_dfa(a, max_states, err);
+    }
+    build_ac(a);
+    return true;
+}
+
+
+// Aho-Corasick. State 0 is the root of the trie of all the strings.
+void pattern_set::build_ac(search_automaton &a) {
+    std::vector<std::map<uint8_t,uint32_t> > trie(1);
+    // patterns ending in each state
+    std::vector<std::vector<uint32_t> > ends(1);
+    for (size_t i = 0; i < patterns.size(); i++) {
+        const std::string &s = patterns[i].bytes;
+        uint32_t st = 0;
+        for (size_t j = 0; j < s.size(); j++) {
+            uint8_t b = s[j];
+            std::map<uint8_t,uint32_t>::iterator it = trie[st].find(b);
+            if (it == trie[st].end()) {
+                trie[st][b] = trie.size();
+                st = trie.size();
+                trie.push_back(std::map<uint8_t,uint32_t>());
+                ends.push_back(std::vector<uint32_t>());
+            }
+            else {
+                st = it->second;
+            }
+        }
+        ends[st].push_back(i);
+    }
+    uint32_t nstates = trie.size();
+    a.nstates = nstates;
+
+    // every byte that occurs in some string gets its own class, and the
+    // rest share class 0. If all 256 occur there is no class 0 to share,
+    // and a byte is its own class.
+    bool used[256] = { false };
+    unsigned nused = 0;
+    for (size_t i = 0; i < patterns.size(); i++) {
+        const std::string &s = patterns[i].bytes;
+        for (size_t j = 0; j < s.size(); j++) {
+            if (!used[(uint8_t) s[j]]) {
+                used[(uint8_t) s[j]] = true;
+                nused++;
+            }
+        }
+    }
+    if (nused == 256) {
+        for (unsigned b = 0; b < 256; b++) a.cls[b] = b;
+        a.nclasses = 256;
+    }
+    else {
+        memset(a.cls, 0, sizeof(a.cls));
+        a.nclasses = 1;
+        for (unsigned b = 0; b < 256; b++) {
+            if (used[b]) a.cls[b] = a.nclasses++;
+        }
+    }
+
+    a.edges.assign(nstates + 1, 0);
+    a.edge_byte.clear();
+    a.edge_to.clear();
+    for (uint32_t s = 0; s < nstates; s++) {
+        a.edges[s] = a.edge_byte.size();
+        for (std::map<uint8_t,uint32_t>::iterator it = trie[s].begin(); it != trie[s].end(); it++) {
+            a.edge_byte.push_back(it->first);
+            a.edge_to.push_back(it->second);
+        }
+    }
+    a.edges[nstates] = a.edge_byte.size();
+
+    // Failure links, outputs and (dense) rows, breadth first: failure
+    // states are shallower, so they are done before step() uses them.
+    // A state's outputs are its own plus those of its failure state.
+    bool dense = (uint64_t) nstates * a.nclasses * sizeof(uint32_t) <= AC_DENSE_MAX;
+    a.fail.assign(nstates, 0);
+    a.delta.clear();
+    if (dense) a.delta.assign((size_t) nstates * a.nclasses, 0);
+    std::queue<uint32_t> q;
+    q.push(0);
+    while (!q.empty()) {
+        uint32_t s = q.front();
+        q.pop();
+        if (s != 0) {
+            const std::vector<uint32_t> &f = ends[a.fail[s]];
+            ends[s].insert(ends[s].end(), f.begin(), f.end());
+            if (dense) {
+                memcpy(&a.delta[(size_t) s * a.nclasses],
+                       &a.delta[(size_t) a.fail[s] * a.nclasses],
+                       a.nclasses * sizeof(uint32_t));
+            }
+        }
+        for (uint32_t e = a.edges[s]; e < a.edges[s+1]; e++) {
+            uint32_t t = a.edge_to[e];
+            // the failure state of a child of the root is the root
+            a.fail[t] = s == 0 ? 0 : a.step(a.fail[s], a.edge_byte[e]);
+            if (dense) a.delta[(size_t) s * a.nclasses + a.cls[a.edge_byte[e]]] = t;
+            q.push(t);
+        }
+    }
+    if (dense) {
+        a.fail.clear();
+        a.edges.clear();
+        a.edge_byte.clear();
+        a.edge_to.clear();
+    }
+
+    a.out.assign(nstates + 1, 0);
+    a.ids.clear();
+    for (uint32_t s = 0; s < nstates; s++) {
+        a.out[s] = a.ids.size();
+        a.ids.insert(a.ids.end(), ends[s].begin(), ends[s].end());
+    }
+    a.out[nstates] = a.ids.size();
+}
+
+
+// Thompson NFA. Each state has at most one byte transition (on a set).
+struct nfa {
+    std::vector<int> set;
+    std::vector<uint32_t> next;
+    std::vector<std::vector<uint32_t> > eps;
+    std::vector<int> accept;
+    bool overflow;
+
+    nfa() : overflow(false) {}
+    uint32_t add() {
+        if (set.size() >= NFA_MAX) overflow = true;
+        set.push_back(-1);
+        next.push_back(0);
+        eps.push_back(std::vector<uint32_t>());
+        accept.push_back(-1);
+        return set.size() - 1;
+    }
+};
+
+struct frag {
+    uint32_t start, end;
+};
+
+static frag build_nfa(nfa &m, const std::vector<int> &op, const std::vector<int> &set,
+                      const std::vector<std::vector<int> > &kids,
+                      const std::vector<std::pair<int,int> > &rep, int n) {
+    frag f;
+    f.start = m.add();
+    if (m.overflow) {
+        f.end = f.start;
+        return f;
+    }
+    switch (op[n]) {
+    case P_SET:
+        f.end = m.add();
+        m.set[f.start] = set[n];
+        m.next[f.start] = f.end;
+        break;
+    case P_CAT:
+        f.end = f.start;
+        for (size_t i = 0; i < kids[n].size() && !m.overflow; i++) {
+            frag k = build_nfa(m, op, set, kids, rep, kids[n][i]);
+            m.eps[f.end].push_back(k.start);
+            f.end = k.end;
+        }
+        break;
+    case P_ALT:
+        f.end = m.add();
+        for (size_t i = 0; i < kids[n].size() && !m.overflow; i++) {
+            frag k = build_nfa(m, op, set, kids, rep, kids[n][i]);
+            m.eps[f.start].push_back(k.start);
+            m.eps[k.end].push_back(f.end);
+        }
+        break;
+    default: {
+        // the required copies, then either a loop or the optional ones
+        int min = rep[n].first, max = rep[n].second;
+        uint32_t cur = f.start;
+        for (int i = 0; i < min && !m.overflow; i++) {
+            frag k = build_nfa(m, op, set, kids, rep, kids[n][0]);
+            m.eps[cur].push_back(k.start);
+            cur = k.end;
+        }
+        f.end = m.add();
+        if (max < 0) {
+            uint32_t loop = m.add();
+            m.eps[cur].push_back(loop);
+            frag k = build_nfa(m, op, set, kids, rep, kids[n][0]);
+            m.eps[loop].push_back(k.start);
+            m.eps[k.end].push_back(loop);
+            m.eps[loop].push_back(f.end);
+        }
+        else {
+            for (int i = min; i < max && !m.overflow; i++) {
+                m.eps[cur].push_back(f.end);
+                frag k = build_nfa(m, op, set, kids, rep, kids[n][0]);
+                m.eps[cur].push_back(k.start);
+                cur = k.end;
+            }
+            m.eps[cur].push_back(f.end);
+        }
+        break;
+    }
+    }
+    return f;
+}
+
+// Adds everything reachable by epsilon moves to v. mark/gen: scratch.
+static void closure(const nfa &m, state_set &v, std::vector<uint32_t> &mark, uint32_t &gen) {
+    gen++;
+    std::vector<uint32_t> stack(v);
+    v.clear();
+    while (!stack.empty()) {
+        uint32_t s = stack.back();
+        stack.pop_back();
+        if (mark[s] == gen) continue;
+        mark[s] = gen;
+        v.push_back(s);
+        for (size_t i = 0; i < m.eps[s].size(); i++) {
+            if (mark[m.eps[s][i]] != gen) stack.push_back(m.eps[s][i]);
+        }
+    }
+}
+
+bool pattern_set::build_dfa(search_automaton &a, uint32_t max_states, std::string &err) {
+    // Literals are built from their bytes, which the caller may have
+    // trimmed. The NFA builder gets flat copies of the trees.
+    for (size_t i = 0; i < patterns.size(); i++) {
+        if (patterns[i].literal) patterns[i].root = string_node(patterns[i].bytes, 0);
+    }
+    std::vector<int> op(nodes.size()), set(nodes.size());
+    std::vector<std::vector<int> > kids(nodes.size());
+    std::vector<std::pair<int,int> > rep(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        op[i] = nodes[i].op;
+        set[i] = nodes[i].set;
+        kids[i] = nodes[i].kids;
+        rep[i] = std::make_pair(nodes[i].min, nodes[i].max);
+    }
+    nfa m;
+    uint32_t start = m.add();
+    for (size_t i = 0; i < patterns.size() && !m.overflow; i++) {
+        frag f = build_nfa(m, op, set, kids, rep, patterns[i].root);
+        m.eps[start].push_back(f.start);
+        m.accept[f.end] = i;
+    }
+    if (m.overflow) {
+        err = "patterns are too large (bounded repeats?)";
+        return false;
+    }
+    uint32_t nn = m.set.size();
+
+    // Byte classes: refine {all bytes} by each set in turn
+    uint32_t nclasses = 1;
+    memset(a.cls, 0, sizeof(a.cls));
+    for (size_t i = 0; i < sets.size(); i++) {
+        std::vector<int> remap(2 * nclasses, -1);
+        uint32_t n = 0;
+        for (unsigned b = 0; b < 256; b++) {
+            int key = a.cls[b] * 2 + set_has(sets[i].bits, b);
+            if (remap[key] < 0) remap[key] = n++;
+            a.cls[b] = remap[key];
+        }
+        nclasses = n;
+    }
+    a.nclasses = nclasses;
+    std::vector<std::vector<uint32_t> > set_classes(sets.size());
+    for (size_t i = 0; i < sets.size(); i++) {
+        std::vector<bool> seen(nclasses);
+        for (unsigned b = 0; b < 256; b++) {
+            if (set_has(sets[i].bits, b) && !seen[a.cls[b]]) {
+                seen[a.cls[b]] = true;
+                set_classes[i].push_back(a.cls[b]);
+            }
+        }
+    }
+
+    // Subset construction. Every DFA state contains the closure of the
+    // start state (matches may begin anywhere), so that part is left out
+    // of the sets; base[c] is where it goes on class c.
+    std::vector<uint32_t> mark(nn, 0);
+    uint32_t gen = 0;
+    state_set sc(1, start);
+    closure(m, sc, mark, gen);
+    std::vector<bool> in_start(nn);
+    for (size_t i = 0; i < sc.size(); i++) in_start[sc[i]] = true;
+
+    std::vector<state_set> moves(nclasses);
+    std::vector<state_set> base(nclasses);
+    for (size_t i = 0; i < sc.size(); i++) {
+        int s = m.set[sc[i]];
+        if (s < 0) continue;
+        for (size_t j = 0; j < set_classes[s].size(); j++) {
+            base[set_classes[s][j]].push_back(m.next[sc[i]]);
+        }
+    }
+    for (uint32_t c = 0; c < nclasses; c++) {
+        closure(m, base[c], mark, gen);
+    }
+
+    std::map<state_set,uint32_t> ids;
+    std::vector<const state_set *> dstates;
+    std::vector<uint32_t> delta;
+    std::vector<state_set> accepts;
+    dstates.push_back(&ids.insert(std::make_pair(state_set(), 0)).first->first);
+    for (size_t d = 0; d < dstates.size(); d++) {
+        const state_set &x = *dstates[d];
+        for (uint32_t c = 0; c < nclasses; c++) moves[c].clear();
+        state_set acc;
+        for (size_t i = 0; i < x.size(); i++) {
+            if (m.accept[x[i]] >= 0) acc.push_back(m.accept[x[i]]);
+            int s = m.set[x[i]];
+            if (s < 0) continue;
+            for (size_t j = 0; j < set_classes[s].size(); j++) {
+                moves[set_classes[s][j]].push_back(m.next[x[i]]);
+            }
+        }
+        std::sort(acc.begin(), acc.end());
+        accepts.push_back(acc);
+        for (uint32_t c = 0; c < nclasses; c++) {
+            state_set &t = moves[c];
+            closure(m, t, mark, gen);
+            t.insert(t.end(), base[c].begin(), base[c].end());
+            state_set key;
+            for (size_t i = 0; i < t.size(); i++) {
+                if (!in_start[t[i]]) key.push_back(t[i]);
+            }
+            std::sort(key.begin(), key.end());
+            key.erase(std::unique(key.begin(), key.end()), key.end());
+            std::pair<std::map<state_set,uint32_t>::iterator,bool> r =
+                ids.insert(std::make_pair(key, (uint32_t) dstates.size()));
+            if (r.second) {
+                if (dstates.size() >= max_states) {
+                    char buf[128];
+                    snprintf(buf, sizeof(buf), "the DFA needs more than %u states", max_states);
+                    err = buf;
+                    return false;
+                }
+                dstates.push_back(&r.first->first);
+            }
+            delta.push_back(r.first->second);
+        }
+    }
+    uint32_t n = dstates.size();
+    ids.clear();
+
+    // Hopcroft minimization. Blocks are ranges of elems; the marked
+    // states of a block are moved to its front.
+    std::vector<uint32_t> elems(n), loc(n), blk(n);
+    std::vector<uint32_t> bstart, bend, bmarked;
+    std::vector<bool> in_work;
+    std::vector<uint32_t> work;
+    {
+        std::map<state_set,uint32_t> by_accept;
+        std::vector<std::vector<uint32_t> > members;
+        for (uint32_t s = 0; s < n; s++) {
+            std::pair<std::map<state_set,uint32_t>::iterator,bool> r =
+                by_accept.insert(std::make_pair(accepts[s], (uint32_t) members.size()));
+            if (r.second) members.push_back(std::vector<uint32_t>());
+            members[r.first->second].push_back(s);
+        }
+        uint32_t pos = 0;
+        for (size_t b = 0; b < members.size(); b++) {
+            bstart.push_back(pos);
+            for (size_t i = 0; i < members[b].size(); i++) {
+                elems[pos] = members[b][i];
+                loc[members[b][i]] = pos;
+                blk[members[b][i]] = b;
+                pos++;
+            }
+            bend.push_back(pos);
+            bmarked.push_back(0);
+            in_work.push_back(true);
+            work.push_back(b);
+        }
+    }
+    // inverse transitions: the predecessors of t on class c are
+    // inv[inv_start[c*n + t] .. inv_start[c*n + t + 1])
+    std::vector<uint32_t> inv_start((size_t) nclasses * n + 1, 0), inv(delta.size());
+    for (uint32_t s = 0; s < n; s++) {
+        for (uint32_t c = 0; c < nclasses; c++) inv_start[(size_t) c * n + delta[(size_t) s * nclasses + c] + 1]++;
+    }
+    for (size_t i = 1; i < inv_start.size(); i++) inv_start[i] += inv_start[i-1];
+    {
+        std::vector<uint32_t> fill(inv_start.begin(), inv_start.end() - 1);
+        for (uint32_t s = 0; s < n; s++) {
+            for (uint32_t c = 0; c < nclasses; c++) {
+                inv[fill[(size_t) c * n + delta[(size_t) s * nclasses + c]]++] = s;
+            }
+        }
+    }
+    std::vector<uint32_t> splitter, touched;
+    while (!work.empty()) {
+        uint32_t A = work.back();
+        work.pop_back();
+        in_work[A] = false;
+        splitter.assign(elems.begin() + bstart[A], elems.begin() + bend[A]);
+        for (uint32_t c = 0; c < nclasses; c++) {
+            touched.clear();
+            for (size_t i = 0; i < splitter.size(); i++) {
+                size_t t = (size_t) c * n + splitter[i];
+                for (uint32_t k = inv_start[t]; k < inv_start[t+1]; k++) {
+                    uint32_t s = inv[k], b = blk[s];
+                    uint32_t p = loc[s];
+                    if (p < bstart[b] + bmarked[b]) continue;   // already marked
+                    // swap s to the end of the marked part
+                    uint32_t q = bstart[b] + bmarked[b];
+                    std::swap(elems[p], elems[q]);
+                    loc[elems[p]] = p;
+                    loc[elems[q]] = q;
+                    if (bmarked[b]++ == 0) touched.push_back(b);
+                }
+            }
+            for (size_t i = 0; i < touched.size(); i++) {
+                uint32_t b = touched[i];
+                uint32_t marked = bmarked[b];
+                bmarked[b] = 0;
+                if (marked == bend[b] - bstart[b]) continue;
+                // the marked part becomes a new block
+                uint32_t nb = bstart.size();
+                bstart.push_back(bstart[b]);
+                bend.push_back(bstart[b] + marked);
+                bmarked.push_back(0);
+                bstart[b] += marked;
+                for (uint32_t p = bstart[nb]; p < bend[nb]; p++) blk[elems[p]] = nb;
+                if (in_work[b] || bend[nb] - bstart[nb] <= bend[b] - bstart[b]) {
+                    in_work.push_back(true);
+                    work.push_back(nb);
+                }
+                else {
+                    in_work.push_back(false);
+                    in_work[b] = true;
+                    work.push_back(b);
+                }
+            }
+        }
+    }
+
+    // one state per block, the start state's block first
+    uint32_t nb = bstart.size();
+    std::vector<uint32_t> renum(nb, (uint32_t) -1);
+    std::vector<uint32_t> rep_state;
+    renum[blk[0]] = 0;
+    rep_state.push_back(0);
+    for (uint32_t s = 0; s < n; s++) {
+        if (renum[blk[s]] == (uint32_t) -1) {
+            renum[blk[s]] = rep_state.size();
+            rep_state.push_back(s);
+        }
+    }
+    a.nstates = rep_state.size();
+    a.delta.assign((size_t) a.nstates * nclasses, 0);
+    a.out.assign(a.nstates + 1, 0);
+    a.ids.clear();
+    for (uint32_t i = 0; i < a.nstates; i++) {
+        uint32_t s = rep_state[i];
+        for (uint32_t c = 0; c < nclasses; c++) {
+            a.delta[(size_t) i * nclasses + c] = renum[blk[delta[(size_t) s * nclasses + c]]];
+        }
+        a.out[i] = a.ids.size();
+        a.ids.insert(a.ids.end(), accepts[s].begin(), accepts[s].end());
+    }
+    a.out[a.nstates] = a.ids.size();
+    a.edges.clear();
+    a.edge_byte.clear();
+    a.edge_to.clear();
+    a.fail.clear();
+    return true;
+}
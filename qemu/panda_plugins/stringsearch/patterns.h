@@ -0,0 +1,115 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+#ifndef __STRINGSEARCH_PATTERNS_H_
+#define __STRINGSEARCH_PATTERNS_H_
+
+// Search patterns and the automaton that finds all of them at once.
+// Nothing in here knows about QEMU.
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// One automaton runs over the bytes seen at each tap point; a tap point's
+// whole search state is an automaton state, 0 at the start. Bytes are
+// mapped to classes of bytes that no pattern tells apart, and the dense
+// table has a row of nclasses next states per state. Large sets of plain
+// strings may not fit a dense table; they keep their Aho-Corasick trie
+// edges and failure links instead.
+struct search_automaton {
+    uint32_t nstates;
+    uint8_t cls[256];
+    uint32_t nclasses;
+    std::vector<uint32_t> delta;
+    // sparse form: state s has edges edge_*[edges[s] .. edges[s+1]),
+    // sorted by byte
+    std::vector<uint32_t> edges;
+    std::vector<uint8_t> edge_byte;
+    std::vector<uint32_t> edge_to;
+    std::vector<uint32_t> fail;
+    // the patterns that match at the byte that took us into state s are
+    // ids[out[s] .. out[s+1])
+    std::vector<uint32_t> out;
+    std::vector<uint32_t> ids;
+
+    uint32_t step(uint32_t s, uint8_t b) const {
+        if (!delta.empty()) {
+            return delta[s * nclasses + cls[b]];
+        }
+        while (1) {
+            for (uint32_t e = edges[s]; e < edges[s+1]; e++) {
+                if (edge_byte[e] == b) return edge_to[e];
+                if (edge_byte[e] > b) break;
+            }
+            if (s == 0) return 0;
+            s = fail[s];
+        }
+    }
+};
+
+struct search_pattern {
+    std::string text;       // as written in the search strings file
+    bool literal;           // matches exactly `bytes`
+    std::string bytes;
+    int root;               // otherwise, the parsed pattern
+};
+
+// The set of patterns to search for; see README.md for the syntax.
+class pattern_set {
+public:
+    std::vector<search_pattern> patterns;
+
+    // Parses a line of the search strings file and adds it. Returns false,
+    // with a message in err, if the line is not a valid pattern.
+    bool add(const std::string &line, std::string &err);
+    void add_literal(const std::string &bytes);
+
+    // Builds the automaton for all the patterns: Aho-Corasick if they are
+    // all literals, otherwise a minimized DFA. Returns false, with a
+    // message in err, if the DFA would have more than max_states states.
+    bool compile(search_automaton &a, uint32_t max_states, std::string &err);
+
+private:
+    struct node {
+        int op;
+        int set;                // P_SET: index into sets
+        std::vector<int> kids;  // P_CAT, P_ALT, P_REP
+        int min, max;           // P_REP, max -1 for no limit
+    };
+    struct byte_set {
+        uint64_t bits[4];
+    };
+    std::vector<node> nodes;
+    std::vector<byte_set> sets;
+
+    int new_node(int op);
+    int new_set(const byte_set &s, int flags);
+    int cat(int a, int b);
+    int alt(int a, int b);
+    int parse_regex(const std::string &re, size_t &pos, int flags, int depth, std::string &err);
+    int parse_regex_atom(const std::string &re, size_t &pos, int flags, int depth, std::string &err);
+    bool parse_class(const std::string &re, size_t &pos, byte_set &s, std::string &err);
+    int parse_hex(const std::string &hex, size_t &pos, int depth, std::string &err);
+    int parse_hex_atom(const std::string &hex, size_t &pos, int depth, std::string &err);
+    bool parse_repeat(const std::string &s, size_t &pos, int &min, int &max, std::string &err);
+    int string_node(const std::string &s, int flags);
+    int with_flags(const std::string &body, int flags, bool regex, std::string &err);
+    bool nullable(int n);
+    bool as_literal(int n, std::string &bytes);
+
+    void build_ac(search_automaton &a);
+    bool build_dfa(search_automaton &a, uint32_t max_states, std::string &err);
+};
+
+#endif
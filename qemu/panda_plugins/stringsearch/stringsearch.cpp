@@ -33,12 +33,15 @@ extern "C" {
 #include <ctype.h>
 #include <math.h>
 #include <map>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <string>
 
 
 #include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
+#include "patterns.h"
 #include "pandalog.h"
 #include "../callstack_instr/callstack_instr_ext.h"
 #include "panda_plugin_plugin.h"
@@ -57,15 +60,6 @@ PPP_PROT_REG_CB(on_ssm);
 
 }
 
-// Silly: since we use these as map values, they have to be
-// copy constructible. Plain arrays aren't, but structs containing
-// arrays are. So we make these goofy wrappers.
-struct match_strings {
-    int val[MAX_STRINGS];
-};
-struct string_pos {
-    uint8_t val[MAX_STRINGS];
-};
 struct fullstack {
     int n;
     target_ulong callers[MAX_CALLERS];
@@ -74,54 +68,58 @@ struct fullstack {
 };
 
 std::map<prog_point,fullstack> matchstacks;
-std::map<prog_point,match_strings> matches;
-std::map<prog_point,string_pos> read_text_tracker;
-std::map<prog_point,string_pos> write_text_tracker;
-uint8_t tofind[MAX_STRINGS][MAX_STRLEN];
-uint8_t strlens[MAX_STRINGS];
-int num_strings = 0;
+// per prog point, how many times each string matched
+std::map<prog_point,std::vector<int> > matches;
+// per prog point, the automaton state after the last byte it accessed
+prog_point_map<uint32_t> read_text_tracker;
+prog_point_map<uint32_t> write_text_tracker;
+// what on_ssm gets for each pattern: the bytes of a plain string, or
+// the pattern as written
+std::vector<std::string> tofind;
 int n_callers = 16;
 
 // this creates BOTH the global for this callback fn (on_ssm_func)
 // and the function used by other plugins to register a fn (add_on_ssm)
 PPP_CB_BOILERPLATE(on_ssm)
 
-// this creates the 
+// All the search patterns are compiled into one automaton (see
+// patterns.h), so each accessed byte costs one transition however many
+// patterns there are, and overlapping matches are all found.
+search_automaton automaton;
+
+void report_match(CPUState *env, target_ulong pc, target_ulong addr,
+                  prog_point &p, int str_idx, bool is_write) {
+    printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
+           (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
+    std::vector<int> &m = matches[p];
+    if (m.empty()) m.resize(tofind.size());
+    m[str_idx]++;
+
+    // Also get the full stack here
+    fullstack f = {0};
+    f.n = get_callers(f.callers, n_callers, env);
+    f.pc = p.pc;
+    f.asid = p.cr3;
+    matchstacks[p] = f;
+
+    // call the i-found-a-match registered callbacks here
+    PPP_RUN_CB(on_ssm, env, pc, addr, (uint8_t *) tofind[str_idx].data(),
+               tofind[str_idx].size(), is_write)
+}
 
 int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf, bool is_write,
-                       std::map<prog_point,string_pos> &text_tracker) {
+                       prog_point_map<uint32_t> &text_tracker) {
     prog_point p = {};
     get_prog_point(env, &p);
 
-    string_pos &sp = text_tracker[p];
+    uint32_t &state = text_tracker[p];
 
     for (unsigned int i = 0; i < size; i++) {
-        uint8_t val = ((uint8_t *)buf)[i];
-        for(int str_idx = 0; str_idx < num_strings; str_idx++) {
-            if (tofind[str_idx][sp.val[str_idx]] == val)
-                sp.val[str_idx]++;
-            else
-                sp.val[str_idx] = 0;
-
-            if (sp.val[str_idx] == strlens[str_idx]) {
-                // Victory!
-                printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
-                       (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
-                matches[p].val[str_idx]++;
-                sp.val[str_idx] = 0;
-
-                // Also get the full stack here
-                fullstack f = {0};
-                f.n = get_callers(f.callers, n_callers, env);
-                f.pc = p.pc;
-                f.asid = p.cr3;
-                matchstacks[p] = f;
-
-                // call the i-found-a-match registered callbacks here
-                PPP_RUN_CB(on_ssm, env, pc, addr, tofind[str_idx], strlens[str_idx], is_write)
-
-            }
+        state = automaton.step(state, ((uint8_t *)buf)[i]);
+        for (uint32_t o = automaton.out[state]; o < automaton.out[state+1]; o++) {
+            // Victory!
+            report_match(env, pc, addr + i, p, automaton.ids[o], is_write);
         }
     }
  
@@ -150,16 +148,15 @@ bool init_plugin(void *self) {
 
     panda_arg_list *args = panda_get_args("stringsearch");
 
+    pattern_set patterns;
     const char *arg_str = panda_parse_string(args, "str", "");
-    size_t arg_len = strlen(arg_str);
-    if (arg_len > 0) {
-        memcpy(tofind[num_strings], arg_str, arg_len);
-        strlens[num_strings] = arg_len;
-        num_strings++;
+    if (strlen(arg_str) > 0) {
+        patterns.add_literal(std::string(arg_str, strnlen(arg_str, MAX_STRLEN)));
     }
 
     n_callers = panda_parse_uint64(args, "callers", 16);
     if (n_callers > MAX_CALLERS) n_callers = MAX_CALLERS;
+    uint32_t max_states = panda_parse_uint64(args, "max_states", 200000);
 
     const char *prefix = panda_parse_string(args, "name", "stringsearch");
     char stringsfile[128] = {};
@@ -171,37 +168,41 @@ bool init_plugin(void *self) {
         return false;
     }
 
-    // Format: lines of colon-separated hex chars or quoted strings, e.g.
+    // One pattern per line: colon-separated hex bytes, "string", or
+    // /regex/; see README.md for wildcards, classes and flags. e.g.
     // 0a:1b:2c:3d:4e
-    // or "string" (no newlines)
+    // 4d:5a:??:00:[30-39]{2,4}
+    // "string" (no newlines)
+    // "password"iwa
+    // /user(name)?=\w+/i
     std::string line;
+    int lineno = 0;
     while(std::getline(search_strings, line)) {
-        std::istringstream iss(line);
-
-        if (line[0] == '"') {
-            size_t len = line.size() - 2;
-            memcpy(tofind[num_strings], line.substr(1, len).c_str(), len);
-            strlens[num_strings] = len;
-        } else {
-            std::string x;
-            int i = 0;
-            while (std::getline(iss, x, ':')) {
-                tofind[num_strings][i++] = (uint8_t)strtoul(x.c_str(), NULL, 16);
-                if (i >= MAX_STRLEN) {
-                    printf("WARN: Reached max number of characters (%d) on string %d, truncating.\n", MAX_STRLEN, num_strings);
-                    break;
-                }
-            }
-            strlens[num_strings] = i;
+        lineno++;
+        if (line.empty() || line[0] == '#') continue;
+        std::string err;
+        if (!patterns.add(line, err)) {
+            printf("WARN: %s:%d: %s, skipping.\n", stringsfile, lineno, err.c_str());
+            continue;
         }
-
-        printf("stringsearch: added string of length %d to search set\n", strlens[num_strings]);
-
-        if(++num_strings >= MAX_STRINGS) {
-            printf("WARN: maximum number of strings (%d) reached, will not load any more.\n", MAX_STRINGS);
-            break;
+        search_pattern &sp = patterns.patterns.back();
+        if (sp.literal && sp.bytes.size() > MAX_STRLEN) {
+            printf("WARN: Reached max number of characters (%d) on string %u, truncating.\n", MAX_STRLEN, (unsigned) patterns.patterns.size() - 1);
+            sp.bytes.resize(MAX_STRLEN);
         }
     }
+    for (size_t i = 0; i < patterns.patterns.size(); i++) {
+        search_pattern &sp = patterns.patterns[i];
+        tofind.push_back(sp.literal ? sp.bytes : sp.text);
+    }
+    std::string err;
+    if (!patterns.compile(automaton, max_states, err)) {
+        printf("stringsearch: %s; raise max_states or simplify the patterns. Exiting.\n", err.c_str());
+        return false;
+    }
+    printf("stringsearch: %u patterns, %u states, %u byte classes, %s transitions\n",
+           (unsigned) tofind.size(), automaton.nstates, automaton.nclasses,
+           automaton.delta.empty() ? "sparse" : "dense");
 
     char matchfile[128] = {};
     sprintf(matchfile, "%s_string_matches.txt", prefix);
@@ -229,7 +230,7 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
-    std::map<prog_point,match_strings>::iterator it;
+    std::map<prog_point,std::vector<int> >::iterator it;
     for(it = matches.begin(); it != matches.end(); it++) {
         // Print prog point
 
@@ -243,8 +244,8 @@ void uninit_plugin(void *self) {
         fprintf(mem_report, TARGET_FMT_lx " ", f.asid);
 
         // Print strings that matched and how many times
-        for(int i = 0; i < num_strings; i++)
-            fprintf(mem_report, " %d", it->second.val[i]);
+        for(size_t i = 0; i < tofind.size(); i++)
+            fprintf(mem_report, " %d", it->second[i]);
         fprintf(mem_report, "\n");
     }
     fclose(mem_report);
@@ -4,8 +4,8 @@
 #define __STRINGSEARCH_H_
 
 
-#define MAX_STRINGS 100
 #define MAX_CALLERS 128
+// longer search strings are truncated
 #define MAX_STRLEN  256
 
 
@@ -215,11 +215,11 @@ static bool is_empty(ReturnPoint& pt){
 static bool returned_check_callback(CPUState *env, TranslationBlock* tb){
     // First, check if any of the PANDA VMI callbacks needs to be triggered
 #if defined(CONFIG_PANDA_VMI)
-    panda_cb_list *plist;
+    panda_cb_entry *plist;
     for(auto& retVal :fork_returns){
         if (retVal.retaddr == tb->pc && retVal.process_id == get_asid(env, tb->pc)){
            // we returned from fork
-           for(plist = panda_cbs[PANDA_CB_VMI_AFTER_FORK]; plist != NULL; plist = panda_cb_list_next(plist)) {
+           PANDA_CB_FOREACH(plist, PANDA_CB_VMI_AFTER_FORK) {
                 plist->entry.return_from_fork(env);
             }
            // set to 0,0 so we can remove after we finish iterating
@@ -231,7 +231,7 @@ static bool returned_check_callback(CPUState *env, TranslationBlock* tb){
         if(retVal.process_id == get_asid(env, tb->pc) && !in_kernelspace(env)){
         //if (retVal.retaddr == tb->pc /*&& retVal.process_id == get_asid(env, tb->pc)*/){
            // we returned from fork
-           for(plist = panda_cbs[PANDA_CB_VMI_AFTER_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
+           PANDA_CB_FOREACH(plist, PANDA_CB_VMI_AFTER_EXEC) {
                 plist->entry.return_from_exec(env);
             }
            // set to 0,0 so we can remove after we finish iterating
@@ -242,7 +242,7 @@ static bool returned_check_callback(CPUState *env, TranslationBlock* tb){
     for(auto& retVal :clone_returns){
         if (retVal.retaddr == tb->pc && retVal.process_id == get_asid(env, tb->pc)){
            // we returned from fork
-           for(plist = panda_cbs[PANDA_CB_VMI_AFTER_CLONE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+           PANDA_CB_FOREACH(plist, PANDA_CB_VMI_AFTER_CLONE) {
                 plist->entry.return_from_clone(env);
             }
            // set to 0,0 so we can remove after we finish iterating
@@ -433,23 +433,16 @@ int exec_callback(CPUState *env, target_ulong pc) {
     return 0;
 }
 
-// Check if the instruction is sysenter (0F 34)
+// Check if the instruction is syscall (0F 05) or sysenter (0F 34)
 bool translate_callback(CPUState *env, target_ulong pc) {
-#if defined(TARGET_I386)
-    unsigned char buf[2] = {};
-    panda_virtual_memory_rw(env, pc, buf, 2, 0);
-    // Check if the instruction is syscall (0F 05)
-    if (buf[0]== 0x0F && buf[1] == 0x05) {
-        return true;
-    }
-    // Check if the instruction is sysenter (0F 34)
-    else if (buf[0]== 0x0F && buf[1] == 0x34) {
-        return true;
-    }
-    else {
+    // The translator has already decoded this instruction for us
+    if (panda_cur_insn.cls != PANDA_INSN_SYSCALL) {
         return false;
     }
+#if defined(TARGET_I386)
+    return true;
 #elif defined(TARGET_ARM)
+    // Narrow svc down to the encodings the kernel treats as syscalls
     unsigned char buf[4] = {};
 
     // Check for ARM mode syscall
@@ -509,6 +502,7 @@ bool init_plugin(void *self) {
 // Don't bother if we're not on a supported target
 #if defined(TARGET_I386) || defined(TARGET_ARM)
     panda_cb pcb;
+    panda_enable_insn_class();
     pcb.insn_translate = translate_callback;
     panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
     pcb.insn_exec = exec_callback;
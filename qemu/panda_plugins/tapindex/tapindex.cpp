@@ -35,6 +35,9 @@ extern "C" {
 #include <list>
 #include <algorithm>
 
+#include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
@@ -46,19 +49,8 @@ int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_
 
 }
 
-struct prog_point {
-    target_ulong caller;
-    target_ulong pc;
-    target_ulong cr3;
-    bool operator <(const prog_point &p) const {
-        return (this->pc < p.pc) || \
-               (this->pc == p.pc && this->caller < p.caller) || \
-               (this->pc == p.pc && this->caller == p.caller && this->cr3 < p.cr3);
-    }
-};
-
-std::map<prog_point,long> read_tracker;
-std::map<prog_point,long> write_tracker;
+prog_point_map<long> read_tracker;
+prog_point_map<long> write_tracker;
 FILE *read_index;
 FILE *write_index;
 
@@ -128,10 +120,10 @@ void uninit_plugin(void *self) {
     fwrite(&target_ulong_size, sizeof(uint32_t), 1, read_index);
 
     // Save reads
-    std::map<prog_point,long>::iterator it;
-    for(it = read_tracker.begin(); it != read_tracker.end(); it++) {
-        fwrite(&it->first, sizeof(prog_point), 1, read_index);
-        fwrite(&it->second, sizeof(long), 1, read_index);
+    std::vector<prog_point_map<long>::entry *> sorted = read_tracker.sorted();
+    for(size_t i = 0; i < sorted.size(); i++) {
+        fwrite(&sorted[i]->first, sizeof(prog_point), 1, read_index);
+        fwrite(&sorted[i]->second, sizeof(long), 1, read_index);
     }
     fclose(read_index);
 
@@ -139,9 +131,10 @@ void uninit_plugin(void *self) {
     fwrite(&target_ulong_size, sizeof(uint32_t), 1, write_index);
 
     // Save writes
-    for(it = write_tracker.begin(); it != write_tracker.end(); it++) {
-        fwrite(&it->first, sizeof(prog_point), 1, write_index);
-        fwrite(&it->second, sizeof(long), 1, write_index);
+    sorted = write_tracker.sorted();
+    for(size_t i = 0; i < sorted.size(); i++) {
+        fwrite(&sorted[i]->first, sizeof(prog_point), 1, write_index);
+        fwrite(&sorted[i]->second, sizeof(long), 1, write_index);
     }
     fclose(write_index);
 }
@@ -35,6 +35,9 @@ extern "C" {
 #include <list>
 #include <algorithm>
 
+#include "../common/prog_point.h"
+#include "../common/prog_point_map.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
@@ -50,18 +53,8 @@ uint64_t bytes_read, bytes_written;
 uint64_t num_reads, num_writes;
 
 struct text_counter { unsigned int hist[256]; };
-struct prog_point {
-    target_ulong caller;
-    target_ulong pc;
-    target_ulong cr3;
-    bool operator <(const prog_point &p) const {
-        return (this->pc < p.pc) || \
-               (this->pc == p.pc && this->caller < p.caller) || \
-               (this->pc == p.pc && this->caller == p.caller && this->cr3 < p.cr3);
-    }
-};
 
-std::map<prog_point,text_counter> text_tracker;
+prog_point_map<text_counter> text_tracker;
 //FILE *text_memlog;
 
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
@@ -169,8 +162,9 @@ void uninit_plugin(void *self) {
     );
 
     // In order to sort this properly
-    for(std::map<prog_point,text_counter>::iterator it = text_tracker.begin(); it != text_tracker.end(); it++) {
-        display_map.push_back(std::make_pair(it->first, it->second));
+    std::vector<prog_point_map<text_counter>::entry *> sorted = text_tracker.sorted();
+    for(size_t i = 0; i < sorted.size(); i++) {
+        display_map.push_back(std::make_pair(sorted[i]->first, sorted[i]->second));
     }
     //display_map.sort(confidence_compare);
 
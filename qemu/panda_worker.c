@@ -0,0 +1,170 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+
+/*
+ * Background worker pool for plugins.
+ *
+ * Plugins hand over a task (function + payload) from a callback and the
+ * pool runs it on one of a few worker threads. The payload belongs to the
+ * pool from then on and is released with the task's free function once
+ * the task has run. Tasks must not touch CPUState, guest memory or any
+ * other emulator state: copy what is needed into the payload first.
+ *
+ * Tasks submitted with PANDA_WORK_SERIAL run one at a time, in submission
+ * order, with respect to the other serial tasks of the same plugin.
+ * Everything else may run concurrently and in any order.
+ *
+ * panda_work_flush() waits for a plugin's tasks (or everyone's). PANDA
+ * calls it before and after uninit_plugin, and at the end of a replay.
+ */
+
+#include "config.h"
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "panda_plugin.h"
+
+#include <unistd.h>
+
+#define PANDA_WORKERS_MAX 8
+
+typedef struct panda_work {
+    void *owner;
+    panda_work_fn fn;
+    panda_work_fn free_fn;
+    void *payload;
+    bool serial;
+} panda_work;
+
+// Per-plugin bookkeeping
+typedef struct panda_work_owner {
+    int outstanding;    // queued or running
+    bool serial_busy;   // a serial task is running
+} panda_work_owner;
+
+static bool panda_workers_started = false;
+static int panda_nworkers = 0;
+static QemuThread panda_workers[PANDA_WORKERS_MAX];
+static QemuMutex panda_work_lock;
+static QemuCond panda_work_avail;
+static QemuCond panda_work_done;
+static GQueue *panda_work_queue;
+static GHashTable *panda_work_owners;
+static int panda_work_outstanding = 0;
+
+static panda_work_owner *panda_work_owner_get(void *owner) {
+    panda_work_owner *o = g_hash_table_lookup(panda_work_owners, owner);
+    if (o == NULL) {
+        o = g_new0(panda_work_owner, 1);
+        g_hash_table_insert(panda_work_owners, owner, o);
+    }
+    return o;
+}
+
+// Internal: first task that may run now. Called with the lock held.
+static panda_work *panda_work_pick(void) {
+    GList *l;
+    for (l = panda_work_queue->head; l != NULL; l = l->next) {
+        panda_work *w = l->data;
+        if (w->serial) {
+            panda_work_owner *o = panda_work_owner_get(w->owner);
+            if (o->serial_busy) continue;
+            o->serial_busy = true;
+        }
+        g_queue_delete_link(panda_work_queue, l);
+        return w;
+    }
+    return NULL;
+}
+
+static void *panda_worker_thread(void *arg) {
+    qemu_mutex_lock(&panda_work_lock);
+    while (true) {
+        panda_work *w = panda_work_pick();
+        if (w == NULL) {
+            qemu_cond_wait(&panda_work_avail, &panda_work_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&panda_work_lock);
+
+        w->fn(w->payload);
+        if (w->free_fn) w->free_fn(w->payload);
+
+        qemu_mutex_lock(&panda_work_lock);
+        panda_work_owner *o = panda_work_owner_get(w->owner);
+        o->outstanding--;
+        panda_work_outstanding--;
+        if (w->serial) {
+            o->serial_busy = false;
+            // the next serial task of this plugin may be waiting
+            qemu_cond_broadcast(&panda_work_avail);
+        }
+        qemu_cond_broadcast(&panda_work_done);
+        g_free(w);
+    }
+    return NULL;
+}
+
+static void panda_workers_start(void) {
+    int i;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // leave a core for the emulator itself
+    panda_nworkers = ncpus > 1 ? ncpus - 1 : 1;
+    if (panda_nworkers > PANDA_WORKERS_MAX) panda_nworkers = PANDA_WORKERS_MAX;
+
+    qemu_mutex_init(&panda_work_lock);
+    qemu_cond_init(&panda_work_avail);
+    qemu_cond_init(&panda_work_done);
+    panda_work_queue = g_queue_new();
+    panda_work_owners = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                              NULL, g_free);
+    for (i = 0; i < panda_nworkers; i++) {
+        qemu_thread_create(&panda_workers[i], panda_worker_thread, NULL);
+    }
+    panda_workers_started = true;
+}
+
+void panda_work_submit(void *plugin, panda_work_fn fn, void *payload,
+                       panda_work_fn free_fn, int flags) {
+    panda_work *w = g_new0(panda_work, 1);
+    w->owner = plugin;
+    w->fn = fn;
+    w->free_fn = free_fn;
+    w->payload = payload;
+    w->serial = (flags & PANDA_WORK_SERIAL) != 0;
+
+    if (!panda_workers_started) panda_workers_start();
+    qemu_mutex_lock(&panda_work_lock);
+    panda_work_owner_get(plugin)->outstanding++;
+    panda_work_outstanding++;
+    g_queue_push_tail(panda_work_queue, w);
+    qemu_cond_signal(&panda_work_avail);
+    qemu_mutex_unlock(&panda_work_lock);
+}
+
+void panda_work_flush(void *plugin) {
+    if (!panda_workers_started) return;
+    qemu_mutex_lock(&panda_work_lock);
+    while (true) {
+        int left;
+        if (plugin == NULL) {
+            left = panda_work_outstanding;
+        }
+        else {
+            left = panda_work_owner_get(plugin)->outstanding;
+        }
+        if (left == 0) break;
+        qemu_cond_wait(&panda_work_done, &panda_work_lock);
+    }
+    qemu_mutex_unlock(&panda_work_lock);
+}
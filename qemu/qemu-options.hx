@@ -2609,10 +2609,17 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-dedup", 0, QEMU_OPTION_record_dedup,
+    "-record-dedup   store device DMA and packet buffers once in a side payload file\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay <snapshot>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-checkpoints", HAS_ARG, QEMU_OPTION_replay_checkpoints,
+    "-replay-checkpoints <n>\n"
+    "                during replay, save a checkpoint about every <n> instructions\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
@@ -33,6 +33,8 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <libgen.h>
@@ -80,6 +82,9 @@ volatile sig_atomic_t rr_use_live_exit_request = 0;
 //mz the log of non-deterministic events
 RR_log *rr_nondet_log = NULL;
 
+// store device buffers once in a side payload file (set by -record-dedup)
+int rr_dedup_payloads = 0;
+
 double rr_get_percentage (void) {
     return 100.0 * rr_prog_point.guest_instr_count /
         rr_nondet_log->last_prog_point.guest_instr_count;
@@ -263,10 +268,159 @@ inline void rr_assert_fail(const char *exp, const char *file, int line, const ch
     /* NOT REACHED */
 }
 
+/******************************************************************************************/
+/* PAYLOAD STORE */
+/******************************************************************************************/
+
+// key for the record-side index of payloads already in the store
+typedef struct {
+    uint64_t hash;
+    uint64_t len;
+} RR_payload_key;
+
+static GHashTable *rr_payload_index = NULL;
+
+// 64-bit multiply-xorshift hash, eight bytes at a time
+static uint64_t rr_payload_hash(const uint8_t *buf, uint64_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+    uint64_t i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, buf + i, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (i < len) {
+        uint64_t k = 0;
+        memcpy(&k, buf + i, len - i);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+static guint rr_payload_key_hash(gconstpointer key) {
+    return (guint) ((const RR_payload_key *) key)->hash;
+}
+
+static gboolean rr_payload_key_equal(gconstpointer a, gconstpointer b) {
+    const RR_payload_key *ka = a;
+    const RR_payload_key *kb = b;
+    return ka->hash == kb->hash && ka->len == kb->len;
+}
+
+// true iff the stored payload at ref matches buf.  Guards against hash collisions.
+static uint8_t rr_payload_matches(RR_payload_ref ref, const uint8_t *buf, uint64_t len) {
+    uint8_t chunk[4096];
+    uint64_t done = 0;
+    while (done < len) {
+        size_t n = MIN(sizeof(chunk), len - done);
+        if (pread(rr_nondet_log->payload_fd, chunk, n, ref + done) != (ssize_t) n ||
+            memcmp(chunk, buf + done, n) != 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// open the payload file for this record log and write its magic
+static void rr_payload_store_open(const char *filename) {
+    rr_nondet_log->payload_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    rr_assert(rr_nondet_log->payload_fd >= 0);
+    rr_assert(write(rr_nondet_log->payload_fd, RR_PAYLOAD_MAGIC, RR_PAYLOAD_MAGIC_LEN) == RR_PAYLOAD_MAGIC_LEN);
+    rr_nondet_log->payload_size = RR_PAYLOAD_MAGIC_LEN;
+    rr_nondet_log->deduped = 1;
+    rr_payload_index = g_hash_table_new_full(rr_payload_key_hash, rr_payload_key_equal, g_free, g_free);
+}
+
+// return a reference to a stored copy of buf, adding it to the store if needed
+static RR_payload_ref rr_payload_store_put(const uint8_t *buf, uint64_t len) {
+    RR_payload_key key = { rr_payload_hash(buf, len), len };
+    RR_payload_ref *found = g_hash_table_lookup(rr_payload_index, &key);
+    RR_payload_ref ref;
+    uint64_t done = 0;
+
+    if (found && rr_payload_matches(*found, buf, len)) {
+        return *found;
+    }
+    ref = rr_nondet_log->payload_size;
+    while (done < len) {
+        ssize_t n = pwrite(rr_nondet_log->payload_fd, buf + done, len - done, ref + done);
+        rr_assert(n > 0);
+        done += n;
+    }
+    rr_nondet_log->payload_size += len;
+    //mz on a (real) hash collision we keep the first payload indexed
+    if (!found) {
+        g_hash_table_insert(rr_payload_index,
+                g_memdup(&key, sizeof(key)), g_memdup(&ref, sizeof(ref)));
+    }
+    return ref;
+}
+
+// map the payload file of a deduped recording for replay
+static void rr_payload_table_map(const char *filename) {
+    struct stat statbuf = {0};
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "nondet log uses payload store %s, which can't be opened\n", filename);
+    }
+    rr_assert(fd >= 0);
+    rr_assert(fstat(fd, &statbuf) == 0);
+    rr_assert(statbuf.st_size >= RR_PAYLOAD_MAGIC_LEN);
+    //mz read-only: entries get their own copies (see rr_read_payload)
+    rr_nondet_log->payload_base = mmap(NULL, statbuf.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    rr_assert(rr_nondet_log->payload_base != MAP_FAILED);
+    rr_assert(memcmp(rr_nondet_log->payload_base, RR_PAYLOAD_MAGIC, RR_PAYLOAD_MAGIC_LEN) == 0);
+    rr_nondet_log->payload_size = statbuf.st_size;
+    if (rr_debug_whisper()) {
+        fprintf (logfile, "mapped payload table %s.  len=%llu bytes.\n",
+                 filename, (unsigned long long) rr_nondet_log->payload_size);
+    }
+}
+
+// release the payload file or mapping, whichever this log has
+static void rr_payload_close(void) {
+    if (!rr_nondet_log->deduped) {
+        return;
+    }
+    if (rr_nondet_log->type == RECORD) {
+        close(rr_nondet_log->payload_fd);
+        g_hash_table_destroy(rr_payload_index);
+        rr_payload_index = NULL;
+    }
+    else {
+        munmap(rr_nondet_log->payload_base, rr_nondet_log->payload_size);
+        rr_nondet_log->payload_base = NULL;
+    }
+    rr_nondet_log->deduped = 0;
+}
+
 /******************************************************************************************/
 /* RECORD */
 /******************************************************************************************/
 
+//mz write a device buffer, either inline or as a reference into the payload store
+static inline void rr_write_payload(const uint8_t *buf, uint64_t len) {
+    if (rr_payload_is_ref(rr_nondet_log->deduped, len)) {
+        RR_payload_ref ref = rr_payload_store_put(buf, len);
+        fwrite(&ref, sizeof(ref), 1, rr_nondet_log->fp);
+    }
+    else {
+        fwrite(buf, 1, len, rr_nondet_log->fp);
+    }
+}
+
 //mz write the current log item to file
 static inline void rr_write_item(void) {
     RR_log_entry *item = &(rr_nondet_log->current_item);
@@ -315,8 +469,8 @@ static inline void rr_write_item(void) {
 			       sizeof(args->variant.cpu_mem_rw_args), 
 			       1, rr_nondet_log->fp);
                         //mz write the buffer
-                        fwrite(args->variant.cpu_mem_rw_args.buf, 1, 
-			       args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp);
+                        rr_write_payload(args->variant.cpu_mem_rw_args.buf,
+                                args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         //bdg same deal as RR_CALL_CPU_MEM_RW
@@ -324,8 +478,8 @@ static inline void rr_write_item(void) {
                                 args->variant.cpu_mem_unmap.len == 0);
                         fwrite(&(args->variant.cpu_mem_unmap),
 			       sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp);
-                        fwrite(args->variant.cpu_mem_unmap.buf, 1, 
-			       args->variant.cpu_mem_unmap.len, rr_nondet_log->fp);
+                        rr_write_payload(args->variant.cpu_mem_unmap.buf,
+                                args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
                         fwrite(&(args->variant.cpu_mem_reg_region_args), 
@@ -345,8 +499,8 @@ static inline void rr_write_item(void) {
                         fwrite(&(args->variant.handle_packet_args), 
 			       sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp);
                         //mz write the buffer
-                        fwrite(args->variant.handle_packet_args.buf, 1, 
-			       args->variant.handle_packet_args.size, rr_nondet_log->fp);
+                        rr_write_payload(args->variant.handle_packet_args.buf,
+                                args->variant.handle_packet_args.size);
                         break;
                     default:
                         //mz unimplemented
@@ -687,6 +841,28 @@ static inline RR_log_entry *alloc_new_entry(void)
     return new_entry;
 }
 
+//mz read a device buffer written by rr_write_payload.  Deduped buffers are
+//mz copied out of the payload table: entries that share a payload must not
+//mz see each other's changes (e.g. a plugin editing a packet).
+static inline uint8_t *rr_read_payload(uint64_t len) {
+    //mz always allocate a new one. we free it when the item is added to the recycle list
+    uint8_t *buf = g_malloc(len);
+    if (rr_payload_is_ref(rr_nondet_log->deduped, len)) {
+        RR_payload_ref ref;
+        rr_assert(fread(&ref, sizeof(ref), 1, rr_nondet_log->fp) == 1);
+        rr_assert(ref >= RR_PAYLOAD_MAGIC_LEN && ref + len <= rr_nondet_log->payload_size);
+        memcpy(buf, rr_nondet_log->payload_base + ref, len);
+    }
+    else {
+        rr_assert(len == 0 || fread(buf, 1, len, rr_nondet_log->fp) == len);
+    }
+#ifdef RR_STATS
+    rr_size_of_log_entries[RR_SKIPPED_CALL] += rr_payload_log_bytes(rr_nondet_log->deduped, len);
+#endif
+    rr_nondet_log->bytes_read += rr_payload_log_bytes(rr_nondet_log->deduped, len);
+    return buf;
+}
+
 //mz fill an entry
 static RR_log_entry *rr_read_item(void) {
     RR_log_entry *item = alloc_new_entry();
@@ -695,6 +871,7 @@ static RR_log_entry *rr_read_item(void) {
     rr_assert (rr_in_replay());
     rr_assert ( ! rr_log_is_empty());
     rr_assert (rr_nondet_log->fp != NULL);
+    item->file_offset = rr_nondet_log->bytes_read;
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
     if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
@@ -783,14 +960,8 @@ static RR_log_entry *rr_read_item(void) {
 #endif
                         rr_nondet_log->bytes_read += sizeof(args->variant.cpu_mem_rw_args);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
-                        rr_assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-#ifdef RR_STATS
-                        rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_rw_args.len;
-#endif
-                        rr_nondet_log->bytes_read += args->variant.cpu_mem_rw_args.len;
+                        args->variant.cpu_mem_rw_args.buf = rr_read_payload(args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         rr_assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
@@ -798,12 +969,7 @@ static RR_log_entry *rr_read_item(void) {
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_unmap);
 #endif
                         rr_nondet_log->bytes_read += sizeof(args->variant.cpu_mem_unmap);
-                        args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
-                        rr_assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-#ifdef RR_STATS
-                        rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_unmap.len;
-#endif
-                        rr_nondet_log->bytes_read += args->variant.cpu_mem_unmap.len;
+                        args->variant.cpu_mem_unmap.buf = rr_read_payload(args->variant.cpu_mem_unmap.len);
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
@@ -842,18 +1008,10 @@ static RR_log_entry *rr_read_item(void) {
                         rr_nondet_log->bytes_read += sizeof(args->variant.handle_packet_args);
 			//mz XXX HACK
 			args->old_buf_addr = (uint64_t) args->variant.handle_packet_args.buf;
-			//mz buffer length in args->variant.cpu_mem_rw_args.len 
-			//mz always allocate a new one. we free it when the item is added to the recycle list
-			args->variant.handle_packet_args.buf = 
-			  g_malloc(args->variant.handle_packet_args.size);
+			//mz buffer length in args->variant.handle_packet_args.size
 			//mz read the buffer 
-			assert (fread(args->variant.handle_packet_args.buf, 
-				      args->variant.handle_packet_args.size, 1,
-                                      rr_nondet_log->fp) == 1 /*> 0*/);
-#ifdef RR_STATS
-			rr_size_of_log_entries[item->header.kind] += args->variant.handle_packet_args.size;
-#endif
-                        rr_nondet_log->bytes_read += args->variant.handle_packet_args.size;
+			args->variant.handle_packet_args.buf =
+			  rr_read_payload(args->variant.handle_packet_args.size);
 			break;
 
                     default:
@@ -1214,8 +1372,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
 		  {
 		    // run all callbacks registered for hd transfer
 		    RR_hd_transfer_args *hdt = &(args->variant.hd_transfer_args);
-		    panda_cb_list *plist;
-		    for (plist = panda_cbs[PANDA_CB_REPLAY_HD_TRANSFER]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		    panda_cb_entry *plist;
+		    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_HD_TRANSFER) {
 		      plist->entry.replay_hd_transfer
 			(cpu_single_env, 
 			 hdt->type,
@@ -1230,8 +1388,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
 		  {
 		    // run all callbacks registered for packet handling
 		    RR_handle_packet_args *hp = &(args->variant.handle_packet_args);
-		    panda_cb_list *plist;
-		    for (plist = panda_cbs[PANDA_CB_REPLAY_HANDLE_PACKET]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		    panda_cb_entry *plist;
+		    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_HANDLE_PACKET) {
 		      plist->entry.replay_handle_packet
 			(cpu_single_env, 
 			 hp->buf,
@@ -1249,9 +1407,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
                     // card (E1000)
                     RR_net_transfer_args *nta =
                         &(args->variant.net_transfer_args);
-                    panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_NET_TRANSFER];
-                            plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_entry *plist;
+                    PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_NET_TRANSFER) {
                       plist->entry.replay_net_transfer
                         (cpu_single_env, 
                          nta->type,
@@ -1285,6 +1442,14 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
 
 extern char *qemu_strdup(const char *str);
   
+// (re)write the header at the start of the record log
+static void rr_write_log_header(uint32_t flags) {
+  RR_log_header hdr;
+  rr_log_header_init(&hdr, flags, rr_nondet_log->last_prog_point);
+  rewind(rr_nondet_log->fp);
+  rr_assert(fwrite(&hdr, sizeof(hdr), 1, rr_nondet_log->fp) == 1);
+}
+
 // create record log
 void rr_create_record_log (const char *filename) {
   // create log
@@ -1305,7 +1470,7 @@ void rr_create_record_log (const char *filename) {
   //count as a monotonicly increasing measure of progress.
   //This way, when we print progress, we can use something better than size of log consumed
   //(as that can jump //sporadically).
-  fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+  rr_write_log_header(rr_dedup_payloads ? RR_LOG_DEDUP_PAYLOADS : 0);
 }
 
 
@@ -1330,8 +1495,15 @@ void rr_create_replay_log (const char *filename) {
 	     rr_nondet_log->name, rr_nondet_log->size);
   }
   //mz read the last program point from the log header.
-  rr_assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
-  rr_nondet_log->bytes_read += sizeof(RR_prog_point);
+  RR_log_header hdr;
+  size_t hdr_len = rr_log_header_read(rr_nondet_log->fp, &hdr);
+  if (hdr_len == 0) {
+    fprintf(stderr, "%s: bad or unsupported nondet log header\n", rr_nondet_log->name);
+  }
+  rr_assert(hdr_len != 0);
+  rr_nondet_log->last_prog_point = hdr.last_prog_point;
+  rr_nondet_log->deduped = (hdr.flags & RR_LOG_DEDUP_PAYLOADS) != 0;
+  rr_nondet_log->bytes_read += hdr_len;
 }
 
 
@@ -1340,12 +1512,12 @@ void rr_destroy_log(void) {
   if (rr_nondet_log->fp) {
     //mz if in record, update the header with the last written prog point.
     if (rr_nondet_log->type == RECORD) {
-        rewind(rr_nondet_log->fp);
-        fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+        rr_write_log_header(rr_nondet_log->deduped ? RR_LOG_DEDUP_PAYLOADS : 0);
     }
     fclose(rr_nondet_log->fp);
     rr_nondet_log->fp = NULL;
   }
+  rr_payload_close();
   g_free(rr_nondet_log->name);
   g_free(rr_nondet_log);
   rr_nondet_log = NULL;
@@ -1424,6 +1596,106 @@ static inline void rr_get_nondet_log_file_name(char *rr_name, char *rr_path, cha
 }
 
 
+static inline void rr_get_payload_file_name(char *rr_name, char *rr_path, char *file_name, size_t file_name_len) {
+  rr_assert (rr_name != NULL && rr_path != NULL);
+  snprintf(file_name, file_name_len, "%s/%s-rr-payload.log", rr_path, rr_name);
+}
+
+
+/******************************************************************************************/
+/* CHECKPOINTS */
+/******************************************************************************************/
+
+// take a checkpoint about every this many instructions of replay (-replay-checkpoints)
+uint64_t rr_checkpoint_interval = 0;
+// cpu_exec calls rr_do_checkpoint once replay reaches this instr count
+uint64_t rr_next_checkpoint = (uint64_t) -1;
+// set (e.g. by a plugin's init) to start replay from the nearest checkpoint
+uint64_t rr_replay_start_instr = 0;
+
+// <path>/<name> of the recording being replayed
+static char rr_checkpoint_base[1024];
+// contents of <name>-rr-ckpt.idx
+static GArray *rr_checkpoints = NULL;
+
+static void rr_checkpoints_load(void) {
+  char name_buf[1024];
+  RR_checkpoint ckpt;
+  FILE *fp;
+
+  rr_checkpoints = g_array_new(FALSE, FALSE, sizeof(RR_checkpoint));
+  snprintf(name_buf, sizeof(name_buf), "%s-rr-ckpt.idx", rr_checkpoint_base);
+  fp = fopen(name_buf, "r");
+  if (fp == NULL) {
+    return;
+  }
+  while (fread(&ckpt, sizeof(ckpt), 1, fp) == 1) {
+    g_array_append_val(rr_checkpoints, ckpt);
+  }
+  fclose(fp);
+}
+
+// last checkpoint at or before instr, NULL if there is none
+static RR_checkpoint *rr_checkpoint_find(uint64_t instr) {
+  RR_checkpoint *best = NULL;
+  guint i;
+  for (i = 0; i < rr_checkpoints->len; i++) {
+    RR_checkpoint *ckpt = &g_array_index(rr_checkpoints, RR_checkpoint, i);
+    if (ckpt->prog_point.guest_instr_count <= instr &&
+        (best == NULL ||
+         ckpt->prog_point.guest_instr_count > best->prog_point.guest_instr_count)) {
+      best = ckpt;
+    }
+  }
+  return best;
+}
+
+static void rr_checkpoint_schedule(void) {
+  if (rr_checkpoint_interval == 0) {
+    rr_next_checkpoint = (uint64_t) -1;
+  }
+  else {
+    rr_next_checkpoint = (rr_prog_point.guest_instr_count / rr_checkpoint_interval + 1) *
+        rr_checkpoint_interval;
+  }
+}
+
+static inline void rr_get_checkpoint_file_name(uint64_t instr, char *file_name, size_t file_name_len) {
+  snprintf(file_name, file_name_len, "%s-rr-ckpt-%llu", rr_checkpoint_base,
+           (unsigned long long) instr);
+}
+
+// snapshot the guest here and remember where in the log replay resumes.
+// Called from cpu_exec between blocks, like the scissors savevm.
+void rr_do_checkpoint(void) {
+  char name_buf[1024];
+  RR_checkpoint ckpt;
+  RR_checkpoint *prev;
+  FILE *fp;
+
+  rr_assert(rr_in_replay());
+  ckpt.prog_point = rr_prog_point;
+  //mz entries still on the queue have been read, but not replayed yet
+  ckpt.log_offset = rr_queue_head ? rr_queue_head->file_offset : rr_nondet_log->bytes_read;
+  rr_checkpoint_schedule();
+
+  prev = rr_checkpoint_find(ckpt.prog_point.guest_instr_count);
+  if (prev && prev->prog_point.guest_instr_count == ckpt.prog_point.guest_instr_count) {
+    // left by an earlier replay
+    return;
+  }
+  rr_get_checkpoint_file_name(ckpt.prog_point.guest_instr_count, name_buf, sizeof(name_buf));
+  printf ("writing checkpoint:\t%s\n", name_buf);
+  do_savevm_rr(get_monitor(), name_buf);
+
+  snprintf(name_buf, sizeof(name_buf), "%s-rr-ckpt.idx", rr_checkpoint_base);
+  fp = fopen(name_buf, "a");
+  rr_assert(fp != NULL);
+  rr_assert(fwrite(&ckpt, sizeof(ckpt), 1, fp) == 1);
+  fclose(fp);
+  g_array_append_val(rr_checkpoints, ckpt);
+}
+
 void rr_reset_state(void *cpu_state) {
     //mz reset program point
     memset(&rr_prog_point, 0, sizeof(RR_prog_point));
@@ -1553,6 +1825,11 @@ int rr_do_begin_record(const char *file_name_full, void *cpu_state) {
   rr_get_nondet_log_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
   printf ("opening nondet log for write :\t%s\n", name_buf);
   rr_create_record_log(name_buf);
+  if (rr_dedup_payloads) {
+    rr_get_payload_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    printf ("opening payload store for write :\t%s\n", name_buf);
+    rr_payload_store_open(name_buf);
+  }
   // reset record/replay counters and flags
   rr_reset_state(cpu_state);
   g_free(rr_path_base);
@@ -1583,6 +1860,11 @@ void rr_do_end_record(void) {
   time_t rr_end_time;
   time(&rr_end_time);
   printf("Time taken was: %ld seconds.\n", rr_end_time - rr_start_time);
+  if (rr_nondet_log->deduped) {
+    printf("Payload store: %u unique buffers, %llu bytes.\n",
+           g_hash_table_size(rr_payload_index),
+           (unsigned long long) rr_nondet_log->payload_size);
+  }
   
   //log_all_cpu_states();
 
@@ -1613,16 +1895,28 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
     fprintf (logfile,"Begin vm replay for file_name_full = %s\n", file_name_full);    
     fprintf (logfile,"path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
   }
-  // first retrieve snapshot
-  rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+  // first retrieve snapshot, or the closest checkpoint if we can skip ahead
+  snprintf(rr_checkpoint_base, sizeof(rr_checkpoint_base), "%s/%s", rr_path, rr_name);
+  rr_checkpoints_load();
+  RR_checkpoint *ckpt = NULL;
+  if (rr_replay_start_instr) {
+    ckpt = rr_checkpoint_find(rr_replay_start_instr);
+  }
+  if (ckpt) {
+    rr_get_checkpoint_file_name(ckpt->prog_point.guest_instr_count, name_buf, sizeof(name_buf));
+    printf ("starting from checkpoint at instr %llu\n",
+            (unsigned long long) ckpt->prog_point.guest_instr_count);
+  }
+  else {
+    rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+  }
   if (rr_debug_whisper()) {
     fprintf (logfile,"reading snapshot:\t%s\n", name_buf);
   }
   printf ("loading snapshot\n");
   //  vm_stop(0) RUN_STATE_RESTORE_VM);
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_BEFORE_REPLAY_LOADVM]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_REPLAY_LOADVM) {
         plist->entry.before_loadvm();
     }
   snapshot_ret = load_vmstate_rr(name_buf);
@@ -1642,8 +1936,21 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
   rr_get_nondet_log_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
   printf ("opening nondet log for read :\t%s\n", name_buf);
   rr_create_replay_log(name_buf);
+  if (rr_nondet_log->deduped) {
+    rr_get_payload_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    printf ("mapping payload store :\t%s\n", name_buf);
+    rr_payload_table_map(name_buf);
+  }
   // reset record/replay counters and flags
   rr_reset_state(cpu_state);
+  if (ckpt) {
+    //mz pick up the count and the log where the checkpoint left them
+    rr_prog_point = ckpt->prog_point;
+    ((CPUState *) cpu_state)->rr_guest_instr_count = ckpt->prog_point.guest_instr_count;
+    rr_assert(fseek(rr_nondet_log->fp, ckpt->log_offset, SEEK_SET) == 0);
+    rr_nondet_log->bytes_read = ckpt->log_offset;
+  }
+  rr_checkpoint_schedule();
   // set global to turn on replay
   rr_mode = RR_REPLAY;
 
@@ -1668,6 +1975,8 @@ void rr_do_end_replay(int is_error) {
     else {
         printf ("Replay completed successfully. 1\n");
     }
+    // Let plugins' background work catch up with the replay
+    panda_work_flush(NULL);
 
     time_t rr_end_time;
     time(&rr_end_time);
@@ -1685,6 +1994,11 @@ void rr_do_end_replay(int is_error) {
 #endif
     printf("max_queue_len = %llu\n", rr_max_num_queue_entries);
     rr_max_num_queue_entries = 0;
+    if (rr_checkpoints) {
+        g_array_free(rr_checkpoints, TRUE);
+        rr_checkpoints = NULL;
+    }
+    rr_next_checkpoint = (uint64_t) -1;
     // cleanup the recycled list for log entries
     {
         unsigned long num_items = 0;
@@ -105,6 +105,7 @@ typedef struct rr_log_entry_t {
         // if log_entry.kind == RR_LAST
         // no variant fields
     } variant;
+    uint64_t file_offset;   // replay: where this entry starts in the nondet log
     struct rr_log_entry_t *next;
 } RR_log_entry;
 
@@ -123,6 +124,12 @@ typedef struct RR_log_t {
   RR_log_entry current_item;
   uint8_t current_item_valid;
   unsigned long long item_number;
+
+  // payload store (see rr_dedup_payloads); only valid if deduped
+  uint8_t deduped;
+  int payload_fd;              // record: fd of the payload file
+  uint64_t payload_size;       // record: bytes written; replay: bytes mapped
+  uint8_t *payload_base;       // replay: read-only mapping of the payload file
 } RR_log;
 
 RR_log_entry *rr_get_queue_head(void);
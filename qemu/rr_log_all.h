@@ -32,6 +32,8 @@
 #include <signal.h>
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 typedef enum {RR_OFF, RR_RECORD, RR_REPLAY} RR_mode;
@@ -733,5 +735,109 @@ void rr_record_net_transfer(RR_callsite_id call_site,
     Net_transfer_type transfer_type, uint64_t src_addr, uint64_t dest_addr,
     uint32_t num_bytes);
 
+/* Payload store.  When rr_dedup_payloads is set during record, device
+   buffers (DMA writes, unmapped buffers and packets) of at least
+   RR_PAYLOAD_MIN_LEN bytes are hashed and written once to a side file,
+   <name>-rr-payload.log, and the nondet log header gets
+   RR_LOG_DEDUP_PAYLOADS.  The nondet log entry then carries an
+   RR_payload_ref (offset into that file) in place of the bytes.  Replay
+   maps the payload file read-only and gives each entry its own copy of
+   the buffer, since consumers may modify it. */
+
+#define RR_PAYLOAD_MAGIC "PANDARRP"
+#define RR_PAYLOAD_MAGIC_LEN 8
+#define RR_PAYLOAD_MIN_LEN 64
+
+typedef uint64_t RR_payload_ref;
+
+extern int rr_dedup_payloads;
+
+// true iff a buffer of this length is stored by reference in a deduped log
+static inline uint8_t rr_payload_is_ref(uint8_t deduped, uint64_t len) {
+  return deduped && len >= RR_PAYLOAD_MIN_LEN;
+}
+
+// number of bytes a buffer of this length occupies in the nondet log
+static inline uint64_t rr_payload_log_bytes(uint8_t deduped, uint64_t len) {
+  return rr_payload_is_ref(deduped, len) ? sizeof(RR_payload_ref) : len;
+}
+
+/* Nondet log header, rewritten with the last prog point when recording
+   ends.  Logs from before RR_LOG_VERSION 1 have no magic, version or
+   flags and start directly with the last prog point. */
+
+#define RR_LOG_MAGIC "PANDARRL"
+#define RR_LOG_MAGIC_LEN 8
+#define RR_LOG_VERSION 1
+
+// device buffers may be references into the payload store
+#define RR_LOG_DEDUP_PAYLOADS 0x1
+
+typedef struct {
+  char magic[RR_LOG_MAGIC_LEN];
+  uint32_t version;
+  uint32_t flags;
+  RR_prog_point last_prog_point;
+} RR_log_header;
+
+static inline void rr_log_header_init(RR_log_header *hdr, uint32_t flags,
+                                      RR_prog_point last_prog_point) {
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN);
+  hdr->version = RR_LOG_VERSION;
+  hdr->flags = flags;
+  hdr->last_prog_point = last_prog_point;
+}
+
+// Parse the header from the first len bytes of a nondet log.  Returns its
+// size in the log, or 0 if it is truncated or of an unknown version.
+static inline size_t rr_log_header_parse(const uint8_t *buf, size_t len,
+                                         RR_log_header *hdr) {
+  if (len >= RR_LOG_MAGIC_LEN && !memcmp(buf, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN)) {
+    if (len < sizeof(*hdr)) {
+      return 0;
+    }
+    memcpy(hdr, buf, sizeof(*hdr));
+    return hdr->version == RR_LOG_VERSION ? sizeof(*hdr) : 0;
+  }
+  // version 0
+  if (len < sizeof(RR_prog_point)) {
+    return 0;
+  }
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(&hdr->last_prog_point, buf, sizeof(RR_prog_point));
+  return sizeof(RR_prog_point);
+}
+
+// Read the header of the nondet log open at fp and leave fp just past it.
+static inline size_t rr_log_header_read(FILE *fp, RR_log_header *hdr) {
+  uint8_t buf[sizeof(RR_log_header)];
+  size_t len;
+
+  rewind(fp);
+  len = rr_log_header_parse(buf, fread(buf, 1, sizeof(buf), fp), hdr);
+  if (len) {
+    fseek(fp, len, SEEK_SET);
+  }
+  return len;
+}
+
+/* Replay checkpoints.  With -replay-checkpoints N, replay saves a snapshot
+   <name>-rr-ckpt-<instr> roughly every N instructions and appends an
+   RR_checkpoint to <name>-rr-ckpt.idx.  A later replay of the same
+   recording with rr_replay_start_instr set starts from the last checkpoint
+   at or before that instruction instead of from the beginning. */
+
+typedef struct {
+  RR_prog_point prog_point;   // where the snapshot was taken
+  uint64_t log_offset;        // nondet log offset of the next entry to replay
+} RR_checkpoint;
+
+extern uint64_t rr_checkpoint_interval;
+extern uint64_t rr_next_checkpoint;
+extern uint64_t rr_replay_start_instr;
+
+void rr_do_checkpoint(void);
+
 #endif
 
@@ -85,13 +85,15 @@ static void rr_spit_log_entry(RR_log_entry item) {
                 int callbytes;
                 switch (item.variant.call_args.kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        callbytes = sizeof(args->variant.cpu_mem_rw_args) + args->variant.cpu_mem_rw_args.len;
+                        callbytes = sizeof(args->variant.cpu_mem_rw_args) +
+                            rr_payload_log_bytes(rr_nondet_log->deduped, args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
                         callbytes = sizeof(args->variant.cpu_mem_reg_region_args);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        callbytes = sizeof(args->variant.cpu_mem_unmap) + args->variant.cpu_mem_unmap.len;
+                        callbytes = sizeof(args->variant.cpu_mem_unmap) +
+                            rr_payload_log_bytes(rr_nondet_log->deduped, args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_HD_TRANSFER:
                         callbytes = sizeof(args->variant.hd_transfer_args);
@@ -215,7 +217,7 @@ static RR_log_entry *rr_read_item(void) {
                         //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
+                        fseek(rr_nondet_log->fp, rr_payload_log_bytes(rr_nondet_log->deduped, args->variant.cpu_mem_rw_args.len), SEEK_CUR);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
@@ -224,7 +226,7 @@ static RR_log_entry *rr_read_item(void) {
                         //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
+                        fseek(rr_nondet_log->fp, rr_payload_log_bytes(rr_nondet_log->deduped, args->variant.cpu_mem_unmap.len), SEEK_CUR);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
                         assert(fread(&(args->variant.cpu_mem_reg_region_args), 
@@ -238,7 +240,8 @@ static RR_log_entry *rr_read_item(void) {
                         assert(fread(&(args->variant.handle_packet_args),
                               sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
                         fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
+                            rr_payload_log_bytes(rr_nondet_log->deduped,
+                                args->variant.handle_packet_args.size), SEEK_CUR);
                         break;
                     case RR_CALL_NET_TRANSFER:
                         assert(fread(&(args->variant.net_transfer_args),
@@ -284,7 +287,15 @@ void rr_create_replay_log (const char *filename) {
 	     rr_nondet_log->name, rr_nondet_log->size);
   }
   //mz read the last program point from the log header.
-  assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  RR_log_header hdr;
+  assert(rr_log_header_read(rr_nondet_log->fp, &hdr) != 0);
+  rr_nondet_log->last_prog_point = hdr.last_prog_point;
+  // buffers in a deduped log are references into the payload store,
+  // which we only need to skip over
+  rr_nondet_log->deduped = (hdr.flags & RR_LOG_DEDUP_PAYLOADS) != 0;
+  if (rr_nondet_log->deduped) {
+    printf("Log uses a payload store\n");
+  }
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,305 @@
+/*
+ * rr_stats: summarize a nondet log without replaying it.
+ *
+ * Unlike rr_print, which reads and prints every entry, this maps the log
+ * and walks it in place, so it runs about as fast as the disk can deliver
+ * the file.  It reports entry counts and log bytes per entry kind, per
+ * skipped call kind and per callsite, plus a histogram of interrupt
+ * requests over instruction count.  Optionally, the entry headers can be
+ * exported as CSV (-c) or as one raw little-endian column file per field
+ * (-x), for loading into numpy or similar.
+ *
+ * usage: rr_stats [-n buckets] [-c out.csv] [-x prefix] <name>-rr-nondet.log
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#define RR_LOG_STANDALONE
+#include "cpu.h"
+#include "rr_log.h"
+
+RR_debug_level_type rr_debug_level = RR_DEBUG_WHISPER;
+
+typedef struct {
+    uint64_t count;
+    uint64_t bytes;
+} RR_stat;
+
+static RR_stat kind_stats[RR_LAST + 1];
+static RR_stat call_stats[RR_CALL_LAST + 1];
+static RR_stat callsite_stats[RR_CALLSITE_LAST + 1];
+
+// columns written with -x, one file each
+enum {
+    COL_OFFSET,     // uint64_t file offset of the entry
+    COL_INSTR,      // uint64_t guest instruction count
+    COL_PC,         // uint64_t
+    COL_SECONDARY,  // uint64_t
+    COL_KIND,       // uint8_t RR_log_entry_kind
+    COL_CALLSITE,   // uint8_t RR_callsite_id
+    COL_CALL_KIND,  // uint8_t RR_skipped_call_kind, 0xff if not a skipped call
+    COL_BYTES,      // uint32_t bytes taken in the log
+    COL_LAST
+};
+static const char *col_names[COL_LAST] = {
+    "offset", "instr", "pc", "secondary", "kind", "callsite", "call_kind", "bytes"
+};
+
+#define IO_BUF_SIZE (1 << 20)
+
+static FILE *open_output(const char *name) {
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL) {
+        perror(name);
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, IO_BUF_SIZE);
+    return fp;
+}
+
+static void print_stat(const char *name, RR_stat *st, uint64_t total_bytes) {
+    printf("  %-40s %12llu entries %14llu bytes %6.2f%%\n", name,
+           (unsigned long long) st->count, (unsigned long long) st->bytes,
+           total_bytes ? 100.0 * st->bytes / total_bytes : 0.0);
+}
+
+int main(int argc, char **argv) {
+    const char *csv_name = NULL;
+    const char *col_prefix = NULL;
+    uint32_t num_buckets = 50;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:x:")) != -1) {
+        switch (c) {
+            case 'n':
+                num_buckets = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                csv_name = optarg;
+                break;
+            case 'x':
+                col_prefix = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc - 1 || num_buckets == 0) {
+usage:
+        fprintf(stderr, "usage: %s [-n buckets] [-c out.csv] [-x prefix] <name>-rr-nondet.log\n", argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return 1;
+    }
+    struct stat statbuf;
+    assert(fstat(fd, &statbuf) == 0);
+    uint64_t size = statbuf.st_size;
+    uint8_t *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(base != MAP_FAILED);
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    RR_log_header hdr;
+    uint64_t hdr_len = rr_log_header_parse(base, size, &hdr);
+    if (hdr_len == 0) {
+        fprintf(stderr, "%s: bad or unsupported nondet log header\n", filename);
+        return 1;
+    }
+    uint8_t deduped = (hdr.flags & RR_LOG_DEDUP_PAYLOADS) != 0;
+    uint64_t total_instr = hdr.last_prog_point.guest_instr_count;
+    uint64_t bucket_size = total_instr / num_buckets + 1;
+    uint64_t *interrupts = g_new0(uint64_t, num_buckets);
+
+    FILE *csv = NULL;
+    FILE *cols[COL_LAST] = {NULL};
+    if (csv_name) {
+        csv = open_output(csv_name);
+        fprintf(csv, "offset,instr,pc,secondary,kind,callsite,call_kind,bytes\n");
+    }
+    if (col_prefix) {
+        int i;
+        for (i = 0; i < COL_LAST; i++) {
+            char *col_name = g_strdup_printf("%s.%s", col_prefix, col_names[i]);
+            cols[i] = open_output(col_name);
+            g_free(col_name);
+        }
+    }
+
+    // the on-disk layout is what rr_write_item produces: a packed
+    // header followed by the variant, so fields are copied out rather
+    // than read through pointers into the (unaligned) mapping
+    uint64_t pos = hdr_len;
+    uint64_t num_entries = 0;
+    while (pos < size) {
+        uint64_t start = pos;
+        RR_prog_point pp;
+        uint8_t kind, callsite;
+        uint8_t call_kind = 0xff;
+
+        assert(pos + sizeof(RR_prog_point) + 2 <= size);
+        memcpy(&pp, base + pos, sizeof(RR_prog_point));
+        pos += sizeof(RR_prog_point);
+        kind = base[pos++];
+        callsite = base[pos++];
+
+        switch (kind) {
+            case RR_INPUT_1:
+                pos += sizeof(uint8_t);
+                break;
+            case RR_INPUT_2:
+                pos += sizeof(uint16_t);
+                break;
+            case RR_INPUT_4:
+                pos += sizeof(uint32_t);
+                break;
+            case RR_INPUT_8:
+                pos += sizeof(uint64_t);
+                break;
+            case RR_INTERRUPT_REQUEST:
+                pos += sizeof(uint16_t);
+                interrupts[pp.guest_instr_count / bucket_size < num_buckets ?
+                           pp.guest_instr_count / bucket_size : num_buckets - 1]++;
+                break;
+            case RR_EXIT_REQUEST:
+                pos += sizeof(uint16_t);
+                break;
+            case RR_SKIPPED_CALL:
+                {
+                    RR_skipped_call_args args;
+                    call_kind = base[pos++];
+                    switch (call_kind) {
+                        case RR_CALL_CPU_MEM_RW:
+                            assert(pos + sizeof(args.variant.cpu_mem_rw_args) <= size);
+                            memcpy(&args.variant.cpu_mem_rw_args, base + pos, sizeof(args.variant.cpu_mem_rw_args));
+                            pos += sizeof(args.variant.cpu_mem_rw_args);
+                            pos += rr_payload_log_bytes(deduped, args.variant.cpu_mem_rw_args.len);
+                            break;
+                        case RR_CALL_CPU_MEM_UNMAP:
+                            assert(pos + sizeof(args.variant.cpu_mem_unmap) <= size);
+                            memcpy(&args.variant.cpu_mem_unmap, base + pos, sizeof(args.variant.cpu_mem_unmap));
+                            pos += sizeof(args.variant.cpu_mem_unmap);
+                            pos += rr_payload_log_bytes(deduped, args.variant.cpu_mem_unmap.len);
+                            break;
+                        case RR_CALL_CPU_REG_MEM_REGION:
+                            pos += sizeof(args.variant.cpu_mem_reg_region_args);
+                            break;
+                        case RR_CALL_HD_TRANSFER:
+                            pos += sizeof(args.variant.hd_transfer_args);
+                            break;
+                        case RR_CALL_HANDLE_PACKET:
+                            assert(pos + sizeof(args.variant.handle_packet_args) <= size);
+                            memcpy(&args.variant.handle_packet_args, base + pos, sizeof(args.variant.handle_packet_args));
+                            pos += sizeof(args.variant.handle_packet_args);
+                            pos += rr_payload_log_bytes(deduped, args.variant.handle_packet_args.size);
+                            break;
+                        case RR_CALL_NET_TRANSFER:
+                            pos += sizeof(args.variant.net_transfer_args);
+                            break;
+                        default:
+                            fprintf(stderr, "Unknown skipped call kind %d at offset %llu\n",
+                                    call_kind, (unsigned long long) start);
+                            return 1;
+                    }
+                    uint64_t bytes = pos - start;
+                    call_stats[call_kind].count++;
+                    call_stats[call_kind].bytes += bytes;
+                }
+                break;
+            case RR_LAST:
+            case RR_DEBUG:
+                break;
+            default:
+                fprintf(stderr, "Unknown RR log kind %d at offset %llu\n",
+                        kind, (unsigned long long) start);
+                return 1;
+        }
+        if (pos > size) {
+            fprintf(stderr, "Log truncated in entry at offset %llu\n", (unsigned long long) start);
+            return 1;
+        }
+
+        uint32_t bytes = pos - start;
+        kind_stats[kind].count++;
+        kind_stats[kind].bytes += bytes;
+        if (callsite > RR_CALLSITE_LAST) callsite = RR_CALLSITE_LAST;
+        callsite_stats[callsite].count++;
+        callsite_stats[callsite].bytes += bytes;
+        num_entries++;
+
+        if (csv) {
+            fprintf(csv, "%llu,%llu,0x%llx,0x%llx,%s,%s,%s,%u\n",
+                    (unsigned long long) start,
+                    (unsigned long long) pp.guest_instr_count,
+                    (unsigned long long) pp.pc,
+                    (unsigned long long) pp.secondary,
+                    get_log_entry_kind_string(kind),
+                    get_callsite_string(callsite),
+                    call_kind == 0xff ? "" : get_skipped_call_kind_string(call_kind),
+                    bytes);
+        }
+        if (col_prefix) {
+            fwrite(&start, sizeof(start), 1, cols[COL_OFFSET]);
+            fwrite(&pp.guest_instr_count, sizeof(uint64_t), 1, cols[COL_INSTR]);
+            fwrite(&pp.pc, sizeof(uint64_t), 1, cols[COL_PC]);
+            fwrite(&pp.secondary, sizeof(uint64_t), 1, cols[COL_SECONDARY]);
+            fwrite(&kind, 1, 1, cols[COL_KIND]);
+            fwrite(&callsite, 1, 1, cols[COL_CALLSITE]);
+            fwrite(&call_kind, 1, 1, cols[COL_CALL_KIND]);
+            fwrite(&bytes, sizeof(bytes), 1, cols[COL_BYTES]);
+        }
+    }
+
+    printf("RR log %s: %llu instructions, %llu entries, %llu bytes%s\n",
+           filename, (unsigned long long) total_instr,
+           (unsigned long long) num_entries, (unsigned long long) size,
+           deduped ? " (deduped payloads)" : "");
+
+    int i;
+    printf("\nBy entry kind:\n");
+    for (i = 0; i <= RR_LAST; i++) {
+        if (kind_stats[i].count)
+            print_stat(get_log_entry_kind_string(i), &kind_stats[i], size);
+    }
+    printf("\nBy skipped call kind:\n");
+    for (i = 0; i <= RR_CALL_LAST; i++) {
+        if (call_stats[i].count)
+            print_stat(get_skipped_call_kind_string(i), &call_stats[i], size);
+    }
+    printf("\nBy callsite:\n");
+    for (i = 0; i <= RR_CALLSITE_LAST; i++) {
+        if (callsite_stats[i].count)
+            print_stat(get_callsite_string(i), &callsite_stats[i], size);
+    }
+
+    uint64_t max_bucket = 0;
+    uint32_t b;
+    for (b = 0; b < num_buckets; b++) {
+        if (interrupts[b] > max_bucket) max_bucket = interrupts[b];
+    }
+    printf("\nInterrupt requests per %llu instructions:\n", (unsigned long long) bucket_size);
+    for (b = 0; b < num_buckets; b++) {
+        int bar = max_bucket ? (int) (50 * interrupts[b] / max_bucket) : 0;
+        printf("  %14llu %10llu %8.3f/Minstr |%.*s\n",
+               (unsigned long long) (b * bucket_size),
+               (unsigned long long) interrupts[b],
+               1e6 * interrupts[b] / bucket_size, bar,
+               "##################################################");
+    }
+
+    if (csv) fclose(csv);
+    for (i = 0; i < COL_LAST; i++) {
+        if (cols[i]) fclose(cols[i]);
+    }
+    g_free(interrupts);
+    munmap(base, size);
+    close(fd);
+    return 0;
+}
@@ -1661,6 +1661,13 @@ static int qemu_concat_section(QEMUFile* dst, QEMUFile* src)
     return ret;
 }
 
+/* Where in dst the data of the section being written to tmp_save will
+ * start once qemu_concat_section has copied it over. */
+static int64_t qemu_section_data_offset(QEMUFile *dst)
+{
+    return qemu_ftell(dst) + (qemu_file_is_fopen(dst) ? 8 : 0);
+}
+
 int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared)
 {
@@ -1702,6 +1709,7 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_be32(f, se->instance_id);
         qemu_put_be32(f, se->version_id);
 
+        ram_save_section_offset = qemu_section_data_offset(f);
         ret = se->save_live_state(mon, tmp_save, QEMU_VM_SECTION_START, se->opaque);
         if (ret >= 0){
             ret = qemu_concat_section(f, tmp_save);
@@ -1744,6 +1752,7 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
+        ram_save_section_offset = qemu_section_data_offset(f);
         ret = se->save_live_state(mon, tmp_save, QEMU_VM_SECTION_PART, se->opaque);
         qemu_concat_section(f, tmp_save);
         if (ret <= 0) {
@@ -1785,6 +1794,7 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
+        ram_save_section_offset = qemu_section_data_offset(f);
         ret = se->save_live_state(mon, tmp_save, QEMU_VM_SECTION_END, se->opaque);
         if (ret >= 0){
             ret = qemu_concat_section(f, tmp_save);
@@ -2280,7 +2290,10 @@ int do_savevm_rr(Monitor *mon, const char *name) {
         error_report("Could not open VM state file\n");
         return -1;
     }
+    /* lay RAM out so that replay can map it lazily (see load_vmstate_rr) */
+    ram_save_page_aligned = 1;
     ret = qemu_savevm_state(mon, f);
+    ram_save_page_aligned = 0;
     qemu_fclose(f);
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
@@ -2301,7 +2314,11 @@ int load_vmstate_rr(const char *name) {
     }
 
     qemu_system_reset(VMRESET_SILENT);
+    /* guest RAM is mapped copy-on-write from the snapshot where possible;
+       the mapping outlives the file */
+    ram_load_mmap_fd = qemu_stdio_fd(f);
     ret = qemu_loadvm_state(f);
+    ram_load_mmap_fd = -1;
 
     qemu_fclose(f);
     if (ret < 0) {
@@ -67,6 +67,25 @@
 #define MMU_INSTR_VARS
 // rwhelan: flag to indicate whether address has been logged
 static uint8_t logged;
+
+// Physical address for the PANDA phys-mem callbacks. When the TLB entry
+// for addr is valid (always the case once the access itself is done) the
+// page comes from the TLB; otherwise fall back to walking the page tables.
+static inline target_phys_addr_t panda_tlb_phys_addr(CPUState *env,
+        target_ulong addr, int mmu_idx, target_ulong tlb_addr)
+{
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    if ((addr & TARGET_PAGE_MASK) ==
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        return env->tlb_phys[mmu_idx][index] + (addr & ~TARGET_PAGE_MASK);
+    }
+    return cpu_get_phys_addr(env, addr);
+}
+
+#define PANDA_TLB_PHYS_ADDR(type) \
+    panda_tlb_phys_addr(env, addr, mmu_idx, \
+        env->tlb_table[mmu_idx][(addr >> TARGET_PAGE_BITS) & \
+                                (CPU_TLB_SIZE - 1)].type)
 #endif
 #endif
 
@@ -135,16 +154,23 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 #ifdef MMU_INSTR
 
     // newer version
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
-            DATA_SIZE);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_before_read(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE);
+    panda_cb_entry *plist;
+    target_phys_addr_t paddr = -1;
+    if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_BEFORE_READ) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_BEFORE_READ))) {
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_BEFORE_READ) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
+                DATA_SIZE);
+        }
+        if (panda_cb_any(PANDA_CB_PHYS_MEM_BEFORE_READ)) {
+            paddr = PANDA_TLB_PHYS_ADDR(ADDR_READ);
+            PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_BEFORE_READ) {
+                if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+                plist->entry.phys_mem_before_read(env, env->panda_guest_pc,
+                    paddr, DATA_SIZE);
+            }
+        }
     }
     
 #endif    
@@ -156,6 +182,12 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (tlb_addr & TLB_PANDA_MEMCB) {
+#ifndef MMU_INSTR
+            panda_memcb_retranslate(env, GETPC());
+#endif
+            tlb_addr &= ~TLB_PANDA_MEMCB;
+        }
         if (tlb_addr & ~TARGET_PAGE_MASK) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
@@ -197,27 +229,42 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 #ifdef MMU_INSTR
     // deprecated versions
     // PANDA instrumentation: memory read
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &res);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_read(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &res);
-    }
+    if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_READ) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_READ) |
+                         PANDA_CB_BIT(PANDA_CB_VIRT_MEM_AFTER_READ) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_AFTER_READ))) {
+        if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_PHYS_MEM_READ) |
+                             PANDA_CB_BIT(PANDA_CB_PHYS_MEM_AFTER_READ))) {
+            paddr = PANDA_TLB_PHYS_ADDR(ADDR_READ);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_READ) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &res);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_READ) {
+            if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+            plist->entry.phys_mem_read(env, env->panda_guest_pc,
+                paddr, DATA_SIZE, &res);
+        }
 
-    // newer version
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &res);
+        // newer version
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_AFTER_READ) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &res);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_AFTER_READ) {
+            if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+            plist->entry.phys_mem_after_read(env, env->panda_guest_pc,
+                paddr, DATA_SIZE, &res);
+        }
     }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_after_read(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &res);
+    if (panda_cb_any(PANDA_CB_MEM_BATCH)) {
+        if (paddr == (target_phys_addr_t) -1) {
+            paddr = PANDA_TLB_PHYS_ADDR(ADDR_READ);
+        }
+        panda_mem_batch_add(env, addr, paddr, DATA_SIZE, res, false);
     }
     
 
@@ -241,6 +288,12 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (tlb_addr & TLB_PANDA_MEMCB) {
+#ifndef MMU_INSTR
+            panda_memcb_retranslate(env, retaddr);
+#endif
+            tlb_addr &= ~TLB_PANDA_MEMCB;
+        }
         if (tlb_addr & ~TARGET_PAGE_MASK) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
@@ -277,9 +330,8 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory read
     // rwhelan: redundant?
-    /*panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    /*panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_READ) {
         plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
             DATA_SIZE, &res);
     }*/
@@ -364,28 +416,38 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
     // PANDA instrumentation: memory write
 
     // deprecated version
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_write(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &val);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_write(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
-    }
+    panda_cb_entry *plist;
+    target_phys_addr_t paddr = -1;
+    if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_WRITE) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_WRITE) |
+                         PANDA_CB_BIT(PANDA_CB_VIRT_MEM_BEFORE_WRITE) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_BEFORE_WRITE))) {
+        if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_PHYS_MEM_WRITE) |
+                             PANDA_CB_BIT(PANDA_CB_PHYS_MEM_BEFORE_WRITE))) {
+            paddr = PANDA_TLB_PHYS_ADDR(addr_write);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_WRITE) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_write(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &val);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_WRITE) {
+            if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+            plist->entry.phys_mem_write(env, env->panda_guest_pc,
+                paddr, DATA_SIZE, &val);
+        }
 
-    // newer version
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &val);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_before_write(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
+        // newer version
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_BEFORE_WRITE) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &val);
+        }
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_BEFORE_WRITE) {
+            if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+            plist->entry.phys_mem_before_write(env, env->panda_guest_pc,
+                paddr, DATA_SIZE, &val);
+        }
     }
 
 #endif
@@ -393,6 +455,12 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (tlb_addr & TLB_PANDA_MEMCB) {
+#ifndef MMU_INSTR
+            panda_memcb_retranslate(env, GETPC());
+#endif
+            tlb_addr &= ~TLB_PANDA_MEMCB;
+        }
         if (tlb_addr & ~TARGET_PAGE_MASK) {
             //mz 10.20.2009  There's something in the lower 12 bits (and
             //TLB_INVALID_MASK is not it) - therefore, it must be IO
@@ -437,15 +505,27 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
     // PANDA instrumentation: memory write
 
     // newer version
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &val);
+    if (panda_cb_mask & (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_AFTER_WRITE) |
+                         PANDA_CB_BIT(PANDA_CB_PHYS_MEM_AFTER_WRITE))) {
+        PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_AFTER_WRITE) {
+            if (!panda_memcb_match(plist->filter, env, addr, DATA_SIZE)) continue;
+            plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &val);
+        }
+        if (panda_cb_any(PANDA_CB_PHYS_MEM_AFTER_WRITE)) {
+            paddr = PANDA_TLB_PHYS_ADDR(addr_write);
+            PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_AFTER_WRITE) {
+                if (!panda_memcb_match(plist->filter, env, paddr, DATA_SIZE)) continue;
+                plist->entry.phys_mem_after_write(env, env->panda_guest_pc,
+                    paddr, DATA_SIZE, &val);
+            }
+        }
     }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_after_write(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
+    if (panda_cb_any(PANDA_CB_MEM_BATCH)) {
+        if (paddr == (target_phys_addr_t) -1) {
+            paddr = PANDA_TLB_PHYS_ADDR(addr_write);
+        }
+        panda_mem_batch_add(env, addr, paddr, DATA_SIZE, val, true);
     }
 #endif
 
@@ -468,8 +548,8 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory write
     // rwhelan: redundant?
-    /*panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_WRITE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    /*panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_WRITE) {
         plist->entry.virt_mem_write(env, env->panda_guest_pc, addr, DATA_SIZE, &val);
     }*/
 #endif
@@ -477,6 +557,12 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (tlb_addr & TLB_PANDA_MEMCB) {
+#ifndef MMU_INSTR
+            panda_memcb_retranslate(env, retaddr);
+#endif
+            tlb_addr &= ~TLB_PANDA_MEMCB;
+        }
         if (tlb_addr & ~TARGET_PAGE_MASK) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
@@ -613,9 +613,8 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
     int op1 = (insn >> 8) & 0xf;
     if (op1 == 7){
         // PANDA instrumentation: guest hypercall
-        panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL;
-                plist = panda_cb_list_next(plist)){
+        panda_cb_entry *plist;
+        PANDA_CB_FOREACH(plist, PANDA_CB_GUEST_HYPERCALL){
             plist->entry.guest_hypercall(env);
         }
     }
@@ -1382,9 +1381,8 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
 
     if (cp_num == 7){
         // PANDA instrumentation: guest hypercall
-        panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL;
-                plist = panda_cb_list_next(plist)) {
+        panda_cb_entry *plist;
+        PANDA_CB_FOREACH(plist, PANDA_CB_GUEST_HYPERCALL) {
             plist->entry.guest_hypercall(env);
         }
     }
@@ -1439,7 +1437,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
     int op2;
     int crm;
 
-    panda_cb_list *plist;
+    panda_cb_entry *plist;
     target_ulong oldval;
 
     op1 = (insn >> 21) & 7;
@@ -1506,23 +1504,26 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
 	    switch (op2) {
 	    case 0:
                 oldval = env->cp15.c2_base0;
-		for(plist = panda_cbs[PANDA_CB_VMI_PGD_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		PANDA_CB_FOREACH(plist, PANDA_CB_VMI_PGD_CHANGED) {
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base0 = val;
 		break;
 	    case 1:
                 oldval = env->cp15.c2_base1;
-		for(plist = panda_cbs[PANDA_CB_VMI_PGD_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		PANDA_CB_FOREACH(plist, PANDA_CB_VMI_PGD_CHANGED) {
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base1 = val;
+		/* not part of the panda_current_asid key */
+		panda_v2p_cache_flush();
 		break;
 	    case 2:
                 val &= 7;
                 env->cp15.c2_control = val;
 		env->cp15.c2_mask = ~(((uint32_t)0xffffffffu) >> val);
                 env->cp15.c2_base_mask = ~((uint32_t)0x3fffu >> val);
+		panda_v2p_cache_flush();
 		break;
 	    default:
 		goto bad_reg;
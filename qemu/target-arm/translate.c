@@ -105,6 +105,22 @@ static TCGv_i64 cpu_F0d, cpu_F1d;
 
 #include "panda_plugin.h"
 
+/* The TCG global that holds the CPUState field at env_offset mid-block,
+   for panda_insn_gen.h: the copy in env may be stale. */
+static inline bool panda_insn_env_global(size_t env_offset, TCGv *v)
+{
+    size_t regs = offsetof(CPUState, regs);
+
+    if (env_offset >= regs && env_offset < regs + sizeof(uint32_t) * 16 &&
+        (env_offset - regs) % sizeof(uint32_t) == 0) {
+        *v = cpu_R[(env_offset - regs) / sizeof(uint32_t)];
+        return true;
+    }
+    return false;
+}
+
+#include "panda_insn_gen.h"
+
 static const char *regnames[] =
     { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
       "r8", "r9", "r10", "r11", "r12", "r13", "r14", "pc" };
@@ -9871,6 +9887,72 @@ undef:
     gen_exception_insn(s, 2, EXCP_UDEF);
 }
 
+/* PANDA: fill in panda_cur_insn for the instruction at s->pc */
+static void panda_classify_insn(DisasContext *s, TranslationBlock *tb)
+{
+    panda_insn_info *ii = &panda_cur_insn;
+    uint32_t pc = s->pc;
+
+    ii->cls = PANDA_INSN_NONE;
+    ii->pc = pc;
+    ii->target = -1;
+    if (s->thumb) {
+        uint32_t insn = lduw_code(pc);
+        if ((insn & 0xff00) == 0xdf00) {            /* svc */
+            ii->cls = PANDA_INSN_SYSCALL;
+        } else if (insn == 0x4770 ||                /* bx lr */
+                   (insn & 0xff00) == 0xbd00) {     /* pop {..., pc} */
+            ii->cls = PANDA_INSN_RET;
+        } else if ((insn & 0xff87) == 0x4780) {     /* blx reg */
+            ii->cls = PANDA_INSN_CALL;
+        } else if ((insn & 0xf800) == 0xf000) {
+            uint32_t insn2 = lduw_code(pc + 2);
+            if ((insn2 & 0xc000) == 0xc000) {       /* bl, blx imm */
+                uint32_t sbit = (insn >> 10) & 1;
+                uint32_t i1 = !(((insn2 >> 13) & 1) ^ sbit);
+                uint32_t i2 = !(((insn2 >> 11) & 1) ^ sbit);
+                int32_t off = (sbit << 24) | (i1 << 23) | (i2 << 22) |
+                              ((insn & 0x3ff) << 12) | ((insn2 & 0x7ff) << 1);
+                off = (off << 7) >> 7;
+                ii->cls = PANDA_INSN_CALL;
+                if (insn2 & 0x1000) {
+                    ii->target = pc + 4 + off;
+                } else {
+                    ii->target = ((pc + 4) & ~3) + off;
+                }
+            }
+        }
+    } else {
+        uint32_t insn = ldl_code(pc);
+        int32_t off = ((int32_t)(insn << 8)) >> 6;
+        if ((insn >> 28) == 0xf) {
+            if ((insn & 0x0e000000) == 0x0a000000) {    /* blx imm */
+                ii->cls = PANDA_INSN_CALL;
+                ii->target = pc + 8 + off + ((insn >> 23) & 2);
+            }
+        } else if ((insn & 0x0f000000) == 0x0b000000) { /* bl */
+            ii->cls = PANDA_INSN_CALL;
+            ii->target = pc + 8 + off;
+        } else if ((insn & 0x0ffffff0) == 0x012fff30 || /* blx reg */
+                   (insn & 0x0fffffff) == 0x01a0e00f) { /* mov lr, pc */
+            ii->cls = PANDA_INSN_CALL;
+        } else if ((insn & 0x0fffffff) == 0x012fff1e || /* bx lr */
+                   (insn & 0x0fffffff) == 0x01a0f00e || /* mov pc, lr */
+                   (insn & 0x0fff8000) == 0x08bd8000 || /* pop {..., pc} */
+                   (insn & 0x0fffffff) == 0x049df004) { /* pop {pc} */
+            ii->cls = PANDA_INSN_RET;
+        } else if ((insn & 0x0f000000) == 0x0f000000) { /* svc */
+            ii->cls = PANDA_INSN_SYSCALL;
+        }
+    }
+
+    if (ii->cls != PANDA_INSN_NONE) {
+        tb->panda_insn_cls = ii->cls;
+        tb->panda_insn_pc = ii->pc;
+        tb->panda_insn_target = ii->target;
+    }
+}
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -9922,13 +10004,9 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-#ifdef CONFIG_SOFTMMU
-    // Terminate translation early if we have an interrupt coming up
-    if (!search_pc && rr_in_replay())
-        max_insns = max_insns < rr_num_instr_before_next_interrupt ?
-                        max_insns : rr_num_instr_before_next_interrupt;
-#endif
-    // But during search_pc always translate the same number we did last time
+    // Blocks that must stop early for a replayed interrupt are translated
+    // with a count in cflags (see tb_find_truncated in cpu-exec.c).
+    // During search_pc always translate the same number we did last time
     if (search_pc)
         max_insns = tb->icount;
 
@@ -9938,6 +10016,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         tb->num_guest_insns = 0;
 #endif
 
+    tb->panda_insn_cls = PANDA_INSN_NONE;
     gen_icount_start();
 
     tcg_clear_temp_count();
@@ -10052,10 +10131,14 @@ static inline void gen_intermediate_code_internal(CPUState *env,
             tcg_gen_debug_insn_start(dc->pc);
         }
 
+        if (panda_insn_classify) {
+            panda_classify_insn(dc, tb);
+        }
+
         // PANDA: ask if anyone wants execution notification
         bool panda_exec_cb = false;
-        panda_cb_list *plist;
-        for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+        panda_cb_entry *plist;
+        PANDA_CB_FOREACH(plist, PANDA_CB_INSN_TRANSLATE) {
             panda_exec_cb |= plist->entry.insn_translate(env, dc->pc);
         }
 
@@ -10063,6 +10146,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         if (unlikely(panda_exec_cb)) {
             gen_helper_panda_insn_exec(tcg_const_tl(dc->pc));
         }
+        gen_panda_insn_actions(dc->pc);
 
         if (dc->thumb) {
             disas_thumb_insn(env, dc);
@@ -2123,8 +2123,8 @@ void helper_cpuid(void)
     helper_svm_check_intercept_param(SVM_EXIT_CPUID, 0);
 
     // PANDA instrumentation: guest hypercall
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_GUEST_HYPERCALL) {
         plist->entry.guest_hypercall(env);
     }
 
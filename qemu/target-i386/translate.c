@@ -99,6 +99,31 @@ static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
 #include "panda_plugin.h"
 
+/* The TCG global that holds the CPUState field at env_offset mid-block,
+   for panda_insn_gen.h: the copy in env may be stale. */
+static inline bool panda_insn_env_global(size_t env_offset, TCGv *v)
+{
+    size_t regs = offsetof(CPUState, regs);
+
+    if (env_offset >= regs &&
+        env_offset < regs + sizeof(target_ulong) * CPU_NB_REGS &&
+        (env_offset - regs) % sizeof(target_ulong) == 0) {
+        *v = cpu_regs[(env_offset - regs) / sizeof(target_ulong)];
+        return true;
+    }
+    if (env_offset == offsetof(CPUState, cc_src)) {
+        *v = cpu_cc_src;
+        return true;
+    }
+    if (env_offset == offsetof(CPUState, cc_dst)) {
+        *v = cpu_cc_dst;
+        return true;
+    }
+    return false;
+}
+
+#include "panda_insn_gen.h"
+
 #ifdef TARGET_X86_64
 static int x86_64_hregs;
 #endif
@@ -7808,6 +7833,92 @@ void optimize_flags_init(void)
 #include "helper.h"
 }
 
+/* PANDA: fill in panda_cur_insn for the instruction at pc. Only the
+   prefixes and opcode bytes (and the displacement of a direct call) are
+   looked at, all of which disas_insn reads anyway. */
+static void panda_classify_insn(DisasContext *s, TranslationBlock *tb,
+                                target_ulong pc)
+{
+    panda_insn_info *ii = &panda_cur_insn;
+    target_ulong p = pc;
+    int b, op16 = !s->code32;
+
+    ii->cls = PANDA_INSN_NONE;
+    ii->pc = pc;
+    ii->target = -1;
+    for (;;) {
+        b = ldub_code(p++);
+        if (b == 0x66) {
+            op16 = s->code32;
+        } else if (b == 0x67 || b == 0xf0 || b == 0xf2 || b == 0xf3 ||
+                   b == 0x26 || b == 0x2e || b == 0x36 || b == 0x3e ||
+                   b == 0x64 || b == 0x65 ||
+                   (CODE64(s) && (b & 0xf0) == 0x40)) {
+            /* other prefix, or REX */
+        } else {
+            break;
+        }
+    }
+    if (CODE64(s)) {
+        op16 = 0;
+    }
+
+    switch (b) {
+    case 0xe8: /* call rel */
+        ii->cls = PANDA_INSN_CALL;
+        if (op16) {
+            int16_t rel = lduw_code(p);
+            ii->target = s->cs_base + ((p + 2 - s->cs_base + rel) & 0xffff);
+        } else {
+            int32_t rel = ldl_code(p);
+            ii->target = p + 4 + rel;
+        }
+        break;
+    case 0x9a: /* lcall im */
+        ii->cls = PANDA_INSN_CALL;
+        break;
+    case 0xff:
+        switch ((ldub_code(p) >> 3) & 7) {
+        case 2: /* call Ev */
+        case 3: /* lcall Ev */
+            ii->cls = PANDA_INSN_CALL;
+            break;
+        case 4: /* jmp Ev */
+        case 5: /* ljmp Ev */
+            ii->cls = PANDA_INSN_JMP_INDIRECT;
+            break;
+        }
+        break;
+    case 0xc2: case 0xc3: case 0xca: case 0xcb:
+        ii->cls = PANDA_INSN_RET;
+        break;
+    case 0xcf:
+        ii->cls = PANDA_INSN_IRET;
+        break;
+    case 0xcc: case 0xcd: case 0xce:
+        ii->cls = PANDA_INSN_INT;
+        break;
+    case 0x0f:
+        switch (ldub_code(p)) {
+        case 0x05: /* syscall */
+        case 0x34: /* sysenter */
+            ii->cls = PANDA_INSN_SYSCALL;
+            break;
+        case 0x07: /* sysret */
+        case 0x35: /* sysexit */
+            ii->cls = PANDA_INSN_SYSRET;
+            break;
+        }
+        break;
+    }
+
+    if (ii->cls != PANDA_INSN_NONE) {
+        tb->panda_insn_cls = ii->cls;
+        tb->panda_insn_pc = ii->pc;
+        tb->panda_insn_target = ii->target;
+    }
+}
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -7932,6 +8043,7 @@ static void gen_intermediate_code_internal(CPUState *env,
         max_insns = tb->icount;
 #endif
 
+    tb->panda_insn_cls = PANDA_INSN_NONE;
     gen_icount_start();
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
@@ -7986,10 +8098,14 @@ static void gen_intermediate_code_internal(CPUState *env,
             }
 #endif
 
+            if (panda_insn_classify) {
+                panda_classify_insn(dc, tb, pc_ptr);
+            }
+
             // PANDA: ask if anyone wants execution notification
             bool panda_exec_cb = false;
-            panda_cb_list *plist;
-            for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+            panda_cb_entry *plist;
+            PANDA_CB_FOREACH(plist, PANDA_CB_INSN_TRANSLATE) {
                 panda_exec_cb |= plist->entry.insn_translate(env, pc_ptr);
             }
 
@@ -7997,6 +8113,7 @@ static void gen_intermediate_code_internal(CPUState *env,
             if (unlikely(panda_exec_cb)) {
                 gen_helper_panda_insn_exec(tcg_const_tl(pc_ptr));
             }
+            gen_panda_insn_actions(pc_ptr);
 
             
             //mz generate micro-ops for this instruction
@@ -8049,17 +8166,8 @@ static void gen_intermediate_code_internal(CPUState *env,
         }
 
 #ifdef CONFIG_SOFTMMU
-        if (rr_mode == RR_REPLAY) {
-            //mz make sure we'll terminate in time for next interrupt
-            //mz NOTE: we cannot muck with size of translation block if search_pc
-            //is set - must be the same as last translation!
-            if (search_pc == 0 && tb->num_guest_insns == rr_num_instr_before_next_interrupt) {
-                //printf("Terminating block %#x early because we have an interrupt coming up.\n", pc_start);
-                gen_jmp_im(pc_ptr - dc->cs_base);
-                gen_eob(dc);
-                break;
-            }
-        }
+        // blocks that must stop early for a replayed interrupt are
+        // translated with a count in cflags; see tb_find_truncated
         if (rr_mode != RR_OFF) {
             //mz update EIP (otherwise it has already been updated by a gen_jmp_im instruction)
             //            assert( (pc_ptr - prev_pc_ptr) < sizeof(gen_op_add_eip) / sizeof(char *) );
@@ -678,7 +678,7 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
 
     uintptr_t helperFuncAddr;
 
-    if (panda_use_memcb){
+    if (panda_memcb_gen){
         helperFuncAddr = ld ? (uint64_t) qemu_panda_ld_helpers[bits>>4]:
                                (uint64_t) qemu_panda_st_helpers[bits>>4];
     }
@@ -709,7 +709,7 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
     }
 
     char *funcName;
-    if (panda_use_memcb){
+    if (panda_memcb_gen){
         funcName = ld ? qemu_panda_ld_helper_names[bits>>4]:
             qemu_panda_st_helper_names[bits>>4];
     }
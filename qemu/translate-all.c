@@ -89,6 +89,12 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 
     gen_intermediate_code(env, tb);
 
+#ifdef CONFIG_SOFTMMU
+    // Memory instrumentation is decided per TB, now that we know its extent
+    panda_memcb_gen = panda_use_memcb || panda_memcb_tb_may_match(tb);
+    tb->panda_memcb = panda_memcb_gen;
+#endif
+
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
     tb->tb_next_offset[0] = 0xffff;
@@ -151,9 +157,8 @@ int cpu_restore_state(TranslationBlock *tb,
                       CPUState *env, unsigned long searched_pc)
 {
     // PANDA instrumentation: CPU restore state
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_entry *plist;
+    PANDA_CB_FOREACH(plist, PANDA_CB_CPU_RESTORE_STATE) {
         plist->entry.cb_cpu_restore_state(env, tb);
     }
  
@@ -171,6 +176,11 @@ int cpu_restore_state(TranslationBlock *tb,
 
     gen_intermediate_code_pc(env, tb);
 
+#ifdef CONFIG_SOFTMMU
+    // Must regenerate the same host code as cpu_gen_code did
+    panda_memcb_gen = tb->panda_memcb;
+#endif
+
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
         env->icount_decr.u16.low += tb->icount;
@@ -3227,11 +3227,19 @@ int main(int argc, char **argv, char **envp)
                 record_name = optarg;
 	            break;
 
+            case QEMU_OPTION_record_dedup:
+                rr_dedup_payloads = 1;
+                break;
+
             case QEMU_OPTION_replay:
                 display_type = DT_NONE;
                 replay_name = optarg;
                 break;
 
+            case QEMU_OPTION_replay_checkpoints:
+                rr_checkpoint_interval = strtoull(optarg, NULL, 0);
+                break;
+
             case QEMU_OPTION_pandalog:
                 pandalog = 1;
                 pandalog_open(optarg, "w");
@@ -40,7 +40,11 @@ outf.write(RRPACK_MAGIC)
 outf.write(struct.pack("<Q", num_guest_insns))
 outf.write("\0" * 16) # Placeholder for checksum
 outf.flush()
-subprocess.check_call(['tar', 'cJf', '-', base + '-rr-snp', base + '-rr-nondet.log'], stdout=outf)
+files = [base + '-rr-snp', base + '-rr-nondet.log']
+# recordings made with -record-dedup keep device buffers in a payload file
+if os.path.exists(base + '-rr-payload.log'):
+    files.append(base + '-rr-payload.log')
+subprocess.check_call(['tar', 'cJf', '-'] + files, stdout=outf)
 outf.close()
 
 print "Calculating checksum...",
@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Standalone test of bufmon's buffer index; needs no replay.
+
+if [ $# != 1 ]
+then
+    echo "try again with bufmon_index.bash regressiondir"
+    exit 1
+fi
+
+
+regressiondir=$1
+
+source ${HOME}/git/panda/testing/testing.defs
+
+tst=bufmon_index
+
+# this is a fn defined in testing.defs
+set_outputs $tst
+
+src=${pandadir}/qemu/panda_plugins
+tstdir=${testingdir}/tests/${tst}
+work=${outdir}/${tst}
+
+/bin/rm -rf $work $testout
+
+# bufmon.cpp includes ../common and ../callstack_instr, so build a copy
+# of it with the stand-in callstack_instr API next to it
+mkdir -p $work/bufmon $work/common $work/callstack_instr
+cp $src/bufmon/bufmon.cpp $src/bufmon/bufmon_int_fns.h $work/bufmon
+cp $src/common/prog_point.h $src/common/prog_point_map.h $work/common
+cp $tstdir/stubs/callstack_instr_ext.h $work/callstack_instr
+
+g++ -O2 -I$tstdir/stubs -I$work/bufmon -o $work/test_bufmon \
+    $tstdir/test_bufmon.cpp $work/bufmon/bufmon.cpp
+
+cd $work
+./test_bufmon > $testout
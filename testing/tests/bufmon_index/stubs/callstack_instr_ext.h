@@ -0,0 +1,2 @@
+static inline bool init_callstack_instr_api(void) { return true; }
+void get_prog_point(CPUState *env, prog_point *p);
@@ -0,0 +1,2 @@
+// Stand-ins for the QEMU headers bufmon.cpp includes, for
+// test_bufmon.cpp. The target is 32-bit, like i386.
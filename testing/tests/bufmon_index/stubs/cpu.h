@@ -0,0 +1 @@
+typedef struct CPUState CPUState;
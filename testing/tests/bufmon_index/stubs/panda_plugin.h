@@ -0,0 +1,29 @@
+typedef enum panda_cb_type {
+    PANDA_CB_VIRT_MEM_READ,
+    PANDA_CB_VIRT_MEM_WRITE,
+} panda_cb_type;
+
+typedef union panda_cb {
+    int (*virt_mem_read)(CPUState *env, target_ulong pc, target_ulong addr,
+                         target_ulong size, void *buf);
+    int (*virt_mem_write)(CPUState *env, target_ulong pc, target_ulong addr,
+                          target_ulong size, void *buf);
+} panda_cb;
+
+typedef struct panda_memcb_filter {
+    uint64_t addr_start;
+    uint64_t addr_end;
+    target_ulong pc_start;
+    target_ulong pc_end;
+    target_ulong asid;
+    bool match_asid;
+    uint32_t sizes;
+} panda_memcb_filter;
+
+void panda_register_memcb_filtered(void *plugin, panda_cb_type type, panda_cb cb,
+                                   const panda_memcb_filter *filter);
+void panda_update_memcb_filter(void *plugin, panda_cb_type type,
+                               const panda_memcb_filter *filter);
+void panda_enable_plugin(void *plugin);
+void panda_disable_plugin(void *plugin);
+void panda_enable_precise_pc(void);
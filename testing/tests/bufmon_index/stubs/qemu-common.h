@@ -0,0 +1,7 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint32_t target_ulong;
+#define TARGET_FMT_lx "%08x"
@@ -0,0 +1 @@
+uint64_t rr_get_guest_instr_count(void);
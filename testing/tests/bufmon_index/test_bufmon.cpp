@@ -0,0 +1,304 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Checks bufmon's buffer index against a brute-force search over the
+// monitored buffers. bufmon.cpp is built against the stand-ins in stubs/;
+// this file plays PANDA, calling its memory callbacks the way the filter
+// bufmon sets up allows. Prints one line per check; the output is compared
+// with the blessed reference by all.bash.
+
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "panda_plugin.h"
+#include "rr_log.h"
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+void bufmon_add_buffer(target_ulong buf, target_ulong size, target_ulong asid);
+int bufmon_remove_buffer(target_ulong buf, target_ulong asid);
+}
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../common/prog_point.h"
+
+extern FILE *mem_report;
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void) {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+static int failures = 0;
+
+static void report(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) failures++;
+}
+
+// What bufmon gave PANDA
+
+static panda_cb read_cb, write_cb;
+static panda_memcb_filter filter;
+static bool enabled = true;
+
+extern "C" {
+
+void panda_register_memcb_filtered(void *plugin, panda_cb_type type, panda_cb cb,
+                                   const panda_memcb_filter *f) {
+    if (type == PANDA_CB_VIRT_MEM_READ) read_cb = cb;
+    else write_cb = cb;
+    filter = *f;
+}
+
+void panda_update_memcb_filter(void *plugin, panda_cb_type type,
+                               const panda_memcb_filter *f) {
+    filter = *f;
+}
+
+void panda_enable_plugin(void *plugin) { enabled = true; }
+void panda_disable_plugin(void *plugin) { enabled = false; }
+void panda_enable_precise_pc(void) { }
+
+// Each access gets its own instruction count, so a report can't be
+// mistaken for another's
+static uint64_t instr_count = 0;
+
+uint64_t rr_get_guest_instr_count(void) { return instr_count; }
+
+static target_ulong cur_asid;
+
+void get_prog_point(CPUState *env, prog_point *p) {
+    p->caller = 0x1000;
+    p->pc = 0x2000;
+    p->cr3 = cur_asid;
+}
+
+}
+
+// The monitored buffers, as the test sees them
+
+struct buffer { target_ulong start, size, asid; };
+
+static std::vector<buffer> live;
+
+static void add_buf(target_ulong start, target_ulong size, target_ulong asid) {
+    bufmon_add_buffer(start, size, asid);
+    if (size == 0) return;
+    // bufmon keeps the part below the top of memory
+    if ((target_ulong) (start + size - 1) < start) size = -start;
+    buffer b = { start, size, asid };
+    live.push_back(b);
+}
+
+static bool remove_buf(target_ulong start, target_ulong asid) {
+    int n = 0;
+    for (size_t i = 0; i < live.size(); ) {
+        if (live[i].start == start && live[i].asid == asid) {
+            live.erase(live.begin() + i);
+            n++;
+        }
+        else i++;
+    }
+    return bufmon_remove_buffer(start, asid) == n;
+}
+
+// The reports bufmon should have written since the last check
+static std::string expected;
+
+// Makes an access of size bytes at addr (which mustn't wrap) in asid.
+// Returns false if the filter kept out an access that hits a buffer.
+static bool touch(target_ulong addr, target_ulong size, target_ulong asid,
+                  bool is_write) {
+    target_ulong last = addr + size - 1;
+    uint8_t data[8];
+    int hits = 0;
+    for (size_t i = 0; i < live.size(); i++) {
+        const buffer &b = live[i];
+        if (b.asid == asid && b.start <= last && addr <= b.start + b.size - 1) {
+            hits++;
+        }
+    }
+    instr_count++;
+    cur_asid = asid;
+    for (target_ulong i = 0; i < size; i++) data[i] = (uint8_t) (addr + i);
+
+    if (!enabled || (filter.addr_end && (addr >= filter.addr_end ||
+                                         addr + (uint64_t) size <= filter.addr_start))) {
+        return hits == 0;
+    }
+    if (is_write) write_cb.virt_mem_write(NULL, 0, addr, size, data);
+    else read_cb.virt_mem_read(NULL, 0, addr, size, data);
+
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%s %" PRId64 " " TARGET_FMT_lx " "
+                     TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx " "
+                     TARGET_FMT_lx, is_write ? "WRITE" : "READ", instr_count,
+                     0x1000, 0x2000, asid, addr, size);
+    for (target_ulong i = 0; i < size; i++) {
+        n += snprintf(line + n, sizeof(line) - n, " %02x", data[i]);
+    }
+    snprintf(line + n, sizeof(line) - n, "\n");
+    for (int i = 0; i < hits; i++) expected += line;
+    return true;
+}
+
+// Compares what bufmon wrote with the expected reports, then starts both
+// afresh
+static bool taps_match(void) {
+    std::string got;
+    char buf[4096];
+    size_t n;
+    fflush(mem_report);
+    FILE *f = fopen("buffer_taps.txt", "r");
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) got.append(buf, n);
+    fclose(f);
+    bool ok = got == expected;
+    if (ftruncate(fileno(mem_report), 0) != 0) ok = false;
+    rewind(mem_report);
+    expected.clear();
+    return ok;
+}
+
+static bool filter_covers_buffers(void) {
+    if (live.empty()) {
+        return !enabled && filter.addr_start == 0 && filter.addr_end == 1;
+    }
+    for (size_t i = 0; i < live.size(); i++) {
+        if (live[i].start < filter.addr_start ||
+            live[i].start + (uint64_t) live[i].size > filter.addr_end) {
+            return false;
+        }
+    }
+    return enabled;
+}
+
+static bool remove_all(void) {
+    bool ok = true;
+    while (!live.empty()) ok = remove_buf(live[0].start, live[0].asid) && ok;
+    return ok;
+}
+
+// Every access of every size near the edges of buffers that end at, start
+// at and straddle page boundaries, in the buffers' asid and another one
+static void test_page_boundaries(void) {
+    bool ok = true;
+    add_buf(0x10ff8, 0x10, 1);      // straddles 0x11000
+    add_buf(0x12000, 1, 1);         // first byte of a page
+    add_buf(0x12fff, 1, 1);         // last byte of a page
+    add_buf(0x14ffc, 0x2008, 1);    // three pages
+    add_buf(0x10ff8, 0x10, 2);      // same range, other asid
+    ok = filter_covers_buffers() && ok;
+    static const target_ulong around[] = { 0x11000, 0x12000, 0x13000, 0x15000, 0x17000 };
+    for (unsigned i = 0; i < sizeof(around) / sizeof(around[0]); i++) {
+        for (target_ulong a = around[i] - 0x10; a < around[i] + 0x10; a++) {
+            for (target_ulong size = 1; size <= 8; size *= 2) {
+                for (target_ulong asid = 1; asid <= 3; asid++) {
+                    ok = touch(a, size, asid, a & 1) && ok;
+                }
+            }
+        }
+    }
+    ok = remove_all() && ok;
+    ok = filter_covers_buffers() && ok;
+    report("page boundaries", ok && taps_match());
+}
+
+// Buffers whose end is past the top of memory keep the part below it
+static void test_wraparound(void) {
+    bool ok = true;
+    add_buf(0xfffff000, 0x2000, 1);
+    add_buf(0xffffffff, 1, 1);
+    add_buf(0xfffffffc, 0x10, 2);
+    ok = filter_covers_buffers() && filter.addr_end == 0x100000000ULL && ok;
+    for (target_ulong size = 1; size <= 8; size *= 2) {
+        for (uint64_t a = 0xfffff000 - 0x10; a < 0xfffff000 + 0x10; a++) {
+            ok = touch(a, size, 1, false) && touch(a, size, 2, true) && ok;
+        }
+        for (uint64_t a = 0xffffffe0; a + size <= 0x100000000ULL; a++) {
+            ok = touch(a, size, 1, false) && touch(a, size, 2, true) && ok;
+        }
+        // nothing wrapped to the bottom of memory
+        ok = touch(0, size, 1, false) && touch(0, size, 2, false) && ok;
+    }
+    ok = remove_all() && ok;
+    ok = filter_covers_buffers() && ok;
+    report("wraparound", ok && taps_match());
+}
+
+// Removing a buffer frees its id for the next one; a buffer added again
+// must be reported once, not once per time it was added
+static void test_readd(void) {
+    bool ok = true;
+    for (int round = 0; round < 3; round++) {
+        add_buf(0x20ff0, 0x20, 1);
+        ok = touch(0x20ffe, 4, 1, true) && touch(0x21000, 8, 1, false) && ok;
+        ok = remove_buf(0x20ff0, 1) && ok;
+        ok = touch(0x20ffe, 4, 1, true) && ok;
+        // gone already
+        ok = remove_buf(0x20ff0, 1) && ok;
+    }
+    // two buffers at one address are both removed
+    add_buf(0x30000, 0x10, 1);
+    add_buf(0x30000, 0x2000, 1);
+    add_buf(0x30008, 0x10, 1);
+    ok = touch(0x3000c, 4, 1, false) && ok;
+    ok = remove_buf(0x30000, 1) && ok;
+    ok = touch(0x3000c, 4, 1, false) && touch(0x31000, 4, 1, false) && ok;
+    add_buf(0x30000, 0x2000, 1);
+    ok = touch(0x31000, 4, 1, false) && ok;
+    ok = remove_all() && ok;
+    ok = filter_covers_buffers() && ok;
+    report("re-added buffers", ok && taps_match());
+}
+
+// Random adds, removes and accesses, some buffers many pages long
+static void test_random(void) {
+    bool ok = true;
+    for (int i = 0; i < 200000; i++) {
+        unsigned op = rng() % 10;
+        if (op < 2) {
+            target_ulong size = 1 + rng() % (rng() % 8 == 0 ? 20000 : 300);
+            add_buf(rng() % 0x40000, size, rng() % 3);
+        }
+        else if (op < 3 && !live.empty()) {
+            const buffer &b = live[rng() % live.size()];
+            ok = remove_buf(b.start, b.asid) && ok;
+        }
+        else {
+            target_ulong size = 1 << (rng() % 4);
+            ok = touch(rng() % 0x42000, size, rng() % 3, rng() % 2) && ok;
+        }
+        if (i % 1000 == 0) ok = filter_covers_buffers() && ok;
+    }
+    ok = remove_all() && ok;
+    ok = filter_covers_buffers() && ok;
+    report("random operations", ok && taps_match());
+}
+
+int main(void) {
+    if (!init_plugin((void *) 1)) {
+        printf("init_plugin failed\n");
+        return 1;
+    }
+    report("no buffers, no callbacks", filter_covers_buffers());
+    test_page_boundaries();
+    test_wraparound();
+    test_readd();
+    test_random();
+    uninit_plugin((void *) 1);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Standalone test of memstrings' batched string scan; needs no replay.
+
+if [ $# != 1 ]
+then
+    echo "try again with memstrings_batch.bash regressiondir"
+    exit 1
+fi
+
+
+regressiondir=$1
+
+source ${HOME}/git/panda/testing/testing.defs
+
+tst=memstrings_batch
+
+# this is a fn defined in testing.defs
+set_outputs $tst
+
+src=${pandadir}/qemu/panda_plugins
+tstdir=${testingdir}/tests/${tst}
+work=${outdir}/${tst}
+
+/bin/rm -rf $work $testout
+
+# memstrings.cpp includes ../common, so build a copy of it next to one
+mkdir -p $work/memstrings $work/common
+cp $src/memstrings/memstrings.cpp $work/memstrings
+cp $src/common/prog_point.h $src/common/prog_point_map.h $work/common
+
+g++ -O2 -I$tstdir/stubs -o $work/test_memstrings \
+    $tstdir/test_memstrings.cpp $work/memstrings/memstrings.cpp -lz
+
+# memstrings writes its report to the current directory
+cd $work
+./test_memstrings > $testout
@@ -0,0 +1,2 @@
+// Stand-ins for the QEMU headers memstrings.cpp includes, for
+// test_memstrings.cpp. The target is 32-bit, like i386.
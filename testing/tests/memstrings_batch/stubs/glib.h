@@ -0,0 +1,35 @@
+// Just what memstrings uses: UTF-16LE to UTF-8, one code unit at a time
+#include <stdlib.h>
+
+typedef char gchar;
+typedef size_t gsize;
+
+static inline gchar *g_convert(const gchar *str, long len, const gchar *to,
+                               const gchar *from, gsize *bytes_read,
+                               gsize *bytes_written, void *error) {
+    const unsigned char *s = (const unsigned char *) str;
+    gchar *out = (gchar *) malloc(len / 2 * 3 + 1);
+    gsize n = 0;
+    for (long i = 0; i + 1 < len; i += 2) {
+        unsigned u = s[i] | (s[i+1] << 8);
+        if (u < 0x80) {
+            out[n++] = u;
+        }
+        else if (u < 0x800) {
+            out[n++] = 0xc0 | (u >> 6);
+            out[n++] = 0x80 | (u & 0x3f);
+        }
+        else {
+            out[n++] = 0xe0 | (u >> 12);
+            out[n++] = 0x80 | ((u >> 6) & 0x3f);
+            out[n++] = 0x80 | (u & 0x3f);
+        }
+    }
+    out[n] = 0;
+    *bytes_written = n;
+    return out;
+}
+
+static inline void g_free(void *p) {
+    free(p);
+}
@@ -0,0 +1,32 @@
+typedef enum panda_cb_type {
+    PANDA_CB_MEM_BATCH,
+} panda_cb_type;
+
+typedef struct panda_mem_access {
+    target_ulong pc;
+    target_ulong vaddr;
+    target_phys_addr_t paddr;
+    uint64_t value;         // zero-extended
+    uint8_t size;
+    uint8_t is_write;
+} panda_mem_access;
+
+typedef union panda_cb {
+    int (*mem_batch)(CPUState *env, const panda_mem_access *acc, size_t n);
+} panda_cb;
+
+typedef struct panda_arg_list panda_arg_list;
+
+panda_arg_list *panda_get_args(const char *plugin_name);
+const char *panda_parse_string(panda_arg_list *args, const char *argname, const char *defval);
+target_ulong panda_parse_ulong(panda_arg_list *args, const char *argname, target_ulong defval);
+
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
+void panda_enable_precise_pc(void);
+void panda_enable_memcb(void);
+
+#define PANDA_WORK_SERIAL (1 << 0)
+typedef void (*panda_work_fn)(void *payload);
+void panda_work_submit(void *plugin, panda_work_fn fn, void *payload,
+                       panda_work_fn free_fn, int flags);
+void panda_work_flush(void *plugin);
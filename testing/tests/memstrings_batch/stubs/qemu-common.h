@@ -0,0 +1,9 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+typedef uint32_t target_ulong;
+typedef uint64_t target_phys_addr_t;
+#define TARGET_FMT_lx "%08x"
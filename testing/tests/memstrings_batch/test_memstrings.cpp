@@ -0,0 +1,287 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Checks that memstrings, which scans a block's accesses a batch at a
+// time, finds the same strings as scanning each access on its own, the
+// way the plugin did with the per-access memory callbacks. memstrings.cpp
+// is built against the stand-ins in stubs/; this file plays PANDA. Prints
+// one line per check; the output is compared with the blessed reference
+// by all.bash.
+
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "panda_plugin.h"
+#include "rr_log.h"
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+}
+
+#include <ctype.h>
+#include <wctype.h>
+#include <zlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void) {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+static int failures = 0;
+
+static void report(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) failures++;
+}
+
+// What memstrings gave PANDA
+
+static panda_cb batch_cb;
+
+// Every access of a batch gets the batch's instruction count, as they
+// would at the end of a block
+static uint64_t instr_count = 0;
+
+// Queued until a flush, so that memstrings' limit on buffers in flight
+// comes into play
+struct work {
+    panda_work_fn fn, free_fn;
+    void *payload;
+};
+
+static std::vector<work> queued;
+
+extern "C" {
+
+panda_arg_list *panda_get_args(const char *plugin_name) { return NULL; }
+
+const char *panda_parse_string(panda_arg_list *args, const char *argname,
+                               const char *defval) {
+    return defval;
+}
+
+target_ulong panda_parse_ulong(panda_arg_list *args, const char *argname,
+                               target_ulong defval) {
+    return defval;
+}
+
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
+    batch_cb = cb;
+}
+
+void panda_enable_precise_pc(void) { }
+void panda_enable_memcb(void) { }
+
+uint64_t rr_get_guest_instr_count(void) { return instr_count; }
+
+void panda_work_submit(void *plugin, panda_work_fn fn, void *payload,
+                       panda_work_fn free_fn, int flags) {
+    work w = { fn, free_fn, payload };
+    queued.push_back(w);
+}
+
+void panda_work_flush(void *plugin) {
+    for (size_t i = 0; i < queued.size(); i++) {
+        queued[i].fn(queued[i].payload);
+        if (queued[i].free_fn) queued[i].free_fn(queued[i].payload);
+    }
+    queued.clear();
+}
+
+}
+
+// The per-access scan memstrings must agree with. Same length limits
+// (256 with the terminator, 4 at least) and same report lines.
+
+#define MAX_STRLEN 256
+#define MIN_STRLEN 4
+
+struct ref_strings {
+    std::string a;
+    std::vector<uint16_t> u;
+};
+
+static std::map<target_ulong, ref_strings> ref_read, ref_write;
+static std::vector<std::string> ref_lines;
+
+static void ref_emit(const std::string &s) {
+    char count[32];
+    snprintf(count, sizeof(count), "%" PRIu64 ":", instr_count);
+    ref_lines.push_back(count + s);
+}
+
+static void ref_emit_utf16(const std::vector<uint16_t> &u) {
+    std::string bytes;
+    for (size_t i = 0; i < u.size(); i++) {
+        bytes += (char) (u[i] & 0xff);
+        bytes += (char) (u[i] >> 8);
+    }
+    gsize n = 0;
+    gchar *s = g_convert(bytes.data(), bytes.size(), "UTF-8", "UTF-16LE",
+                         NULL, &n, NULL);
+    ref_emit(std::string(s, n));
+    g_free(s);
+}
+
+static void ref_access(const panda_mem_access &a) {
+    ref_strings &rs = a.is_write ? ref_write[a.pc] : ref_read[a.pc];
+    uint8_t buf[8];
+    for (unsigned i = 0; i < a.size; i++) buf[i] = a.value >> (8 * i);
+
+    for (unsigned i = 0; i < a.size; i++) {
+        if (isprint(buf[i])) {
+            rs.a += (char) buf[i];
+            if (rs.a.size() == MAX_STRLEN - 1) {
+                ref_emit(rs.a);
+                rs.a.clear();
+            }
+        }
+        else {
+            if (rs.a.size() >= MIN_STRLEN) ref_emit(rs.a);
+            rs.a.clear();
+        }
+    }
+
+    if (a.size < 2) return;
+    for (unsigned i = 0; i < a.size; i += 2) {
+        uint16_t val = buf[i] | (buf[i+1] << 8);
+        if (iswprint(val)) {
+            rs.u.push_back(val);
+            if (rs.u.size() == MAX_STRLEN - 1) {
+                ref_emit_utf16(rs.u);
+                rs.u.clear();
+            }
+        }
+        else {
+            if (rs.u.size() >= MIN_STRLEN) ref_emit_utf16(rs.u);
+            rs.u.clear();
+        }
+    }
+}
+
+static void ref_finish(void) {
+    for (int w = 0; w < 2; w++) {
+        std::map<target_ulong, ref_strings> &m = w ? ref_write : ref_read;
+        std::map<target_ulong, ref_strings>::iterator it;
+        for (it = m.begin(); it != m.end(); ++it) {
+            if (it->second.a.size() > MIN_STRLEN) ref_emit(it->second.a);
+            if (it->second.u.size() > MIN_STRLEN) ref_emit_utf16(it->second.u);
+        }
+    }
+}
+
+// Random accesses
+
+static uint8_t random_byte(int kind, unsigned k) {
+    static const uint16_t wide[] = { 0x00e9, 0x4e2d, 0x0416, 0xd800, 0xfffe, 0x007f };
+    switch (kind) {
+    case 0: return rng();                                       // anything
+    case 1: return 0x20 + rng() % 95;                           // ASCII
+    case 2: return (k % 2) ? 0 : 0x20 + rng() % 95;             // UTF-16 ASCII
+    case 3: {                                                   // UTF-16 other
+        uint16_t u = rng() % 4 ? 0x61 + rng() % 26 : wide[rng() % 6];
+        return (k % 2) ? u >> 8 : u & 0xff;
+    }
+    default: return (rng() % 10) ? 0x41 + rng() % 26 : 0;       // short strings
+    }
+}
+
+static panda_mem_access random_access(target_ulong pc, bool is_write, int kind) {
+    panda_mem_access a;
+    memset(&a, 0, sizeof(a));
+    a.pc = pc;
+    a.is_write = is_write;
+    a.size = 1 << (rng() % 4);
+    for (unsigned k = 0; k < a.size; k++) {
+        a.value |= (uint64_t) random_byte(kind, k) << (8 * k);
+    }
+    return a;
+}
+
+static void run_batch(const std::vector<panda_mem_access> &batch) {
+    instr_count++;
+    for (size_t i = 0; i < batch.size(); i++) ref_access(batch[i]);
+    batch_cb.mem_batch(NULL, batch.data(), batch.size());
+}
+
+static std::vector<std::string> read_report(const char *path) {
+    std::vector<std::string> lines;
+    std::string cur;
+    char buf[4096];
+    int n;
+    gzFile f = gzopen(path, "r");
+    if (!f) return lines;
+    while ((n = gzread(f, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                lines.push_back(cur);
+                cur.clear();
+            }
+            else cur += buf[i];
+        }
+    }
+    gzclose(f);
+    return lines;
+}
+
+int main(void) {
+    if (!init_plugin((void *) 1)) {
+        printf("init_plugin failed\n");
+        return 1;
+    }
+
+    std::vector<panda_mem_access> batch;
+    for (int blk = 0; blk < 100000; blk++) {
+        batch.clear();
+        if (blk % 1000 == 0) {
+            // a long copy loop: strings longer than MAX_STRLEN, and more
+            // bytes than memstrings gathers at once
+            target_ulong pc = rng() % 6;
+            for (int i = 0; i < 700; i++) {
+                panda_mem_access a = random_access(pc, true, 1 + rng() % 2);
+                a.size = 8;
+                a.value |= (uint64_t) random_byte(1, 7) << 56;
+                batch.push_back(a);
+            }
+        }
+        int n = 1 + rng() % 40;
+        target_ulong pc = rng() % 6;
+        bool is_write = rng() % 2;
+        int kind = rng() % 5;
+        for (int i = 0; i < n; i++) {
+            if (rng() % 5 == 0) {
+                pc = rng() % 6;
+                is_write = rng() % 2;
+                kind = rng() % 5;
+            }
+            batch.push_back(random_access(pc, is_write, kind));
+        }
+        run_batch(batch);
+    }
+    uninit_plugin((void *) 1);
+    ref_finish();
+
+    // Within a batch, strings at different pcs or of different kinds may
+    // come out in another order, and the ones left at the end in any
+    // order; every line carries its batch's instruction count
+    std::vector<std::string> got = read_report("memstrings_strings.txt.gz");
+    std::sort(got.begin(), got.end());
+    std::sort(ref_lines.begin(), ref_lines.end());
+    report("strings found", ref_lines.size() > 100000);
+    report("same strings as per-access scan", got == ref_lines);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+# 
+
+if [ $# != 1 ]
+then
+    echo "try again with stringsearch1.bash regressiondir"
+    exit 1
+fi
+
+
+regressiondir=$1  
+
+source ${HOME}/git/panda/testing/testing.defs
+
+tst=stringsearch1
+
+# this is a fn defined in testing.defs
+set_outputs $tst
+
+
+# stringsearch reads ${tst}_search_strings.txt and writes
+# ${tst}_string_matches.txt, both in the current directory
+searchstrings=./${tst}_search_strings.txt
+matches=./${tst}_string_matches.txt
+
+# delete matches because we want to make sure that this run creates them
+/bin/rm -f $matches
+
+# one pattern of each kind: plain string, hex with wildcards, and a
+# regular expression with flags, so both automata get exercised
+cat > $searchstrings <<'STRINGS'
+"GNU"
+7f 45 4c 46 ?? 01
+"linux"iwa
+/lib[a-z]+\.so/
+STRINGS
+
+# run qemu with stringsearch
+${testingdir}/runqemu.bash i386 ${replaydir}/NotExploitable/notexploitable -panda "callstack_instr;stringsearch:name=${tst}"
+
+# the matches are the complete test output
+/bin/mv $matches $testout
+/bin/rm -f $searchstrings
@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Standalone test of the stringsearch pattern compiler; needs no replay.
+
+if [ $# != 1 ]
+then
+    echo "try again with stringsearch_patterns.bash regressiondir"
+    exit 1
+fi
+
+
+regressiondir=$1
+
+source ${HOME}/git/panda/testing/testing.defs
+
+tst=stringsearch_patterns
+
+# this is a fn defined in testing.defs
+set_outputs $tst
+
+src=${pandadir}/qemu/panda_plugins/stringsearch
+bin=${outdir}/${tst}
+
+/bin/rm -f $bin $testout
+
+g++ -O2 -I$src -o $bin ${testingdir}/tests/${tst}/test_patterns.cpp $src/patterns.cpp
+
+$bin > $testout
@@ -0,0 +1,292 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Checks the stringsearch pattern compiler (patterns.cpp) against a
+// brute-force matcher. Prints one line per check; the output is compared
+// with the blessed reference by all.bash.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "patterns.h"
+
+typedef std::set<std::pair<size_t,uint32_t> > match_set;
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void) {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+// (end offset, pattern id) of every match the automaton reports
+static match_set run(const search_automaton &a, const std::string &buf) {
+    match_set r;
+    uint32_t s = 0;
+    for (size_t i = 0; i < buf.size(); i++) {
+        s = a.step(s, buf[i]);
+        for (uint32_t k = a.out[s]; k < a.out[s+1]; k++) {
+            r.insert(std::make_pair(i, a.ids[k]));
+        }
+    }
+    return r;
+}
+
+static int failures = 0;
+
+static void report(const char *name, bool ok) {
+    printf("%s: %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) failures++;
+}
+
+// Literal keys that between them use every byte value. With one class per
+// byte there is no spare class for "other bytes", which the class map
+// must not overflow into.
+static void test_all_bytes(void) {
+    pattern_set ps;
+    std::vector<std::string> keys;
+    for (unsigned i = 0; i < 300; i++) {
+        std::string k;
+        unsigned n = 2 + rng() % 4;
+        for (unsigned j = 0; j < n; j++) k += (char) (j == 0 ? i & 0xff : rng() & 0xff);
+        keys.push_back(k);
+        ps.add_literal(k);
+    }
+    search_automaton a;
+    std::string err;
+    bool ok = ps.compile(a, 1000000, err);
+    ok = ok && a.nclasses == 256;
+
+    std::string buf;
+    for (unsigned i = 0; i < 100000; i++) {
+        // plant keys often enough that most of them match somewhere
+        if (rng() % 8 == 0) buf += keys[rng() % keys.size()];
+        else buf += (char) (rng() & 0xff);
+    }
+    match_set want;
+    for (uint32_t k = 0; k < keys.size(); k++) {
+        for (size_t p = 0; p + keys[k].size() <= buf.size(); p++) {
+            if (!buf.compare(p, keys[k].size(), keys[k])) {
+                want.insert(std::make_pair(p + keys[k].size() - 1, k));
+            }
+        }
+    }
+    report("all 256 byte values", ok && run(a, buf) == want);
+}
+
+// Brute-force membership tests, one per pattern below, written out by
+// hand so they don't share any code with the parser.
+static bool eq_nocase(const std::string &s, const char *lit) {
+    if (s.size() != strlen(lit)) return false;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (tolower((unsigned char) s[i]) != tolower((unsigned char) lit[i])) return false;
+    }
+    return true;
+}
+
+static std::string narrow(const std::string &s) {
+    // the UTF-16LE form of an ASCII string, back to ASCII; "" if it isn't one
+    std::string r;
+    if (s.size() % 2) return "";
+    for (size_t i = 0; i < s.size(); i += 2) {
+        if (s[i+1] != 0) return "";
+        r += s[i];
+    }
+    return r;
+}
+
+#define B(i) ((uint8_t) s[i])
+
+static bool m_literal(const std::string &s) { return s == "password"; }
+static bool m_any(const std::string &s) {
+    return s.size() == 6 && B(0) == 0x4d && B(1) == 0x5a && B(4) == 0x50 && B(5) == 0x45;
+}
+static bool m_nibble(const std::string &s) {
+    return s.size() == 2 && (B(0) >> 4) == 0x4 && (B(1) & 0xf) == 0xd;
+}
+static bool m_class(const std::string &s) {
+    return s.size() == 2 && ((B(0) >= 0x30 && B(0) <= 0x39) || B(0) == 0x41) && B(1) != 0;
+}
+static bool m_repeat(const std::string &s) {
+    return s.size() >= 3 && s.size() <= 5 && B(0) == 0xaa && B(s.size()-1) == 0xbb;
+}
+static bool m_group(const std::string &s) {
+    return s == std::string("\xe8\x00\x00", 3) || s == std::string("\xff\x15\x00\x00", 4);
+}
+static bool m_open_repeat(const std::string &s) {
+    if (s.size() < 3 || B(0) != 'x' || B(s.size()-1) != 'y') return false;
+    for (size_t i = 1; i + 1 < s.size(); i++) if (B(i) != 'a') return false;
+    return true;
+}
+static bool m_nocase(const std::string &s) { return eq_nocase(s, "key"); }
+static bool m_wide(const std::string &s) { return narrow(s) == "ab"; }
+static bool m_wide_ascii(const std::string &s) { return s == "ab" || narrow(s) == "ab"; }
+static bool m_all_flags(const std::string &s) {
+    return eq_nocase(s, "hi") || (!narrow(s).empty() && eq_nocase(narrow(s), "hi"));
+}
+static bool m_regex(const std::string &s) {
+    if (s.size() < 4 || s.size() > 5 || s[0] != 'x' || s[s.size()-1] != 'y') return false;
+    for (size_t i = 1; i + 1 < s.size(); i++) if (s[i] < 'a' || s[i] > 'c') return false;
+    return true;
+}
+static bool m_regex_nocase(const std::string &s) {
+    return eq_nocase(s, "ac") || eq_nocase(s, "abc");
+}
+static bool m_digits(const std::string &s) {
+    return s.size() == 3 && isdigit(B(0)) && isdigit(B(1)) && isdigit(B(2));
+}
+
+#undef B
+
+static const struct {
+    const char *text;
+    bool (*match)(const std::string &s);
+    unsigned maxlen;    // longest string the pattern matches; 0 if unbounded
+} cases[] = {
+    { "\"password\"", m_literal, 8 },
+    { "4d 5a ?? ?? 50 45", m_any, 6 },
+    { "4? ?d", m_nibble, 2 },
+    { "[30-39, 41] [^00]", m_class, 2 },
+    { "aa ??{1,3} bb", m_repeat, 5 },
+    { "(e8 | ff 15) 00{2}", m_group, 4 },
+    { "/xa{1,}y/", m_open_repeat, 0 },
+    { "\"key\"i", m_nocase, 3 },
+    { "\"ab\"w", m_wide, 4 },
+    { "\"ab\"wa", m_wide_ascii, 4 },
+    { "\"hi\"iwa", m_all_flags, 4 },
+    { "/x[a-c]{2,3}y/", m_regex, 5 },
+    { "/ab?c/i", m_regex_nocase, 3 },
+    { "/\\d{3}/", m_digits, 3 },
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+// Bytes the patterns care about, and bits of matches to plant among them
+static const char alphabet[] = "\x00\x15\x45\x4d\x50\x5a\xaa\xbb\xe8\xff"
+    "\x3d\x4f\xfd" "059A" "abcxyHhIiKkEeYwWdoprs";
+#define SNIPPET(s) { s, sizeof(s) - 1 }
+static const struct {
+    const char *bytes;
+    size_t len;
+} snippets[] = {
+    SNIPPET("password"), SNIPPET("PassWord"), SNIPPET("passwor"),
+    SNIPPET("MZ\x90\0PE"), SNIPPET("MZ"), SNIPPET("PE"),
+    SNIPPET("k\0e\0y\0"), SNIPPET("h\0I\0"), SNIPPET("a\0b\0"),
+    SNIPPET("xaaay"), SNIPPET("xabcy"), SNIPPET("xaaaaaaay"),
+    SNIPPET("\xaa\x01\x02\x03\xbb"), SNIPPET("\xff\x15\x00\x00"),
+};
+#undef SNIPPET
+
+static std::string random_buffer(size_t n) {
+    std::string buf;
+    while (buf.size() < n) {
+        if (rng() % 16 == 0) {
+            unsigned i = rng() % (sizeof(snippets) / sizeof(snippets[0]));
+            buf.append(snippets[i].bytes, snippets[i].len);
+        }
+        else {
+            buf += alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+    }
+    return buf;
+}
+
+// every (end, id) at which the substring matches, by brute force
+static match_set brute_force(const std::vector<unsigned> &which, const std::string &buf) {
+    match_set r;
+    for (size_t k = 0; k < which.size(); k++) {
+        unsigned maxlen = cases[which[k]].maxlen ? cases[which[k]].maxlen : buf.size();
+        for (size_t e = 1; e <= buf.size(); e++) {
+            for (size_t len = 1; len <= maxlen && len <= e; len++) {
+                if (cases[which[k]].match(buf.substr(e - len, len))) {
+                    r.insert(std::make_pair(e - 1, (uint32_t) k));
+                }
+            }
+        }
+    }
+    return r;
+}
+
+static bool check(const std::vector<unsigned> &which, unsigned rounds) {
+    pattern_set ps;
+    std::string err;
+    for (size_t k = 0; k < which.size(); k++) {
+        if (!ps.add(cases[which[k]].text, err)) {
+            printf("  %s: %s\n", cases[which[k]].text, err.c_str());
+            return false;
+        }
+    }
+    search_automaton a;
+    if (!ps.compile(a, 200000, err)) {
+        printf("  compile: %s\n", err.c_str());
+        return false;
+    }
+    size_t matches = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+        std::string buf = random_buffer(400);
+        match_set want = brute_force(which, buf);
+        if (run(a, buf) != want) return false;
+        matches += want.size();
+    }
+    // a pattern that never matched wasn't tested
+    return matches > 0;
+}
+
+static void test_each_pattern(void) {
+    for (unsigned i = 0; i < NCASES; i++) {
+        std::vector<unsigned> which(1, i);
+        char name[128];
+        snprintf(name, sizeof(name), "pattern %s", cases[i].text);
+        report(name, check(which, 50));
+    }
+}
+
+static void test_pattern_set(void) {
+    std::vector<unsigned> all;
+    for (unsigned i = 0; i < NCASES; i++) all.push_back(i);
+    report("all patterns in one automaton", check(all, 50));
+}
+
+static void test_bad_patterns(void) {
+    static const char *bad[] = {
+        "", "\"abc", "\"\"", "/a*/", "/(ab/", "/[ab/", "/a{3,1}/", "/ab/q",
+        "4g", "(4d 5a", "4d 5a)", "??{0,2}", "[50-40]",
+    };
+    bool ok = true;
+    for (unsigned i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        pattern_set ps;
+        std::string err;
+        if (ps.add(bad[i], err)) {
+            printf("  accepted %s\n", bad[i]);
+            ok = false;
+        }
+    }
+    report("bad patterns rejected", ok);
+}
+
+static void test_max_states(void) {
+    pattern_set ps;
+    std::string err;
+    search_automaton a;
+    bool ok = ps.add("/a.{20}b/", err) && !ps.compile(a, 1000, err);
+    report("max_states enforced", ok);
+}
+
+int main(void) {
+    test_all_bytes();
+    test_each_pattern();
+    test_pattern_set();
+    test_bad_patterns();
+    test_max_states();
+    printf("%d failures\n", failures);
+    return failures != 0;
+}